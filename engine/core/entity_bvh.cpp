@@ -0,0 +1,418 @@
+#include "entity_bvh.hpp"
+#include "scene.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+namespace sdf_editor
+{
+
+void Entity_bvh::update_hierarchy(const Scene_graph& graph, const std::vector<Entity>& roots, size_t first_root, const std::vector<uint32_t>& released_slots)
+{
+    m_slot_leaves.resize(graph.slot_nodes.size(), no_node);
+    auto remove = [this](uint32_t leaf) {
+        remove_leaf(leaf);
+        m_slot_leaves[m_nodes[leaf].slot] = no_node;
+        free_node(leaf);
+        m_leaf_count--;
+    };
+    for (uint32_t slot : released_slots) {
+        if (slot < m_slot_leaves.size() && m_slot_leaves[slot] != no_node) {
+            remove(m_slot_leaves[slot]);
+        }
+    }
+
+    // Parents come before their children, so the root of a node is known when it is reached
+    std::vector<size_t> root_ids(graph.size());
+    std::vector<uint32_t> added;
+    m_leaves.assign(graph.size(), no_node);
+    for (uint32_t id = 0u; id < graph.size(); id++) {
+        uint32_t parent = graph.parents[id];
+        root_ids[id] = parent == Scene_graph::no_parent ? static_cast<size_t>(graph.entities[id] - roots.data()) : root_ids[parent];
+        uint32_t slot = graph.handles[id].slot;
+        uint32_t leaf = m_slot_leaves[slot];
+        if (root_ids[id] < first_root) {
+            if (leaf != no_node) {
+                remove(leaf);
+            }
+            continue;
+        }
+        if (leaf == no_node) {
+            leaf = allocate_node();
+            m_nodes[leaf].box = fat_box(node_box(graph, id));
+            m_nodes[leaf].slot = slot;
+            m_slot_leaves[slot] = leaf;
+            added.push_back(leaf);
+            m_leaf_count++;
+        }
+        m_nodes[leaf].graph_node = id;
+        m_leaves[id] = leaf;
+    }
+
+    // A build is faster than inserting most of the leaves one by one
+    if (2u * added.size() > m_leaf_count) {
+        rebuild(graph);
+        return;
+    }
+    for (uint32_t leaf : added) {
+        insert_leaf(leaf);
+    }
+}
+
+void Entity_bvh::refit(const Scene_graph& graph)
+{
+    if (m_root == no_node || m_leaves.size() != graph.size()) {
+        return;
+    }
+    m_moved.clear();
+    for (size_t word_id = 0u; word_id < graph.changed.word_count(); word_id++) {
+        for (uint64_t bits = graph.changed.word(word_id); bits != 0u; bits &= bits - 1u) {
+            auto id = static_cast<uint32_t>(word_id * 64u + static_cast<size_t>(std::countr_zero(bits)));
+            uint32_t leaf = m_leaves[id];
+            if (leaf == no_node) {
+                continue;
+            }
+            Box box = node_box(graph, id);
+            if (!contains(m_nodes[leaf].box, box)) {
+                m_nodes[leaf].box = fat_box(box);
+                m_moved.push_back(leaf);
+            }
+        }
+    }
+    if (m_moved.empty()) {
+        return;
+    }
+
+    if (static_cast<float>(m_moved.size()) <= max_reinserted_ratio * static_cast<float>(m_leaf_count)) {
+        for (uint32_t leaf : m_moved) {
+            remove_leaf(leaf);
+            insert_leaf(leaf);
+        }
+        m_reinsertions += m_moved.size();
+        return;
+    }
+    // Like when the whole scene moves, the tree keeps its quality unless the nodes moved apart
+    if (refit_subtree(m_root) > rebuild_ratio * m_built_area) {
+        rebuild(graph);
+    }
+}
+
+uint32_t Entity_bvh::nearest(const glm::vec3& point, const Distance_function& distance) const
+{
+    uint32_t best = no_node;
+    float best_distance = std::numeric_limits<float>::infinity();
+    if (m_root == no_node) {
+        return best;
+    }
+    std::vector<uint32_t> stack{ m_root };
+    while (!stack.empty()) {
+        const Node& node = m_nodes[stack.back()];
+        stack.pop_back();
+        if (glm::any(glm::lessThan(point, node.box.min)) || glm::any(glm::greaterThan(point, node.box.max))) {
+            continue;
+        }
+        if (node.leaf()) {
+            float node_distance = distance(node.graph_node);
+            if (node_distance < best_distance) {
+                best = node.graph_node;
+                best_distance = node_distance;
+            }
+            continue;
+        }
+        stack.push_back(node.children[1]);
+        stack.push_back(node.children[0]);
+    }
+    return best;
+}
+
+uint32_t Entity_bvh::nearest_on_line(const glm::vec3& origin, const glm::vec3& direction, const Distance_function& distance) const
+{
+    uint32_t best = no_node;
+    float best_distance = std::numeric_limits<float>::infinity();
+    if (m_root == no_node) {
+        return best;
+    }
+    // Slabs test, the closest point of the box along the line, infinity if the line misses it
+    glm::vec3 inverse_direction = 1.0f / glm::normalize(direction);
+    auto line_distance = [&origin, &inverse_direction](const Box& box) {
+        glm::vec3 t0 = (box.min - origin) * inverse_direction;
+        glm::vec3 t1 = (box.max - origin) * inverse_direction;
+        glm::vec3 t_min = glm::min(t0, t1);
+        glm::vec3 t_max = glm::max(t0, t1);
+        float enter = std::max({ t_min.x, t_min.y, t_min.z });
+        float exit = std::min({ t_max.x, t_max.y, t_max.z });
+        if (!(enter <= exit)) {
+            return std::numeric_limits<float>::infinity();
+        }
+        if (enter <= 0.0f && exit >= 0.0f) {
+            return 0.0f;
+        }
+        return std::min(std::abs(enter), std::abs(exit));
+    };
+
+    std::vector<uint32_t> stack{ m_root };
+    while (!stack.empty()) {
+        const Node& node = m_nodes[stack.back()];
+        stack.pop_back();
+        if (!(line_distance(node.box) < best_distance)) {
+            continue;
+        }
+        if (node.leaf()) {
+            float node_distance = distance(node.graph_node);
+            if (node_distance < best_distance) {
+                best = node.graph_node;
+                best_distance = node_distance;
+            }
+            continue;
+        }
+        stack.push_back(node.children[1]);
+        stack.push_back(node.children[0]);
+    }
+    return best;
+}
+
+Entity_bvh::Box Entity_bvh::node_box(const Scene_graph& graph, uint32_t id)
+{
+    // Extent of the rotated unit cube along each axis
+    glm::mat3 rotation = glm::mat3_cast(graph.global_rotations[id]);
+    glm::vec3 extent = 0.5f * graph.global_scales[id] * (glm::abs(rotation[0]) + glm::abs(rotation[1]) + glm::abs(rotation[2]));
+    const glm::vec3& position = graph.global_positions[id];
+    return Box{ .min = position - extent, .max = position + extent };
+}
+
+Entity_bvh::Box Entity_bvh::fat_box(const Box& box)
+{
+    glm::vec3 margin = fat_margin * (box.max - box.min);
+    return Box{ .min = box.min - margin, .max = box.max + margin };
+}
+
+Entity_bvh::Box Entity_bvh::merge(const Box& a, const Box& b)
+{
+    return Box{ .min = glm::min(a.min, b.min), .max = glm::max(a.max, b.max) };
+}
+
+bool Entity_bvh::contains(const Box& outer, const Box& inner)
+{
+    return glm::all(glm::lessThanEqual(outer.min, inner.min)) && glm::all(glm::greaterThanEqual(outer.max, inner.max));
+}
+
+double Entity_bvh::area(const Box& box)
+{
+    glm::dvec3 size = glm::dvec3(box.max - box.min);
+    return 2.0 * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+uint32_t Entity_bvh::allocate_node()
+{
+    if (m_free_nodes.empty()) {
+        m_nodes.emplace_back();
+        return static_cast<uint32_t>(m_nodes.size() - 1u);
+    }
+    uint32_t node = m_free_nodes.back();
+    m_free_nodes.pop_back();
+    return node;
+}
+
+void Entity_bvh::free_node(uint32_t node)
+{
+    m_nodes[node] = Node{};
+    m_free_nodes.push_back(node);
+}
+
+void Entity_bvh::insert_leaf(uint32_t leaf)
+{
+    if (m_root == no_node) {
+        m_root = leaf;
+        m_nodes[leaf].parent = no_node;
+        return;
+    }
+
+    // Go down while the area added to the nodes on the way is cheaper than making the leaf a sibling here
+    const Box leaf_box = m_nodes[leaf].box;
+    uint32_t sibling = m_root;
+    while (!m_nodes[sibling].leaf()) {
+        const Node& node = m_nodes[sibling];
+        double merged_area = area(merge(node.box, leaf_box));
+        double sibling_cost = 2.0 * merged_area;
+        double inherited_cost = 2.0 * (merged_area - area(node.box));
+        std::array<double, 2> child_costs;
+        for (size_t i = 0u; i < 2u; i++) {
+            const Node& child = m_nodes[node.children[i]];
+            double child_area = area(merge(child.box, leaf_box));
+            child_costs[i] = (child.leaf() ? child_area : child_area - area(child.box)) + inherited_cost;
+        }
+        if (sibling_cost < child_costs[0] && sibling_cost < child_costs[1]) {
+            break;
+        }
+        sibling = child_costs[0] < child_costs[1] ? node.children[0] : node.children[1];
+    }
+
+    uint32_t old_parent = m_nodes[sibling].parent;
+    uint32_t new_parent = allocate_node();
+    Node& parent = m_nodes[new_parent];
+    parent.parent = old_parent;
+    parent.children = { sibling, leaf };
+    parent.box = merge(leaf_box, m_nodes[sibling].box);
+    parent.height = m_nodes[sibling].height + 1u;
+    m_nodes[sibling].parent = new_parent;
+    m_nodes[leaf].parent = new_parent;
+    if (old_parent == no_node) {
+        m_root = new_parent;
+    }
+    else {
+        auto& children = m_nodes[old_parent].children;
+        children[children[0] == sibling ? 0u : 1u] = new_parent;
+    }
+    update_ancestors(m_nodes[leaf].parent);
+}
+
+void Entity_bvh::remove_leaf(uint32_t leaf)
+{
+    if (leaf == m_root) {
+        m_root = no_node;
+        return;
+    }
+    uint32_t parent = m_nodes[leaf].parent;
+    uint32_t grandparent = m_nodes[parent].parent;
+    const auto& children = m_nodes[parent].children;
+    uint32_t sibling = children[0] == leaf ? children[1] : children[0];
+    m_nodes[leaf].parent = no_node;
+    m_nodes[sibling].parent = grandparent;
+    free_node(parent);
+    if (grandparent == no_node) {
+        m_root = sibling;
+        return;
+    }
+    auto& grandparent_children = m_nodes[grandparent].children;
+    grandparent_children[grandparent_children[0] == parent ? 0u : 1u] = sibling;
+    update_ancestors(grandparent);
+}
+
+void Entity_bvh::update_ancestors(uint32_t node)
+{
+    while (node != no_node) {
+        node = balance(node);
+        Node& current = m_nodes[node];
+        const Node& first = m_nodes[current.children[0]];
+        const Node& second = m_nodes[current.children[1]];
+        current.box = merge(first.box, second.box);
+        current.height = 1u + std::max(first.height, second.height);
+        node = current.parent;
+    }
+}
+
+uint32_t Entity_bvh::balance(uint32_t a)
+{
+    Node& node_a = m_nodes[a];
+    if (node_a.leaf() || node_a.height < 2u) {
+        return a;
+    }
+    // The higher child takes the place of a, a takes its lower child's place
+    auto b_height = static_cast<int>(m_nodes[node_a.children[0]].height);
+    auto c_height = static_cast<int>(m_nodes[node_a.children[1]].height);
+    if (std::abs(c_height - b_height) <= 1) {
+        return a;
+    }
+    size_t up_side = c_height > b_height ? 1u : 0u;
+    uint32_t up = node_a.children[up_side];
+    uint32_t other = node_a.children[1u - up_side];
+    Node& node_up = m_nodes[up];
+    uint32_t f = node_up.children[0];
+    uint32_t g = node_up.children[1];
+
+    node_up.children[0] = a;
+    node_up.parent = node_a.parent;
+    node_a.parent = up;
+    if (node_up.parent == no_node) {
+        m_root = up;
+    }
+    else {
+        auto& children = m_nodes[node_up.parent].children;
+        children[children[0] == a ? 0u : 1u] = up;
+    }
+
+    // The higher grandchild stays under up, the other one goes under a
+    uint32_t kept = m_nodes[f].height > m_nodes[g].height ? f : g;
+    uint32_t given = kept == f ? g : f;
+    node_up.children[1] = kept;
+    node_a.children[up_side] = given;
+    m_nodes[given].parent = a;
+    node_a.box = merge(m_nodes[other].box, m_nodes[given].box);
+    node_a.height = 1u + std::max(m_nodes[other].height, m_nodes[given].height);
+    node_up.box = merge(node_a.box, m_nodes[kept].box);
+    node_up.height = 1u + std::max(node_a.height, m_nodes[kept].height);
+    return up;
+}
+
+void Entity_bvh::rebuild(const Scene_graph& graph)
+{
+    // The leaves keep their node, the internal ones are made again
+    std::vector<uint32_t> leaves;
+    leaves.reserve(m_leaf_count);
+    for (uint32_t leaf : m_slot_leaves) {
+        if (leaf != no_node) {
+            m_nodes[leaf].box = fat_box(node_box(graph, m_nodes[leaf].graph_node));
+            leaves.push_back(leaf);
+        }
+    }
+    m_free_nodes.clear();
+    for (auto node = static_cast<uint32_t>(m_nodes.size()); node-- > 0u;) {
+        if (m_nodes[node].slot == no_node) {
+            m_nodes[node] = Node{};
+            m_free_nodes.push_back(node);
+        }
+    }
+
+    // Split at the median of the centers along their longest axis
+    m_built_area = 0.0;
+    auto center = [this](uint32_t leaf) {
+        const Box& box = m_nodes[leaf].box;
+        return 0.5f * (box.min + box.max);
+    };
+    auto build_node = [this, &leaves, &center](auto& self, size_t first, size_t last) -> uint32_t {
+        if (last - first == 1u) {
+            return leaves[first];
+        }
+        Box centers;
+        for (size_t i = first; i < last; i++) {
+            centers.min = glm::min(centers.min, center(leaves[i]));
+            centers.max = glm::max(centers.max, center(leaves[i]));
+        }
+        glm::vec3 size = centers.max - centers.min;
+        int axis = size.x >= size.y && size.x >= size.z ? 0 : (size.y >= size.z ? 1 : 2);
+        size_t middle = (first + last) / 2u;
+        std::nth_element(leaves.begin() + first, leaves.begin() + middle, leaves.begin() + last, [&center, axis](uint32_t a, uint32_t b) {
+            return center(a)[axis] < center(b)[axis];
+            });
+        std::array<uint32_t, 2> children{ self(self, first, middle), self(self, middle, last) };
+        uint32_t node = allocate_node();
+        Node& built = m_nodes[node];
+        built.children = children;
+        built.box = merge(m_nodes[children[0]].box, m_nodes[children[1]].box);
+        built.height = 1u + std::max(m_nodes[children[0]].height, m_nodes[children[1]].height);
+        m_nodes[children[0]].parent = node;
+        m_nodes[children[1]].parent = node;
+        m_built_area += area(built.box);
+        return node;
+    };
+    m_root = leaves.empty() ? no_node : build_node(build_node, 0u, leaves.size());
+    if (m_root != no_node) {
+        m_nodes[m_root].parent = no_node;
+    }
+    m_rebuilds++;
+}
+
+double Entity_bvh::refit_subtree(uint32_t node)
+{
+    if (m_nodes[node].leaf()) {
+        return 0.0;
+    }
+    auto children = m_nodes[node].children;
+    double subtree_area = refit_subtree(children[0]) + refit_subtree(children[1]);
+    Box& box = m_nodes[node].box;
+    box = merge(m_nodes[children[0]].box, m_nodes[children[1]].box);
+    return subtree_area + area(box);
+}
+
+}
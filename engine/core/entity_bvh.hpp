@@ -0,0 +1,98 @@
+#pragma once
+#include <glm/glm.hpp>
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <vector>
+
+namespace sdf_editor
+{
+
+struct Entity;
+struct Scene_graph;
+
+// Dynamic bounding volume hierarchy over the world boxes of the Scene_graph nodes, for the spatial queries of the inputs
+// The box of a node holds its unit cube, the bounds of every group, plus a margin
+// The leaves are kept by instance slot, so a graph rebuild only inserts and removes the leaves of the entities
+// added or removed, each in logarithmic time, and the tree stays balanced by rotations
+class Entity_bvh
+{
+public:
+    static constexpr uint32_t no_node = std::numeric_limits<uint32_t>::max();
+    // In proportion of the leaf box size, a node moving inside its margin leaves the tree as is
+    static constexpr float fat_margin = 0.1f;
+    // Over this share of the leaves out of their margin in a step, the boxes are refitted in place instead of reinserting the leaves
+    static constexpr float max_reinserted_ratio = 1.0f / 16.0f;
+    // Rebuild when the summed area of the internal boxes got this much bigger than after the last full build
+    static constexpr double rebuild_ratio = 2.0;
+    // Distance of a graph node to the query, infinity to reject it
+    using Distance_function = std::function<float(uint32_t)>;
+
+    // After each Scene_graph::build, with the slots it released
+    // Leaves for the nodes under roots[first_root] and the next roots, the ones before, like the hands, are left out
+    void update_hierarchy(const Scene_graph& graph, const std::vector<Entity>& roots, size_t first_root, const std::vector<uint32_t>& released_slots);
+    // Leaves of the nodes changed by the last propagate
+    void refit(const Scene_graph& graph);
+
+    // Graph node of the smallest distance among the ones whose box holds the point, no_node if none
+    [[nodiscard]] uint32_t nearest(const glm::vec3& point, const Distance_function& distance) const;
+    // Same among the ones whose box the line crosses, in both directions, with distances along the line
+    // in world units: the boxes farther than the best distance are skipped
+    [[nodiscard]] uint32_t nearest_on_line(const glm::vec3& origin, const glm::vec3& direction, const Distance_function& distance) const;
+
+    [[nodiscard]] size_t leaf_count() const { return m_leaf_count; }
+    [[nodiscard]] uint32_t height() const { return m_root == no_node ? 0u : m_nodes[m_root].height; }
+    [[nodiscard]] size_t rebuilds() const { return m_rebuilds; }
+    [[nodiscard]] size_t reinsertions() const { return m_reinsertions; }
+private:
+    struct Box
+    {
+        glm::vec3 min{ std::numeric_limits<float>::max() };
+        glm::vec3 max{ std::numeric_limits<float>::lowest() };
+    };
+    struct Node
+    {
+        Box box;
+        uint32_t parent = no_node;
+        std::array<uint32_t, 2> children{ no_node, no_node };  // None for the leaves
+        uint32_t height = 0u;  // Of the subtree, 0 for the leaves
+        uint32_t graph_node = no_node;
+        uint32_t slot = no_node;  // Only for the leaves, the free nodes have none
+
+        [[nodiscard]] bool leaf() const { return children[0] == no_node; }
+    };
+
+    [[nodiscard]] static Box node_box(const Scene_graph& graph, uint32_t id);
+    [[nodiscard]] static Box fat_box(const Box& box);
+    [[nodiscard]] static Box merge(const Box& a, const Box& b);
+    [[nodiscard]] static bool contains(const Box& outer, const Box& inner);
+    [[nodiscard]] static double area(const Box& box);
+
+    [[nodiscard]] uint32_t allocate_node();
+    void free_node(uint32_t node);
+    void insert_leaf(uint32_t leaf);
+    void remove_leaf(uint32_t leaf);
+    // Refit and balance the nodes from this one to the root
+    void update_ancestors(uint32_t node);
+    // Rotate the higher grandchild up if the children heights differ by more than one, return the node now in its place
+    [[nodiscard]] uint32_t balance(uint32_t node);
+    // Top down at the median of the leaves, their boxes updated from the graph
+    void rebuild(const Scene_graph& graph);
+    // Sum of the internal box areas
+    double refit_subtree(uint32_t node);
+
+    std::vector<Node> m_nodes;
+    std::vector<uint32_t> m_free_nodes;
+    uint32_t m_root = no_node;
+    size_t m_leaf_count = 0u;
+    std::vector<uint32_t> m_slot_leaves;  // Leaf of each instance slot, no_node for the ones left out
+    std::vector<uint32_t> m_leaves;  // Leaf of each graph node
+    std::vector<uint32_t> m_moved;
+    double m_built_area = 0.0;
+    size_t m_rebuilds = 0u;
+    size_t m_reinsertions = 0u;
+};
+
+}
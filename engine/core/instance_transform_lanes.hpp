@@ -0,0 +1,26 @@
+#pragma once
+#include <cstddef>
+
+namespace sdf_editor::detail
+{
+
+// Global transforms of a batch of nodes, one lane per node, to be loaded in SIMD registers
+// Plain arrays and no includes: the AVX2 translation unit uses it, and any inline function it emits
+// could be the copy the linker keeps for the whole engine, crashing the CPUs without AVX
+template<size_t width>
+struct Transform_lanes
+{
+    alignas(width * sizeof(float)) float px[width], py[width], pz[width];
+    alignas(width * sizeof(float)) float qx[width], qy[width], qz[width], qw[width];
+    alignas(width * sizeof(float)) float scale[width];
+    alignas(width * sizeof(float)) float fx[width], fy[width], fz[width];
+};
+
+#if defined(_M_X64) || defined(__x86_64__)
+constexpr size_t avx2_width = 8u;
+// In its own translation unit built with AVX2 and FMA, only called when the CPU supports them
+// Rows of the instance transforms of the nodes of the lanes, 12 floats per node
+void instance_transform_batch_avx2(const Transform_lanes<avx2_width>& lanes, float* transforms);
+#endif
+
+}
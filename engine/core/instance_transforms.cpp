@@ -0,0 +1,203 @@
+#include "instance_transforms.hpp"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#include "instance_transform_lanes.hpp"
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#include <algorithm>
+
+namespace sdf_editor
+{
+
+Simd_level best_simd_level()
+{
+    static const Simd_level level = [] {
+#if defined(_M_X64) || defined(__x86_64__)
+#ifdef _MSC_VER
+        std::array<int, 4> info{};
+        __cpuid(info.data(), 0);
+        int max_leaf = info[0];
+        __cpuid(info.data(), 1);
+        bool fma = (info[2] & (1 << 12)) != 0;
+        bool os_saves_ymm = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 0x6u) == 0x6u;
+        bool avx = (info[2] & (1 << 28)) != 0;
+        bool avx2 = false;
+        if (max_leaf >= 7) {
+            __cpuidex(info.data(), 7, 0);
+            avx2 = (info[1] & (1 << 5)) != 0;
+        }
+        return avx && avx2 && fma && os_saves_ymm ? Simd_level::avx2 : Simd_level::sse2;
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ? Simd_level::avx2 : Simd_level::sse2;
+#endif
+#else
+        return Simd_level::scalar;
+#endif
+    }();
+    return level;
+}
+
+const char* simd_level_name(Simd_level level)
+{
+    switch (level) {
+    case Simd_level::scalar:
+        return "scalar";
+    case Simd_level::sse2:
+        return "sse2";
+    case Simd_level::avx2:
+        return "avx2";
+    }
+    return "unknown";
+}
+
+namespace detail
+{
+
+void instance_transforms_scalar(const Scene_graph& graph, const uint32_t* ids, size_t count, Instance_transform* transforms)
+{
+    for (size_t i = 0u; i < count; i++) {
+        uint32_t id = ids[i];
+        const glm::vec3& p = graph.global_positions[id];
+        const glm::quat& q = graph.global_rotations[id];
+        glm::vec3 s = graph.global_scales[id] * graph.flip_axes[id];
+        float x2 = q.x + q.x;
+        float y2 = q.y + q.y;
+        float z2 = q.z + q.z;
+        float xx = q.x * x2;
+        float yy = q.y * y2;
+        float zz = q.z * z2;
+        float xy = q.x * y2;
+        float xz = q.x * z2;
+        float yz = q.y * z2;
+        float wx = q.w * x2;
+        float wy = q.w * y2;
+        float wz = q.w * z2;
+        transforms[i] = Instance_transform{
+            std::array<float, 4>{ (1.0f - (yy + zz)) * s.x, (xy - wz) * s.y, (xz + wy) * s.z, p.x },
+            std::array<float, 4>{ (xy + wz) * s.x, (1.0f - (xx + zz)) * s.y, (yz - wx) * s.z, p.y },
+            std::array<float, 4>{ (xz - wy) * s.x, (yz + wx) * s.y, (1.0f - (xx + yy)) * s.z, p.z } };
+    }
+}
+
+}
+
+#if defined(_M_X64) || defined(__x86_64__)
+template<size_t width>
+static void gather_lanes(const Scene_graph& graph, const uint32_t* ids, detail::Transform_lanes<width>& lanes)
+{
+    for (size_t lane = 0u; lane < width; lane++) {
+        uint32_t id = ids[lane];
+        const glm::vec3& position = graph.global_positions[id];
+        const glm::quat& rotation = graph.global_rotations[id];
+        const glm::vec3& flip = graph.flip_axes[id];
+        lanes.px[lane] = position.x;
+        lanes.py[lane] = position.y;
+        lanes.pz[lane] = position.z;
+        lanes.qx[lane] = rotation.x;
+        lanes.qy[lane] = rotation.y;
+        lanes.qz[lane] = rotation.z;
+        lanes.qw[lane] = rotation.w;
+        lanes.scale[lane] = graph.global_scales[id];
+        lanes.fx[lane] = flip.x;
+        lanes.fy[lane] = flip.y;
+        lanes.fz[lane] = flip.z;
+    }
+}
+
+// SSE2 is always there on x64
+static void instance_transforms_sse2(const Scene_graph& graph, const uint32_t* ids, size_t count, Instance_transform* transforms)
+{
+    constexpr size_t width = 4u;
+    size_t batched = count - count % width;
+    detail::Transform_lanes<width> lanes;
+    const __m128 one = _mm_set1_ps(1.0f);
+    for (size_t first = 0u; first < batched; first += width) {
+        gather_lanes(graph, ids + first, lanes);
+        __m128 qx = _mm_load_ps(lanes.qx);
+        __m128 qy = _mm_load_ps(lanes.qy);
+        __m128 qz = _mm_load_ps(lanes.qz);
+        __m128 qw = _mm_load_ps(lanes.qw);
+        __m128 scale = _mm_load_ps(lanes.scale);
+        __m128 sx = _mm_mul_ps(scale, _mm_load_ps(lanes.fx));
+        __m128 sy = _mm_mul_ps(scale, _mm_load_ps(lanes.fy));
+        __m128 sz = _mm_mul_ps(scale, _mm_load_ps(lanes.fz));
+        __m128 x2 = _mm_add_ps(qx, qx);
+        __m128 y2 = _mm_add_ps(qy, qy);
+        __m128 z2 = _mm_add_ps(qz, qz);
+        __m128 xx = _mm_mul_ps(qx, x2);
+        __m128 yy = _mm_mul_ps(qy, y2);
+        __m128 zz = _mm_mul_ps(qz, z2);
+        __m128 xy = _mm_mul_ps(qx, y2);
+        __m128 xz = _mm_mul_ps(qx, z2);
+        __m128 yz = _mm_mul_ps(qy, z2);
+        __m128 wx = _mm_mul_ps(qw, x2);
+        __m128 wy = _mm_mul_ps(qw, y2);
+        __m128 wz = _mm_mul_ps(qw, z2);
+
+        // Each register holds one element of the matrix for the 4 nodes, transposed to one row per node
+        __m128 rows[3][4]{
+            {
+                _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(yy, zz)), sx),
+                _mm_mul_ps(_mm_sub_ps(xy, wz), sy),
+                _mm_mul_ps(_mm_add_ps(xz, wy), sz),
+                _mm_load_ps(lanes.px) },
+            {
+                _mm_mul_ps(_mm_add_ps(xy, wz), sx),
+                _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, zz)), sy),
+                _mm_mul_ps(_mm_sub_ps(yz, wx), sz),
+                _mm_load_ps(lanes.py) },
+            {
+                _mm_mul_ps(_mm_sub_ps(xz, wy), sx),
+                _mm_mul_ps(_mm_add_ps(yz, wx), sy),
+                _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, yy)), sz),
+                _mm_load_ps(lanes.pz) } };
+        for (size_t row = 0u; row < 3u; row++) {
+            auto& [c0, c1, c2, c3] = rows[row];
+            _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+            _mm_storeu_ps(transforms[first][row].data(), c0);
+            _mm_storeu_ps(transforms[first + 1u][row].data(), c1);
+            _mm_storeu_ps(transforms[first + 2u][row].data(), c2);
+            _mm_storeu_ps(transforms[first + 3u][row].data(), c3);
+        }
+    }
+    detail::instance_transforms_scalar(graph, ids + batched, count - batched, transforms + batched);
+}
+
+static void instance_transforms_avx2(const Scene_graph& graph, const uint32_t* ids, size_t count, Instance_transform* transforms)
+{
+    static_assert(sizeof(Instance_transform) == 12u * sizeof(float));
+    constexpr size_t width = detail::avx2_width;
+    size_t batched = count - count % width;
+    detail::Transform_lanes<width> lanes;
+    for (size_t first = 0u; first < batched; first += width) {
+        gather_lanes(graph, ids + first, lanes);
+        detail::instance_transform_batch_avx2(lanes, reinterpret_cast<float*>(transforms + first));
+    }
+    detail::instance_transforms_scalar(graph, ids + batched, count - batched, transforms + batched);
+}
+#endif
+
+void instance_transforms(const Scene_graph& graph, const uint32_t* ids, size_t count, Instance_transform* transforms, Simd_level level)
+{
+    switch (std::min(level, best_simd_level())) {
+#if defined(_M_X64) || defined(__x86_64__)
+    case Simd_level::avx2:
+        instance_transforms_avx2(graph, ids, count, transforms);
+        return;
+    case Simd_level::sse2:
+        instance_transforms_sse2(graph, ids, count, transforms);
+        return;
+#endif
+    default:
+        detail::instance_transforms_scalar(graph, ids, count, transforms);
+        return;
+    }
+}
+
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include "scene_graph.hpp"
+
+#include <array>
+#include <cstdint>
+
+namespace sdf_editor
+{
+
+// Rows of translate * rotate * flip * scale, laid out like VkTransformMatrixKHR
+using Instance_transform = std::array<std::array<float, 4>, 3>;
+
+enum class Simd_level
+{
+    scalar,
+    sse2,
+    avx2  // With FMA
+};
+
+// Widest level supported by the running CPU, checked once
+[[nodiscard]] Simd_level best_simd_level();
+[[nodiscard]] const char* simd_level_name(Simd_level level);
+
+// Instance transforms of the global transforms of the nodes ids, computed a batch of nodes at a time
+// The level is capped to the best one of the CPU
+void instance_transforms(const Scene_graph& graph, const uint32_t* ids, size_t count, Instance_transform* transforms, Simd_level level = best_simd_level());
+
+namespace detail
+{
+void instance_transforms_scalar(const Scene_graph& graph, const uint32_t* ids, size_t count, Instance_transform* transforms);
+}
+
+}
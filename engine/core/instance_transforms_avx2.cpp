@@ -0,0 +1,65 @@
+#include "instance_transform_lanes.hpp"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#include <immintrin.h>
+
+namespace sdf_editor::detail
+{
+
+void instance_transform_batch_avx2(const Transform_lanes<avx2_width>& lanes, float* transforms)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256 qx = _mm256_load_ps(lanes.qx);
+    __m256 qy = _mm256_load_ps(lanes.qy);
+    __m256 qz = _mm256_load_ps(lanes.qz);
+    __m256 qw = _mm256_load_ps(lanes.qw);
+    __m256 scale = _mm256_load_ps(lanes.scale);
+    __m256 sx = _mm256_mul_ps(scale, _mm256_load_ps(lanes.fx));
+    __m256 sy = _mm256_mul_ps(scale, _mm256_load_ps(lanes.fy));
+    __m256 sz = _mm256_mul_ps(scale, _mm256_load_ps(lanes.fz));
+    __m256 x2 = _mm256_add_ps(qx, qx);
+    __m256 y2 = _mm256_add_ps(qy, qy);
+    __m256 z2 = _mm256_add_ps(qz, qz);
+    __m256 xx = _mm256_mul_ps(qx, x2);
+    __m256 yy = _mm256_mul_ps(qy, y2);
+    __m256 zz = _mm256_mul_ps(qz, z2);
+    __m256 wx = _mm256_mul_ps(qw, x2);
+    __m256 wy = _mm256_mul_ps(qw, y2);
+    __m256 wz = _mm256_mul_ps(qw, z2);
+
+    __m256 rows[3][4]{
+        {
+            _mm256_mul_ps(_mm256_sub_ps(one, _mm256_add_ps(yy, zz)), sx),
+            _mm256_mul_ps(_mm256_fmsub_ps(qx, y2, wz), sy),
+            _mm256_mul_ps(_mm256_fmadd_ps(qx, z2, wy), sz),
+            _mm256_load_ps(lanes.px) },
+        {
+            _mm256_mul_ps(_mm256_fmadd_ps(qx, y2, wz), sx),
+            _mm256_mul_ps(_mm256_sub_ps(one, _mm256_add_ps(xx, zz)), sy),
+            _mm256_mul_ps(_mm256_fmsub_ps(qy, z2, wx), sz),
+            _mm256_load_ps(lanes.py) },
+        {
+            _mm256_mul_ps(_mm256_fmsub_ps(qx, z2, wy), sx),
+            _mm256_mul_ps(_mm256_fmadd_ps(qy, z2, wx), sy),
+            _mm256_mul_ps(_mm256_sub_ps(one, _mm256_add_ps(xx, yy)), sz),
+            _mm256_load_ps(lanes.pz) } };
+    // Each register holds one element of the matrix for the 8 nodes, transposed per half to one row per node
+    for (size_t row = 0u; row < 3u; row++) {
+        for (size_t half = 0u; half < 2u; half++) {
+            __m128 columns[4];
+            for (size_t column = 0u; column < 4u; column++) {
+                columns[column] = half == 0u ? _mm256_castps256_ps128(rows[row][column]) : _mm256_extractf128_ps(rows[row][column], 1);
+            }
+            auto& [c0, c1, c2, c3] = columns;
+            _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+            float* row_data = transforms + 12u * (4u * half) + 4u * row;
+            _mm_storeu_ps(row_data, c0);
+            _mm_storeu_ps(row_data + 12u, c1);
+            _mm_storeu_ps(row_data + 24u, c2);
+            _mm_storeu_ps(row_data + 36u, c3);
+        }
+    }
+}
+
+}
+#endif
@@ -11,6 +11,8 @@
 
 #include "shader.hpp"
 #include "transform.hpp"
+#include "scene_graph.hpp"
+#include "entity_bvh.hpp"
 
 namespace sdf_editor
 {
@@ -61,8 +63,8 @@ struct Entity
     size_t group_id;
 
     std::vector<Entity> children{};
+    Entity_handle handle{};  // Set by the Transform_system
 
-    int hand_grabbing = -1;
     bool dirty_global = false;
     bool dirty_local = false;
 
@@ -75,19 +77,47 @@ struct Entity
     }
 };
 
+// Outcome of the per-frame TLAS updates, see Tlas::update
+struct Tlas_stats
+{
+    size_t skipped = 0u;
+    size_t refits = 0u;
+    size_t rebuilds = 0u;
+    size_t reallocations = 0u;  // The instances outgrew the structure
+    size_t instances_uploaded = 0u;
+};
+
 struct Scene
 {
     // Should probably be a runtime setting in the future
     static constexpr bool standing = true;
     static constexpr float vr_offset_y = standing ? 0.0f : 1.7f;
-    static constexpr unsigned int max_entities = 20u;
-    static constexpr unsigned int max_lights = 10u;
+    static constexpr uint32_t hit_groups_per_group = 3u;  // Primary, shadow and ambient occlusion, stride of the instances SBT offset
+    static constexpr size_t hand_count = 2u;  // The first entities, left out of the spatial queries
     bool mouse_control{ true }; // Mouse and controller can alternate for ui control
 
     Scene_global scene_global = {};
 
     std::vector<Entity> entities{};
+    // Flat copy of entities updated by the Transform_system, which keeps pointers to them:
+    // set hierarchy_dirty whenever an entity is added, removed or moved in the tree
+    Scene_graph graph{};
+    // The rebuild walks every entity, so each add or remove costs O(N): about 15 ms for 100k leaves
+    // Batch the edits of a frame rather than setting it for each entity in separate frames
+    bool hierarchy_dirty{ true };
+    // Bounds of the graph nodes for the grab and pointing queries, refitted by the Transform_system
+    // The pointers of the graph are only valid while hierarchy_dirty is false
+    Entity_bvh entity_bvh{};
+    // One slot per entity, inactive for the ones without a group and the released ones
     std::vector<vk::AccelerationStructureInstanceKHR> entities_instances{};
+    Instance_slots instance_slots{};
+    // Change tracking of entities_instances by the Transform_system, so each TLAS only uploads what changed
+    uint64_t instances_generation = 0u;  // Incremented by each step changing at least one instance
+    uint64_t instances_structure_generation = 0u;  // Last change a refit can't handle: instance added, removed or pointing to another BLAS
+    std::vector<uint64_t> instance_generations{};  // Generation of the last change of each instance
+    Tlas_stats tlas_stats;
+    std::vector<vk::DeviceAddress> group_blas_addresses{};  // Filled by the renderer, BLAS sized to the bounds of each group
+    std::vector<uint32_t> group_primitive_blocks{};  // Filled by the renderer, custom index of the instances to find the AABBs of their BLAS
 
     std::vector<Material> materials;
     std::vector<Light> lights;
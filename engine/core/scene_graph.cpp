@@ -0,0 +1,378 @@
+#include "scene_graph.hpp"
+#include "scene.hpp"
+
+#include <marl/event.h>
+#include <marl/scheduler.h>
+
+#include <atomic>
+#include <memory>
+
+namespace sdf_editor
+{
+
+Entity_handle Instance_slots::allocate()
+{
+    if (m_free_slots.empty()) {
+        m_generations.push_back(0u);
+        return Entity_handle{ .slot = static_cast<uint32_t>(m_generations.size() - 1u), .generation = 0u };
+    }
+    uint32_t slot = m_free_slots.back();
+    m_free_slots.pop_back();
+    return Entity_handle{ .slot = slot, .generation = m_generations[slot] };
+}
+
+void Instance_slots::release(Entity_handle handle)
+{
+    if (valid(handle)) {
+        m_generations[handle.slot]++;
+        m_free_slots.push_back(handle.slot);
+    }
+}
+
+bool Instance_slots::valid(Entity_handle handle) const
+{
+    return handle.slot < m_generations.size() && m_generations[handle.slot] == handle.generation;
+}
+
+// Bits of the nodes of a range updated in parallel, the words shared with the neighbour ranges
+// are kept aside until every range is done
+class Range_bits
+{
+public:
+    Range_bits(Dirty_bits& bits, uint32_t first, uint32_t last) :
+        m_bits(bits),
+        m_first(first),
+        m_first_word(first / 64u),
+        m_last_word(last > first ? (last - 1u) / 64u : first / 64u)
+    {}
+
+    void set(size_t id) { word(id) |= uint64_t{ 1u } << (id % 64u); }
+    // Nodes of the head, before the range, are done and only read
+    [[nodiscard]] bool test(size_t id)
+    {
+        uint64_t bits = id < m_first ? m_bits.word(id / 64u) : word(id);
+        return (bits >> (id % 64u)) & 1u;
+    }
+    // After every range is done
+    void merge()
+    {
+        m_bits.word(m_first_word) |= m_shared[0];
+        m_bits.word(m_last_word) |= m_shared[1];
+    }
+private:
+    Dirty_bits& m_bits;
+    uint32_t m_first;
+    size_t m_first_word;
+    size_t m_last_word;
+    std::array<uint64_t, 2> m_shared{};
+
+    uint64_t& word(size_t id)
+    {
+        size_t word_id = id / 64u;
+        if (word_id == m_first_word) {
+            return m_shared[0];
+        }
+        if (word_id == m_last_word) {
+            return m_shared[1];
+        }
+        return m_bits.word(word_id);
+    }
+};
+
+void Scene_graph::build(std::vector<Entity>& roots, Instance_slots& slots, std::vector<uint32_t>& released_slots)
+{
+    struct Node
+    {
+        Entity* entity;
+        uint32_t parent;
+        uint32_t size;  // Of its subtree, which follows it in depth first order
+    };
+    std::vector<Node> nodes;
+    auto visit = [&nodes](auto& self, Entity& entity, uint32_t parent) -> void {
+        auto id = static_cast<uint32_t>(nodes.size());
+        nodes.push_back(Node{ &entity, parent, 1u });
+        for (auto& child : entity.children) {
+            self(self, child, id);
+        }
+    };
+    for (auto& root : roots) {
+        visit(visit, root, no_parent);
+    }
+    for (size_t id = nodes.size(); id-- > 0u;) {
+        if (nodes[id].parent != no_parent) {
+            nodes[nodes[id].parent].size += nodes[id].size;
+        }
+    }
+
+    // Copied entities share a handle, only the first one keeps the slot
+    std::vector<bool> claimed(slots.size(), false);
+    for (auto& node : nodes) {
+        Entity_handle& handle = node.entity->handle;
+        if (!slots.valid(handle) || claimed[handle.slot]) {
+            handle = slots.allocate();
+            claimed.resize(slots.size(), false);
+        }
+        claimed[handle.slot] = true;
+    }
+    released_slots.clear();
+    for (const auto& handle : handles) {
+        if (slots.valid(handle) && !claimed[handle.slot]) {
+            slots.release(handle);
+            released_slots.push_back(handle.slot);
+        }
+    }
+
+    // The head keeps the depth first order, then the subtrees of its children and of the small roots
+    // are packed in chunks of about chunk_size nodes
+    std::vector<uint32_t> order;
+    order.reserve(nodes.size());
+    std::vector<uint32_t> subtrees;
+    for (uint32_t id = 0u; id < nodes.size(); id++) {
+        const Node& node = nodes[id];
+        bool parent_in_head = node.parent == no_parent || nodes[node.parent].size > chunk_size;
+        if (!parent_in_head) {
+            continue;
+        }
+        if (node.size > chunk_size) {
+            order.push_back(id);
+        }
+        else {
+            subtrees.push_back(id);
+        }
+    }
+    range_offsets.assign(1u, 0u);
+    range_offsets.push_back(static_cast<uint32_t>(order.size()));
+    for (uint32_t subtree : subtrees) {
+        if (order.size() - range_offsets.back() >= chunk_size) {
+            range_offsets.push_back(static_cast<uint32_t>(order.size()));
+        }
+        for (uint32_t id = subtree; id < subtree + nodes[subtree].size; id++) {
+            order.push_back(id);
+        }
+    }
+    if (range_offsets.back() != order.size()) {
+        range_offsets.push_back(static_cast<uint32_t>(order.size()));
+    }
+    std::vector<uint32_t> new_ids(nodes.size());
+    for (uint32_t id = 0u; id < order.size(); id++) {
+        new_ids[order[id]] = id;
+    }
+
+    // Only the new nodes and the ones moved to another parent need their global transform,
+    // the others kept theirs and the edits since the last step are flagged on their entity
+    size_t size = nodes.size();
+    std::vector<bool> moved(size);
+    for (uint32_t id = 0u; id < size; id++) {
+        const Node& node = nodes[order[id]];
+        Entity_handle parent = node.parent == no_parent ? Entity_handle{} : nodes[node.parent].entity->handle;
+        uint32_t previous = this->node(node.entity->handle);
+        moved[id] = previous == no_node || parent != (parents[previous] == no_parent ? Entity_handle{} : handles[parents[previous]]);
+    }
+
+    entities.resize(size);
+    parents.resize(size);
+    handles.resize(size);
+    group_ids.resize(size);
+    local_positions.resize(size);
+    local_rotations.resize(size);
+    local_scales.resize(size);
+    flip_axes.resize(size);
+    global_positions.resize(size);
+    global_rotations.resize(size);
+    global_scales.resize(size);
+    for (uint32_t id = 0u; id < size; id++) {
+        const Node& node = nodes[order[id]];
+        const Entity& entity = *node.entity;
+        entities[id] = node.entity;
+        parents[id] = node.parent == no_parent ? no_parent : new_ids[node.parent];
+        handles[id] = entity.handle;
+        group_ids[id] = entity.group_id;
+        local_positions[id] = entity.local_transform.position;
+        local_rotations[id] = entity.local_transform.rotation;
+        local_scales[id] = entity.local_transform.scale;
+        flip_axes[id] = entity.local_transform.flip_axis;
+        global_positions[id] = entity.global_transform.position;
+        global_rotations[id] = entity.global_transform.rotation;
+        global_scales[id] = entity.global_transform.scale;
+    }
+
+    slot_nodes.assign(slots.size(), no_node);
+    for (uint32_t id = 0u; id < size; id++) {
+        slot_nodes[handles[id].slot] = id;
+    }
+
+    dirty_local.resize(size);
+    dirty_global.resize(size);
+    changed.resize(size);
+    for (size_t id = 0u; id < size; id++) {
+        if (moved[id]) {
+            dirty_global.set(id);
+        }
+    }
+}
+
+void Scene_graph::gather()
+{
+    std::vector<Range_bits> local_bits;
+    std::vector<Range_bits> global_bits;
+    local_bits.reserve(range_count());
+    global_bits.reserve(range_count());
+    for (size_t range = 0u; range < range_count(); range++) {
+        local_bits.emplace_back(dirty_local, range_offsets[range], range_offsets[range + 1u]);
+        global_bits.emplace_back(dirty_global, range_offsets[range], range_offsets[range + 1u]);
+    }
+    for_each_range([this, &local_bits, &global_bits](size_t range, uint32_t first, uint32_t last) {
+        for (uint32_t id = first; id < last; id++) {
+            const Entity& entity = *entities[id];
+            group_ids[id] = entity.group_id;
+            if (entity.dirty_local) {
+                global_positions[id] = entity.global_transform.position;
+                global_rotations[id] = entity.global_transform.rotation;
+                global_scales[id] = entity.global_transform.scale;
+                flip_axes[id] = entity.global_transform.flip_axis;
+                local_bits[range].set(id);
+            }
+            if (entity.dirty_global) {
+                local_positions[id] = entity.local_transform.position;
+                local_rotations[id] = entity.local_transform.rotation;
+                local_scales[id] = entity.local_transform.scale;
+                flip_axes[id] = entity.local_transform.flip_axis;
+                global_bits[range].set(id);
+            }
+        }
+        });
+    for (size_t range = 0u; range < range_count(); range++) {
+        local_bits[range].merge();
+        global_bits[range].merge();
+    }
+}
+
+void Scene_graph::propagate()
+{
+    changed.clear();
+    std::vector<Range_bits> changed_bits;
+    changed_bits.reserve(range_count());
+    for (size_t range = 0u; range < range_count(); range++) {
+        changed_bits.emplace_back(changed, range_offsets[range], range_offsets[range + 1u]);
+    }
+    // The head is merged before the chunks start, they read its bits
+    for_each_range([this, &changed_bits](size_t range, uint32_t first, uint32_t last) {
+        auto& range_changed = changed_bits[range];
+        for (uint32_t id = first; id < last; id++) {
+            uint32_t parent = parents[id];
+            bool update_global = dirty_global.test(id) || (parent != no_parent && range_changed.test(parent));
+            if (dirty_local.test(id)) {
+                if (parent != no_parent) {
+                    glm::quat inverse_rotation = glm::conjugate(global_rotations[parent]);
+                    local_positions[id] = glm::rotate(inverse_rotation, (global_positions[id] - global_positions[parent]) / global_scales[parent]);
+                    local_rotations[id] = inverse_rotation * global_rotations[id];
+                    local_scales[id] = global_scales[id] / global_scales[parent];
+                }
+                else {
+                    local_positions[id] = global_positions[id];
+                    local_rotations[id] = global_rotations[id];
+                    local_scales[id] = global_scales[id];
+                }
+                range_changed.set(id);
+            }
+            if (update_global) {
+                if (parent != no_parent) {
+                    global_positions[id] = global_positions[parent] + glm::rotate(global_rotations[parent], global_scales[parent] * local_positions[id]);
+                    global_rotations[id] = global_rotations[parent] * local_rotations[id];
+                    global_scales[id] = global_scales[parent] * local_scales[id];
+                }
+                else {
+                    global_positions[id] = local_positions[id];
+                    global_rotations[id] = local_rotations[id];
+                    global_scales[id] = local_scales[id];
+                }
+                range_changed.set(id);
+            }
+        }
+        if (range == 0u) {
+            range_changed.merge();
+        }
+        });
+    for (size_t range = 1u; range < range_count(); range++) {
+        changed_bits[range].merge();
+    }
+    dirty_local.clear();
+    dirty_global.clear();
+}
+
+void Scene_graph::scatter()
+{
+    for_each_range([this](size_t /*range*/, uint32_t first, uint32_t last) {
+        for (uint32_t id = first; id < last; id++) {
+            if (!changed.test(id)) {
+                continue;
+            }
+            Entity& entity = *entities[id];
+            entity.local_transform = Transform{
+                .position = local_positions[id],
+                .rotation = local_rotations[id],
+                .scale = local_scales[id],
+                .flip_axis = flip_axes[id] };
+            entity.global_transform = global_transform(id);
+            entity.dirty_local = false;
+            entity.dirty_global = false;
+        }
+        });
+}
+
+void Scene_graph::for_each_range(const Range_function& function) const
+{
+    function(0u, range_offsets[0], range_offsets[1]);
+    size_t chunk_count = range_count() - 1u;
+    marl::Scheduler* scheduler = marl::Scheduler::get();
+    if (!scheduler || chunk_count <= 1u) {
+        for (size_t chunk = 1u; chunk <= chunk_count; chunk++) {
+            function(chunk, range_offsets[chunk], range_offsets[chunk + 1u]);
+        }
+        return;
+    }
+
+    // The calling thread takes chunks too, so it never waits for workers busy with longer tasks to start
+    // A worker starting late finds no chunk left and returns without touching the graph
+    struct Job
+    {
+        std::atomic<size_t> next_chunk{ 1u };
+        std::atomic<size_t> done_chunks{ 0u };
+        marl::Event finished{ marl::Event::Mode::Manual };
+    };
+    auto job = std::make_shared<Job>();
+    auto run = [this, job, &function, chunk_count] {
+        for (size_t chunk = job->next_chunk++; chunk <= chunk_count; chunk = job->next_chunk++) {
+            function(chunk, range_offsets[chunk], range_offsets[chunk + 1u]);
+            if (++job->done_chunks == chunk_count) {
+                job->finished.signal();
+            }
+        }
+    };
+    auto helpers = std::min(chunk_count - 1u, static_cast<size_t>(scheduler->config().workerThread.count));
+    for (size_t helper = 0u; helper < helpers; helper++) {
+        marl::schedule(run);
+    }
+    run();
+    job->finished.wait();
+}
+
+Transform Scene_graph::global_transform(size_t id) const
+{
+    return Transform{
+        .position = global_positions[id],
+        .rotation = global_rotations[id],
+        .scale = global_scales[id],
+        .flip_axis = flip_axes[id] };
+}
+
+uint32_t Scene_graph::node(Entity_handle handle) const
+{
+    if (handle.slot >= slot_nodes.size()) {
+        return no_node;
+    }
+    uint32_t id = slot_nodes[handle.slot];
+    return id != no_node && handles[id] == handle ? id : no_node;
+}
+
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include "transform.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <vector>
+
+namespace sdf_editor
+{
+
+struct Entity;
+
+// One bit per node of the Scene_graph
+class Dirty_bits
+{
+public:
+    void resize(size_t size) { m_words.assign((size + 63u) / 64u, 0u); }
+    void clear() { std::ranges::fill(m_words, 0u); }
+    void set(size_t id) { m_words[id / 64u] |= uint64_t{ 1u } << (id % 64u); }
+    [[nodiscard]] bool test(size_t id) const { return (m_words[id / 64u] >> (id % 64u)) & 1u; }
+    [[nodiscard]] uint64_t& word(size_t word_id) { return m_words[word_id]; }
+    [[nodiscard]] uint64_t word(size_t word_id) const { return m_words[word_id]; }
+    [[nodiscard]] size_t word_count() const { return m_words.size(); }
+private:
+    std::vector<uint64_t> m_words;
+};
+
+// Stable slot of an entity in Scene::entities_instances, the generation tells apart the entities reusing a slot
+struct Entity_handle
+{
+    static constexpr uint32_t invalid_slot = std::numeric_limits<uint32_t>::max();
+
+    uint32_t slot = invalid_slot;
+    uint32_t generation = 0u;
+
+    bool operator==(const Entity_handle& other) const = default;
+};
+
+// Slots of Scene::entities_instances, the released ones are reused first so adding or removing an entity is O(1)
+class Instance_slots
+{
+public:
+    [[nodiscard]] Entity_handle allocate();
+    void release(Entity_handle handle);
+    [[nodiscard]] bool valid(Entity_handle handle) const;
+    [[nodiscard]] size_t size() const { return m_generations.size(); }
+private:
+    std::vector<uint32_t> m_generations;  // Incremented on release, so the previous handles of the slot become invalid
+    std::vector<uint32_t> m_free_slots;
+};
+
+// Flattened copy of the Entity tree, where parents come before their children so a linear sweep
+// over separate arrays per transform component updates it
+// The nodes are split in ranges: first the head, the few ancestors of subtrees bigger than a chunk,
+// then chunks of whole subtrees, which only depend on the head and are updated in parallel
+// The entities stay the view edited by the UI, json and VR inputs: gather copies what they flagged dirty,
+// scatter writes the updated transforms back
+struct Scene_graph
+{
+    static constexpr uint32_t no_parent = std::numeric_limits<uint32_t>::max();
+    static constexpr uint32_t no_node = std::numeric_limits<uint32_t>::max();
+    static constexpr uint32_t chunk_size = 4096u;  // Nodes, a chunk is only cut between subtrees
+    // Range id, then its first and last node
+    using Range_function = std::function<void(size_t, uint32_t, uint32_t)>;
+
+    std::vector<Entity*> entities;
+    std::vector<uint32_t> parents;
+    std::vector<uint32_t> range_offsets{ 0u, 0u };  // First node of the head and of each chunk, followed by the node count
+    std::vector<Entity_handle> handles;  // Also stored in the entities, so they keep their slot across rebuilds
+    std::vector<uint32_t> slot_nodes;  // Node of each slot, no_node for the released ones
+    std::vector<size_t> group_ids;
+
+    std::vector<glm::vec3> local_positions;
+    std::vector<glm::quat> local_rotations;
+    std::vector<float> local_scales;
+    std::vector<glm::vec3> flip_axes;  // Same for the local and global transforms
+    std::vector<glm::vec3> global_positions;
+    std::vector<glm::quat> global_rotations;
+    std::vector<float> global_scales;
+
+    Dirty_bits dirty_local;  // Global transform edited, the local one is deduced from it
+    Dirty_bits dirty_global;  // Local transform edited or parent moved
+    Dirty_bits changed;  // Nodes whose transform was updated by the last propagate
+
+    // The new nodes and the ones with another parent start dirty, so the first propagate computes all of them
+    // Entities without a valid handle get a slot, the slots of the entities no longer in the tree are released
+    // Linear in the entity count whatever the size of the edit, only the Entity_bvh update is incremental
+    void build(std::vector<Entity>& roots, Instance_slots& slots, std::vector<uint32_t>& released_slots);
+    // Copy the dirty flags and edited transforms of the entities
+    void gather();
+    void propagate();
+    // Write the changed transforms back to the entities and clear their dirty flags
+    void scatter();
+
+    // Run on the head, then on the chunks spread on the marl scheduler bound to this thread if any
+    // The ranges don't depend on the thread count, so neither do the results merged in range order
+    void for_each_range(const Range_function& function) const;
+
+    [[nodiscard]] size_t size() const { return entities.size(); }
+    [[nodiscard]] size_t range_count() const { return range_offsets.size() - 1u; }
+    [[nodiscard]] Transform global_transform(size_t id) const;
+    // no_node if the entity of the handle is no longer in the tree
+    [[nodiscard]] uint32_t node(Entity_handle handle) const;
+};
+
+}
@@ -1,4 +1,8 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <memory>
 #include <string>
 #include <vector>
 #include "vulkan/vk_common.hpp"
@@ -10,17 +14,87 @@ struct Shader_file
 {
     bool dirty = false;
     std::string name;
-    std::string data{};  // important to use a null terminating member for imgui
-    int size{}; // null terminating character index
+    // Immutable snapshot, an edit publish a new one so compile jobs can keep the version they were scheduled with
+    std::shared_ptr<const std::string> data;
+};
+
+enum class Shader_tier
+{
+    none,
+    preview,  // Compiled without optimization for a quick feedback, waiting for the optimized version
+    optimized
+};
+
+// Compile-time switches of the shaders, injected as a macro when compiling
+// Every variant is prebuilt so switching is only a pipeline rebuild, after an edit the variant in use is compiled first
+enum class Shader_variant
+{
+    quality,
+    performance,  // GO_FAST
+    debug_sdf,  // DEBUG_SDF, show the distance field of the groups
+    count
+};
+constexpr size_t shader_variant_count = static_cast<size_t>(Shader_variant::count);
+
+constexpr const char* shader_variant_name(Shader_variant variant)
+{
+    constexpr std::array<const char*, shader_variant_count> names{ "quality", "performance", "debug_sdf" };
+    return names[static_cast<size_t>(variant)];
+}
+
+// Null if the variant doesn't define anything
+constexpr const char* shader_variant_macro(Shader_variant variant)
+{
+    constexpr std::array<const char*, shader_variant_count> macros{ nullptr, "GO_FAST", "DEBUG_SDF" };
+    return macros[static_cast<size_t>(variant)];
+}
+
+// spirv-tools passes run on the optimized tier after shaderc, see Spirv_optimizer
+enum class Spirv_profile
+{
+    none,  // shaderc output as is
+    performance,  // Inlining, unrolling of [[unroll]] loops, then dead branch elimination
+    size,
+    count
+};
+constexpr size_t spirv_profile_count = static_cast<size_t>(Spirv_profile::count);
+
+constexpr const char* spirv_profile_name(Spirv_profile profile)
+{
+    constexpr std::array<const char*, spirv_profile_count> names{ "none", "performance", "size" };
+    return names[static_cast<size_t>(profile)];
+}
+
+// Telemetry of the last compile, exported to shader_stats.json/csv on shutdown
+struct Shader_stats
+{
+    float preprocess_time_ms = 0.0f;
+    float compile_time_ms = 0.0f;  // Wall time of the whole compile, preprocessing included
+    float optimize_time_ms = 0.0f;  // spirv-tools part of compile_time_ms
+    size_t spirv_words = 0u;
+    size_t instructions_before = 0u;  // Before the spirv-tools profile
+    size_t instructions = 0u;
+    Spirv_profile profile = Spirv_profile::none;
+    size_t include_count = 0u;  // Unique files included, directly or not
+    std::chrono::system_clock::time_point last_compiled{};
 };
 
 struct Shader
 {
     int file_id;
-    vk::ShaderModule module;
-    std::vector<int> engine_included_id;
-    std::vector<int> scene_included_id;
+    std::array<vk::ShaderModule, shader_variant_count> modules{};  // One per Shader_variant
+    std::vector<int> included_file_id;  // Engine files first, then scene files, for every variant
     std::string error;
+    uint32_t revision = 0u;  // Incremented each time a new module is swapped in
+    Shader_tier tier = Shader_tier::none;
+    float preview_time_ms = 0.0f;
+    float optimized_time_ms = 0.0f;
+    Shader_stats stats;  // Of the quality variant, or of the one in use until the background compile add it
+
+    [[nodiscard]] vk::ShaderModule module(Shader_variant variant) const { return modules[static_cast<size_t>(variant)]; }
+    // Every variant compiled
+    [[nodiscard]] bool valid() const { return std::ranges::all_of(modules, [](vk::ShaderModule module) { return static_cast<bool>(module); }); }
+    [[nodiscard]] bool empty() const { return std::ranges::none_of(modules, [](vk::ShaderModule module) { return static_cast<bool>(module); }); }
 };
 
 struct Shader_group
@@ -30,11 +104,34 @@ struct Shader_group
     Shader primary_closest_hit;
     Shader shadow_any_hit;
     Shader ao_any_hit;    
+    Shader bounds;  // Compute shader estimating the AABB of the group, not part of the pipeline
+};
+
+// Tunables exposed as specialization constants, changing them only recreate the pipeline
+struct Raymarch_settings
+{
+    bool override_advance_ratio = false;  // Otherwise ADVANCE_RATIO of each group is used
+    float advance_ratio = 1.0f;
+    bool override_advance_ratio_miss = false;  // Otherwise ADVANCE_RATIO_MISS of the scene is used
+    float advance_ratio_miss = 1.0f;
+    int max_steps = 128;
+    int max_steps_miss = 512;
+    float angle_black = 1.25f;
+    float angle_ms = 0.4f;
+    bool sample_2 = true;
+    Shader_variant variant = Shader_variant::quality;  // Not a specialization constant but also only need a new pipeline
+
+    bool operator==(const Raymarch_settings& other) const = default;
 };
 
 struct Shaders
 {
     bool pipeline_dirty = false;
+    bool pipeline_building = false;  // Modules are in use by the renderer, don't swap them
+    bool tiered_compilation = true;  // Swap an unoptimized version first when editing
+    Spirv_profile spirv_profile = Spirv_profile::none;  // Changing it recompile every shader
+    Raymarch_settings raymarch_settings;
+    bool raymarch_settings_dirty = false;
     std::vector<Shader_file> engine_files;
     std::vector<Shader_file> scene_files;
     Shader raygen;
@@ -42,6 +139,32 @@ struct Shaders
     Shader shadow_miss;
     Shader shadow_intersection;
     std::vector<Shader_group> groups;
+    size_t cache_hits = 0u;
+    size_t cache_misses = 0u;
+    size_t edits_coalesced = 0u;  // Edits merged with the next one by the debounce delay
+    size_t compiles_skipped = 0u;  // Compiles not started or thrown away because a newer edit superseded them
+    size_t file_writes = 0u;  // Saves are done by a background thread
+    size_t file_writes_coalesced = 0u;
+    size_t file_write_failures = 0u;
+    float file_write_latency_ms = 0.0f;
+    float file_write_max_latency_ms = 0.0f;
+
+    // Call func(group_name, shader) for every shader of the pipeline, group_name is empty outside of groups
+    template<typename F>
+    void visit(F func) const {
+        static const std::string no_group;
+        func(no_group, raygen);
+        func(no_group, primary_miss);
+        func(no_group, shadow_miss);
+        func(no_group, shadow_intersection);
+        for (const auto& group : groups) {
+            func(group.name, group.primary_intersection);
+            func(group.name, group.primary_closest_hit);
+            func(group.name, group.shadow_any_hit);
+            func(group.name, group.ao_any_hit);
+            func(group.name, group.bounds);
+        }
+    }
 };
 
 }
\ No newline at end of file
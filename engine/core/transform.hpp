@@ -27,6 +27,8 @@ struct Transform
         return *this;
     }
 
+    bool operator==(const Transform& other) const = default;
+
     Transform inverse() const {
         glm::quat conj = glm::conjugate(rotation);
         return Transform{
@@ -5,9 +5,20 @@
 #include <concepts>
 #include <ranges>
 #include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <numeric>
+#include <stdexcept>
 #include <imgui.h>
+#include <glm/gtc/constants.hpp>
 #include <glm/gtc/quaternion.hpp>
+#include <nlohmann/json.hpp>
 #include <cmath>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <marl/scheduler.h>
 
 namespace sdf_editor
 {
@@ -44,6 +55,9 @@ Vr_app::Vr_app(Scene scene, std::filesystem::path scene_json_path, std::filesyst
 
 Vr_app::~Vr_app()
 {
+    if (m_session) {
+        m_session->wait_pipeline_build(m_scene);
+    }
     m_context.device.waitIdle();
     std::ranges::for_each(m_systems, [this](auto& system) { system->cleanup(m_scene); });
     ImGui::DestroyContext();
@@ -79,6 +93,7 @@ Desktop_app::Desktop_app(Scene scene, std::filesystem::path scene_json_path, std
 
 Desktop_app::~Desktop_app()
 {
+    m_renderer.wait_pipeline_build(m_scene);
     m_context.device.waitIdle();
     m_shader_system.cleanup(m_scene);
 }
@@ -88,41 +103,562 @@ void Desktop_app::run()
     while (m_window.step())
     {
         Duration time_since_start = Clock::now() - m_start_clock;
-        m_scene.scene_global.time = time_since_start.count();
-        m_scene.scene_global.nb_lights = static_cast<int>(std::ssize(m_scene.lights));
+        frame(time_since_start.count());
+    }
+}
+
+void Desktop_app::run_benchmark(const std::filesystem::path& report_path)
+{
+    using json = nlohmann::json;
+    // Fixed time step and camera path so that every profile trace the same frames
+    constexpr float frame_time = 1.0f / 60.0f;
+    glm::vec3 start_position = m_scene.camera_position;
+    float start_rot_y = m_scene.camera_rot_y;
+    Spirv_profile start_profile = m_scene.shaders.spirv_profile;
+
+    json report = json::array();
+    for (size_t profile_id = 0u; profile_id < spirv_profile_count; profile_id++) {
+        auto profile = static_cast<Spirv_profile>(profile_id);
+        m_scene.shaders.spirv_profile = profile;
+        auto recompile_start = Clock::now();
+        while (!shaders_ready(profile)) {
+            if (!m_window.step()) {
+                return;
+            }
+            frame(0.0f);
+        }
+        std::chrono::duration<float, std::milli> recompile_time = Clock::now() - recompile_start;
+
+        // With a single command buffer, the time read after a frame is the one of the previous frame
+        std::vector<float> trace_times;
+        trace_times.reserve(benchmark_frames);
+        for (int frame_id = -benchmark_warmup_frames; frame_id <= benchmark_frames; frame_id++) {
+            if (!m_window.step()) {
+                return;
+            }
+            // A full turn along a 1 m circle
+            float path_position = static_cast<float>(std::max(frame_id, 0)) / benchmark_frames;
+            float angle = glm::two_pi<float>() * path_position;
+            m_scene.camera_position = start_position + glm::vec3(std::sin(angle), 0.0f, std::cos(angle) - 1.0f);
+            m_scene.camera_rot_y = start_rot_y + angle;
+            frame(static_cast<float>(std::max(frame_id, 0)) * frame_time);
+            if (frame_id > 0) {
+                trace_times.push_back(m_renderer.trace_time_ms());
+            }
+        }
+
+        size_t instructions_before = 0u;
+        size_t instructions = 0u;
+        m_scene.shaders.visit([&](const std::string& /*group_name*/, const Shader& shader) {
+            instructions_before += shader.stats.instructions_before;
+            instructions += shader.stats.instructions;
+            });
+        std::ranges::sort(trace_times);
+        float mean = std::accumulate(trace_times.begin(), trace_times.end(), 0.0f) / static_cast<float>(trace_times.size());
+        float median = trace_times[trace_times.size() / 2u];
+        float p95 = trace_times[trace_times.size() * 95u / 100u];
+        report.push_back(json{
+            { "profile", spirv_profile_name(profile) },
+            { "frames", trace_times.size() },
+            { "mean_ms", mean },
+            { "median_ms", median },
+            { "p95_ms", p95 },
+            { "min_ms", trace_times.front() },
+            { "max_ms", trace_times.back() },
+            { "instructions_before", instructions_before },
+            { "instructions", instructions },
+            { "recompile_ms", recompile_time.count() } });
+        fmt::print("Benchmark {}: mean {:.3f} ms, median {:.3f} ms, p95 {:.3f} ms, {} instructions ({} from shaderc)\n",
+            spirv_profile_name(profile), mean, median, p95, instructions, instructions_before);
+    }
+    m_scene.camera_position = start_position;
+    m_scene.camera_rot_y = start_rot_y;
+    m_scene.shaders.spirv_profile = start_profile;
+
+    std::ofstream output(report_path);
+    output << std::setw(4) << json{ { "trace_extent", { m_trace_extent.width, m_trace_extent.height } }, { "profiles", report } } << std::endl;
+    fmt::print("Benchmark report written to {}\n", report_path.string());
+}
+
+void Desktop_app::run_tlas_benchmark(const std::filesystem::path& report_path)
+{
+    using json = nlohmann::json;
+    if (m_scene.group_blas_addresses.empty()) {
+        throw std::runtime_error("TLAS benchmark: the scene need at least one group");
+    }
+    size_t entity_count = m_scene.entities.size();
+
+    json report = json::array();
+    for (size_t count : tlas_benchmark_instances) {
+        // Top level entities on a grid, 1 m apart
+        auto side = static_cast<size_t>(std::ceil(std::cbrt(static_cast<float>(count))));
+        for (size_t i = 0u; i < count; i++) {
+            Entity entity{ .name = fmt::format("tlas_benchmark_{}", i), .group_id = 0u };
+            entity.local_transform.position = glm::vec3(
+                static_cast<float>(i % side), static_cast<float>((i / side) % side), static_cast<float>(i / (side * side)));
+            entity.local_transform.scale = 0.5f;
+            entity.dirty_global = true;
+            m_scene.entities.push_back(std::move(entity));
+        }
+        m_scene.hierarchy_dirty = true;
+
+        // The first frame rebuilds, possibly after growing the TLAS, the next ones only move the instances
+        // With a single command buffer, the time read after a frame is the one of the previous frame
+        size_t rebuilds = m_scene.tlas_stats.rebuilds;
+        size_t reallocations = m_scene.tlas_stats.reallocations;
+        float rebuild_time = 0.0f;
+        std::vector<float> refit_times;
+        refit_times.reserve(tlas_benchmark_frames);
+        for (int frame_id = 0; frame_id <= tlas_benchmark_frames + 1; frame_id++) {
+            if (!m_window.step()) {
+                return;
+            }
+            if (frame_id > 0) {
+                float offset = 0.1f * std::sin(static_cast<float>(frame_id));
+                for (size_t i = entity_count; i < m_scene.entities.size(); i++) {
+                    m_scene.entities[i].local_transform.position.y += offset;
+                    m_scene.entities[i].dirty_global = true;
+                }
+            }
+            frame(static_cast<float>(frame_id) / 60.0f);
+            if (frame_id == 1) {
+                rebuild_time = m_renderer.tlas_time_ms();
+            }
+            else if (frame_id > 1) {
+                refit_times.push_back(m_renderer.tlas_time_ms());
+            }
+        }
+
+        std::ranges::sort(refit_times);
+        float mean = std::accumulate(refit_times.begin(), refit_times.end(), 0.0f) / static_cast<float>(refit_times.size());
+        float median = refit_times[refit_times.size() / 2u];
+        float p95 = refit_times[refit_times.size() * 95u / 100u];
+        report.push_back(json{
+            { "instances", m_scene.entities_instances.size() },
+            { "rebuild_ms", rebuild_time },
+            { "rebuilds", m_scene.tlas_stats.rebuilds - rebuilds },
+            { "reallocations", m_scene.tlas_stats.reallocations - reallocations },
+            { "refit_frames", refit_times.size() },
+            { "refit_mean_ms", mean },
+            { "refit_median_ms", median },
+            { "refit_p95_ms", p95 } });
+        fmt::print("TLAS benchmark {} instances: rebuild {:.3f} ms, refit mean {:.3f} ms, median {:.3f} ms, p95 {:.3f} ms\n",
+            m_scene.entities_instances.size(), rebuild_time, mean, median, p95);
+
+        m_scene.entities.resize(entity_count);
+        m_scene.hierarchy_dirty = true;
+    }
+    frame(0.0f);
+
+    std::ofstream output(report_path);
+    output << std::setw(4) << json{ { "trace_extent", { m_trace_extent.width, m_trace_extent.height } }, { "tlas", report } } << std::endl;
+    fmt::print("TLAS benchmark report written to {}\n", report_path.string());
+}
+
+// A root, 9 children and 90 instanced grandchildren
+static Entity benchmark_tree(size_t tree_id)
+{
+    Entity root{ .name = "root", .group_id = Entity::empty_id };
+    root.local_transform.position = glm::vec3(static_cast<float>(tree_id), 0.0f, 0.0f);
+    for (size_t child_id = 0u; child_id < 9u; child_id++) {
+        Entity child{ .name = "child", .group_id = Entity::empty_id };
+        child.local_transform.position = glm::vec3(0.0f, static_cast<float>(child_id), 0.0f);
+        child.local_transform.rotation = glm::angleAxis(0.1f * static_cast<float>(child_id), glm::vec3(0.0f, 1.0f, 0.0f));
+        for (size_t leaf_id = 0u; leaf_id < 10u; leaf_id++) {
+            Entity leaf{ .name = "leaf", .group_id = 0u };
+            leaf.local_transform.position = glm::vec3(0.0f, 0.0f, static_cast<float>(leaf_id));
+            leaf.local_transform.scale = 0.1f;
+            child.children.push_back(std::move(leaf));
+        }
+        root.children.push_back(std::move(child));
+    }
+    root.dirty_global = true;
+    return root;
+}
+
+void Desktop_app::run_transform_benchmark(const std::filesystem::path& report_path)
+{
+    using json = nlohmann::json;
+    using Duration_ms = std::chrono::duration<float, std::milli>;
+
+    json report = json::array();
+    for (size_t count : transform_benchmark_entities) {
+        Scene scene;
+        scene.entities.reserve(count / 100u);
+        for (size_t tree_id = 0u; tree_id < count / 100u; tree_id++) {
+            scene.entities.push_back(benchmark_tree(tree_id));
+        }
+
+        // Flattening the hierarchy and the first update of every entity
+        auto build_start = Clock::now();
+        Transform_system transform_system(scene);
+        Duration_ms build_time = Clock::now() - build_start;
+
+        auto time_steps = [&scene, &transform_system](auto move_roots) {
+            auto start = Clock::now();
+            for (int step = 1; step <= transform_benchmark_steps; step++) {
+                move_roots(0.01f * static_cast<float>(step));
+                transform_system.step(scene);
+            }
+            Duration_ms time = Clock::now() - start;
+            return time.count() / static_cast<float>(transform_benchmark_steps);
+        };
+        float idle_time = time_steps([](float /*offset*/) {});
+        float sparse_time = time_steps([&scene](float offset) {
+            for (size_t tree_id = 0u; tree_id < scene.entities.size(); tree_id += 100u) {
+                scene.entities[tree_id].local_transform.position.y = offset;
+                scene.entities[tree_id].dirty_global = true;
+            }
+            });
+        float full_time = time_steps([&scene](float offset) {
+            for (auto& root : scene.entities) {
+                root.local_transform.position.y = offset;
+                root.dirty_global = true;
+            }
+            });
+
+        report.push_back(json{
+            { "entities", scene.graph.size() },
+            { "instances", scene.entities_instances.size() },
+            { "build_ms", build_time.count() },
+            { "idle_step_ms", idle_time },
+            { "sparse_step_ms", sparse_time },
+            { "full_step_ms", full_time } });
+        fmt::print("Transform benchmark {} entities: build {:.3f} ms, step {:.3f} ms idle, {:.3f} ms with 1% moving, {:.3f} ms with all moving\n",
+            scene.graph.size(), build_time.count(), idle_time, sparse_time, full_time);
+    }
+
+    std::ofstream output(report_path);
+    output << std::setw(4) << json{ { "transforms", report } } << std::endl;
+    fmt::print("Transform benchmark report written to {}\n", report_path.string());
+}
+
+void Desktop_app::run_transform_scaling_benchmark(const std::filesystem::path& report_path)
+{
+    using json = nlohmann::json;
+    using Duration_ms = std::chrono::duration<float, std::milli>;
+    // Each run binds its own scheduler, marl asserts if the thread already has one, like the one of a Shader_system
+    if (marl::Scheduler::get()) {
+        throw std::runtime_error("Transform scaling benchmark: run it before any scheduler is bound to this thread");
+    }
+
+    // Props under the scene root, moved with it every step so every entity changes
+    auto make_scene = [] {
+        Scene scene;
+        Entity scene_root{ .name = "scene", .group_id = Entity::scene_id };
+        scene_root.children.reserve(scaling_benchmark_props);
+        for (size_t prop_id = 0u; prop_id < scaling_benchmark_props; prop_id++) {
+            scene_root.children.push_back(benchmark_tree(prop_id));
+        }
+        scene_root.dirty_global = true;
+        scene.entities.push_back(std::move(scene_root));
+        return scene;
+    };
+
+    // 0 worker is without scheduler, so without tasks
+    json report = json::array();
+    std::vector<vk::AccelerationStructureInstanceKHR> serial_instances;
+    float serial_time = 0.0f;
+    auto max_workers = static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u));
+    for (int workers = 0; workers <= max_workers; workers++) {
+        std::optional<marl::Scheduler> scheduler;
+        if (workers > 0) {
+            marl::Scheduler::Config config;
+            config.setWorkerThreadCount(workers);
+            scheduler.emplace(config);
+            scheduler->bind();
+        }
+        Scene scene = make_scene();
+        Transform_system transform_system(scene);
+        auto start = Clock::now();
+        for (int step = 1; step <= transform_benchmark_steps; step++) {
+            scene.entities[0].local_transform.position.y = 0.01f * static_cast<float>(step);
+            scene.entities[0].dirty_global = true;
+            transform_system.step(scene);
+        }
+        Duration_ms time = Clock::now() - start;
+        float step_time = time.count() / static_cast<float>(transform_benchmark_steps);
+        if (scheduler) {
+            marl::Scheduler::unbind();
+        }
+
+        if (workers == 0) {
+            serial_instances = scene.entities_instances;
+            serial_time = step_time;
+        }
+        bool deterministic = serial_instances.size() == scene.entities_instances.size() &&
+            std::memcmp(serial_instances.data(), scene.entities_instances.data(), serial_instances.size() * sizeof(vk::AccelerationStructureInstanceKHR)) == 0;
+        report.push_back(json{
+            { "workers", workers },
+            { "step_ms", step_time },
+            { "speedup", serial_time / step_time },
+            { "same_as_serial", deterministic } });
+        fmt::print("Transform scaling benchmark {} workers: {:.3f} ms per step, {:.2f}x serial{}\n",
+            workers, step_time, serial_time / step_time, deterministic ? "" : ", DIFFERENT FROM SERIAL");
+    }
+
+    std::ofstream output(report_path);
+    output << std::setw(4) << json{ { "entities", scaling_benchmark_props * 100u + 1u }, { "chunk_size", Scene_graph::chunk_size }, { "workers", report } } << std::endl;
+    fmt::print("Transform scaling benchmark report written to {}\n", report_path.string());
+}
+
+void Desktop_app::run_instance_transform_benchmark(const std::filesystem::path& report_path)
+{
+    using json = nlohmann::json;
+    using Duration_ms = std::chrono::duration<float, std::milli>;
+    constexpr size_t count = instance_transform_benchmark_count;
 
-        m_json_system.step(m_scene);
-        m_shader_system.step(m_scene);
-        m_ui_system.step(m_scene);
-        m_transform_system.step(m_scene);
-
-        for (size_t eye_id = 0u; eye_id < 2u; eye_id++)
-        {
-            m_scene.scene_global.eyes[eye_id].pose.position.x = m_scene.camera_position.x;
-            m_scene.scene_global.eyes[eye_id].pose.position.y = m_scene.camera_position.y;
-            m_scene.scene_global.eyes[eye_id].pose.position.z = m_scene.camera_position.z;
-            //glm::quat rot = glm::angleAxis(m_scene.camera_rot_y, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::angleAxis(m_scene.camera_rot_z, glm::vec3(0.0f, 0.0f, 1.0f));
-            glm::quat rot(glm::vec3(0.0, m_scene.camera_rot_y, 0.0));
-            m_scene.scene_global.eyes[eye_id].pose.orientation = xr::Quaternionf{ .x = rot.x, .y = rot.y, .z = rot.z, .w = rot.w };
-            float wfov = 1.04;
-            float hfov = std::atan((std::tan(wfov) * m_trace_extent.height) / m_trace_extent.width);
-            m_scene.scene_global.eyes[eye_id].fov.angleUp = hfov;
-            m_scene.scene_global.eyes[eye_id].fov.angleDown = -hfov;
-            m_scene.scene_global.eyes[eye_id].fov.angleRight = wfov;
-            m_scene.scene_global.eyes[eye_id].fov.angleLeft = -wfov;
-        }
-
-        size_t command_pool_id = m_command_pools.find_next();
-        auto& command_buffer = m_command_pools.command_buffers[command_pool_id];
-        m_renderer.update_per_frame_data(m_scene, command_pool_id);
-
-        m_renderer.start_recording(command_buffer, m_scene);
-        m_renderer.trace(command_buffer, m_scene, command_pool_id, m_trace_extent);
-        m_mirror.copy(command_buffer, m_renderer.per_frame[command_pool_id].storage_image.image, command_pool_id, m_trace_extent);
-        m_renderer.end_recording(command_buffer, command_pool_id);
-        command_buffer.end();
-        m_mirror.present(command_buffer, m_command_pools.fences[command_pool_id], command_pool_id);
-    }
-}
-
-}
\ No newline at end of file
+    // Shuffled ids, like the scattered nodes changed in a step
+    Scene_graph graph;
+    graph.global_positions.resize(count);
+    graph.global_rotations.resize(count);
+    graph.global_scales.resize(count);
+    graph.flip_axes.resize(count);
+    std::vector<uint32_t> ids(count);
+    for (uint32_t id = 0u; id < count; id++) {
+        float angle = 0.001f * static_cast<float>(id);
+        graph.global_positions[id] = glm::vec3(std::cos(angle), std::sin(angle), angle);
+        graph.global_rotations[id] = glm::angleAxis(angle, glm::normalize(glm::vec3(1.0f, std::cos(angle), 0.5f)));
+        graph.global_scales[id] = 0.5f + std::fmod(angle, 1.0f);
+        graph.flip_axes[id] = glm::vec3(id % 2u ? -1.0f : 1.0f, 1.0f, 1.0f);
+        ids[id] = static_cast<uint32_t>(uint64_t{ id } * 7919u % count);  // 7919 is prime, so a permutation
+    }
+
+    // The conversion done for each instance before the batched kernels
+    std::vector<Instance_transform> reference(count);
+    auto glm_transforms = [&graph, &ids](Instance_transform* transforms) {
+        for (size_t i = 0u; i < ids.size(); i++) {
+            uint32_t id = ids[i];
+            glm::mat4 inv = glm::translate(graph.global_positions[id]) * glm::toMat4(graph.global_rotations[id]) * glm::scale(graph.flip_axes[id]) * glm::scale(glm::vec3(graph.global_scales[id]));
+            transforms[i] = Instance_transform{
+                std::array<float, 4>{ inv[0].x, inv[1].x, inv[2].x, inv[3].x },
+                std::array<float, 4>{ inv[0].y, inv[1].y, inv[2].y, inv[3].y },
+                std::array<float, 4>{ inv[0].z, inv[1].z, inv[2].z, inv[3].z } };
+        }
+    };
+    auto best_time = [](auto convert) {
+        float best = std::numeric_limits<float>::max();
+        for (int run = 0; run < instance_transform_benchmark_runs; run++) {
+            auto start = Clock::now();
+            convert();
+            Duration_ms time = Clock::now() - start;
+            best = std::min(best, time.count());
+        }
+        return best;
+    };
+
+    float glm_time = best_time([&] { glm_transforms(reference.data()); });
+    json report = json::array();
+    report.push_back(json{ { "path", "glm" }, { "ms", glm_time }, { "speedup", 1.0f }, { "max_error", 0.0f } });
+    fmt::print("Instance transform benchmark glm: {:.3f} ms for {} instances\n", glm_time, count);
+
+    std::vector<Instance_transform> transforms(count);
+    for (auto level : { Simd_level::scalar, Simd_level::sse2, Simd_level::avx2 }) {
+        if (level > best_simd_level()) {
+            continue;
+        }
+        float time = best_time([&] { instance_transforms(graph, ids.data(), count, transforms.data(), level); });
+        float max_error = 0.0f;
+        for (size_t i = 0u; i < count; i++) {
+            for (size_t row = 0u; row < 3u; row++) {
+                for (size_t column = 0u; column < 4u; column++) {
+                    max_error = std::max(max_error, std::abs(transforms[i][row][column] - reference[i][row][column]));
+                }
+            }
+        }
+        report.push_back(json{ { "path", simd_level_name(level) }, { "ms", time }, { "speedup", glm_time / time }, { "max_error", max_error } });
+        fmt::print("Instance transform benchmark {}: {:.3f} ms, {:.2f}x glm, max error {}\n", simd_level_name(level), time, glm_time / time, max_error);
+    }
+
+    std::ofstream output(report_path);
+    output << std::setw(4) << json{ { "instances", count }, { "paths", report } } << std::endl;
+    fmt::print("Instance transform benchmark report written to {}\n", report_path.string());
+}
+
+bool Desktop_app::shaders_ready(Spirv_profile profile) const
+{
+    const auto& shaders = m_scene.shaders;
+    bool ready = !shaders.pipeline_dirty && !shaders.pipeline_building;
+    shaders.visit([&ready, profile](const std::string& /*group_name*/, const Shader& shader) {
+        if (!shader.error.empty()) {
+            throw std::runtime_error("Benchmark: every shader need to compile");
+        }
+        ready = ready && shader.tier == Shader_tier::optimized && shader.stats.profile == profile;
+        });
+    return ready;
+}
+
+void Desktop_app::frame(float time)
+{
+    m_scene.scene_global.time = time;
+    m_scene.scene_global.nb_lights = static_cast<int>(std::ssize(m_scene.lights));
+
+    m_json_system.step(m_scene);
+    m_shader_system.step(m_scene);
+    m_ui_system.step(m_scene);
+    m_transform_system.step(m_scene);
+
+    for (size_t eye_id = 0u; eye_id < 2u; eye_id++)
+    {
+        m_scene.scene_global.eyes[eye_id].pose.position.x = m_scene.camera_position.x;
+        m_scene.scene_global.eyes[eye_id].pose.position.y = m_scene.camera_position.y;
+        m_scene.scene_global.eyes[eye_id].pose.position.z = m_scene.camera_position.z;
+        //glm::quat rot = glm::angleAxis(m_scene.camera_rot_y, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::angleAxis(m_scene.camera_rot_z, glm::vec3(0.0f, 0.0f, 1.0f));
+        glm::quat rot(glm::vec3(0.0, m_scene.camera_rot_y, 0.0));
+        m_scene.scene_global.eyes[eye_id].pose.orientation = xr::Quaternionf{ .x = rot.x, .y = rot.y, .z = rot.z, .w = rot.w };
+        float wfov = 1.04;
+        float hfov = std::atan((std::tan(wfov) * m_trace_extent.height) / m_trace_extent.width);
+        m_scene.scene_global.eyes[eye_id].fov.angleUp = hfov;
+        m_scene.scene_global.eyes[eye_id].fov.angleDown = -hfov;
+        m_scene.scene_global.eyes[eye_id].fov.angleRight = wfov;
+        m_scene.scene_global.eyes[eye_id].fov.angleLeft = -wfov;
+    }
+
+    size_t command_pool_id = m_command_pools.find_next();
+    auto& command_buffer = m_command_pools.command_buffers[command_pool_id];
+    m_renderer.update_per_frame_data(m_scene, command_pool_id);
+
+    m_renderer.start_recording(command_buffer, m_scene, command_pool_id);
+    m_renderer.trace(command_buffer, m_scene, command_pool_id, m_trace_extent);
+    m_mirror.copy(command_buffer, m_renderer.per_frame[command_pool_id].storage_image.image, command_pool_id, m_trace_extent);
+    m_renderer.end_recording(command_buffer, command_pool_id);
+    command_buffer.end();
+    m_mirror.present(command_buffer, m_command_pools.fences[command_pool_id], command_pool_id);
+}
+
+void Desktop_app::run_grab_query_benchmark(const std::filesystem::path& report_path)
+{
+    using json = nlohmann::json;
+    using Duration_us = std::chrono::duration<float, std::micro>;
+
+    json report = json::array();
+    for (size_t count : grab_benchmark_entities) {
+        Scene scene;
+        for (size_t hand_id = 0u; hand_id < Scene::hand_count; hand_id++) {
+            scene.entities.push_back(Entity{ .name = "hand", .group_id = Entity::empty_id });
+        }
+        for (size_t tree_id = 0u; tree_id < count / 100u; tree_id++) {
+            scene.entities.push_back(benchmark_tree(tree_id));
+        }
+        Transform_system transform_system(scene);
+        const auto& graph = scene.graph;
+
+        // Half the points next to a leaf, half between them
+        std::vector<glm::vec3> points(grab_benchmark_queries);
+        for (size_t i = 0u; i < points.size(); i++) {
+            auto id = static_cast<uint32_t>(uint64_t{ i } * 7919u % graph.size());
+            points[i] = graph.global_positions[id] + glm::vec3(i % 2u == 0u ? 0.01f : 0.5f);
+        }
+
+        // What Scene_vr_input did before, a visit of every entity, keeping the nearest for the comparison
+        std::vector<Entity*> visit_candidates(points.size());
+        auto visit_start = Clock::now();
+        for (size_t i = 0u; i < points.size(); i++) {
+            float best_distance = std::numeric_limits<float>::infinity();
+            for (size_t p_id = Scene::hand_count; p_id < scene.entities.size(); p_id++) {
+                scene.entities[p_id].visit([&points, &best_distance, &visit_candidates, i](Entity& entity) {
+                    float distance2 = glm::length2(entity.global_transform.position - points[i]);
+                    float scale = entity.global_transform.scale;
+                    if (entity.group_id < Entity::empty_id && distance2 <= 0.25f * scale * scale && distance2 < best_distance) {
+                        best_distance = distance2;
+                        visit_candidates[i] = &entity;
+                    }
+                    });
+            }
+        }
+        Duration_us visit_time = Clock::now() - visit_start;
+
+        size_t mismatches = 0u;
+        auto bvh_start = Clock::now();
+        for (size_t i = 0u; i < points.size(); i++) {
+            const glm::vec3& point = points[i];
+            uint32_t node = scene.entity_bvh.nearest(point, [&graph, &point](uint32_t id) {
+                float distance2 = glm::length2(graph.global_positions[id] - point);
+                float scale = graph.global_scales[id];
+                if (graph.group_ids[id] >= Entity::empty_id || distance2 > 0.25f * scale * scale) {
+                    return std::numeric_limits<float>::infinity();
+                }
+                return distance2;
+                });
+            Entity* candidate = node != Entity_bvh::no_node ? graph.entities[node] : nullptr;
+            mismatches += candidate != visit_candidates[i] ? 1u : 0u;
+        }
+        Duration_us bvh_time = Clock::now() - bvh_start;
+
+        // 1% of the trees moved, then a tree added and another removed, the steps keep the BVH up to date
+        for (size_t tree_id = Scene::hand_count; tree_id < scene.entities.size(); tree_id += 100u) {
+            scene.entities[tree_id].local_transform.position.y += 0.1f;
+            scene.entities[tree_id].dirty_global = true;
+        }
+        auto move_start = Clock::now();
+        transform_system.step(scene);
+        Duration_us move_time = Clock::now() - move_start;
+
+        size_t rebuilds = scene.entity_bvh.rebuilds();
+        scene.entities.push_back(benchmark_tree(count / 100u));
+        scene.entities.erase(scene.entities.begin() + Scene::hand_count);
+        scene.hierarchy_dirty = true;
+        auto edit_start = Clock::now();
+        transform_system.step(scene);
+        Duration_us edit_time = Clock::now() - edit_start;
+
+        auto queries = static_cast<float>(points.size());
+        report.push_back(json{
+            { "entities", graph.size() },
+            { "leaves", scene.entity_bvh.leaf_count() },
+            { "height", scene.entity_bvh.height() },
+            { "visit_query_us", visit_time.count() / queries },
+            { "bvh_query_us", bvh_time.count() / queries },
+            { "move_step_us", move_time.count() },
+            { "edit_step_us", edit_time.count() },
+            { "edit_rebuilt", scene.entity_bvh.rebuilds() != rebuilds },
+            { "reinsertions", scene.entity_bvh.reinsertions() },
+            { "mismatches", mismatches } });
+        fmt::print("Grab query benchmark {} entities: {:.3f} us per query with the BVH, {:.3f} us with a visit, step {:.1f} us with 1% moving, {:.1f} us with a tree added and removed{}\n",
+            graph.size(), bvh_time.count() / queries, visit_time.count() / queries, move_time.count(), edit_time.count(),
+            mismatches == 0u ? "" : fmt::format(", {} DIFFERENT CANDIDATES", mismatches));
+    }
+
+    std::ofstream output(report_path);
+    output << std::setw(4) << json{ { "grab_queries", report } } << std::endl;
+    fmt::print("Grab query benchmark report written to {}\n", report_path.string());
+}
+
+bool run_command_line_benchmark(int argc, char* argv[], const Desktop_app_factory& make_app)
+{
+    std::vector<std::string_view> args(argv + 1, argv + argc);
+    auto flag = std::ranges::find(args, "--benchmark");
+    if (flag == args.end()) {
+        return false;
+    }
+    constexpr std::string_view usage = "usage: --benchmark <name> <report.json>, name among trace, tlas, transform, instance_transforms, transform_scaling, grab_queries";
+    if (std::distance(flag, args.end()) < 3) {
+        throw std::runtime_error(std::string(usage));
+    }
+    std::string_view name = flag[1];
+    std::filesystem::path report_path(flag[2]);
+    if (name == "trace") {
+        make_app()->run_benchmark(report_path);
+    }
+    else if (name == "tlas") {
+        make_app()->run_tlas_benchmark(report_path);
+    }
+    else if (name == "transform") {
+        Desktop_app::run_transform_benchmark(report_path);
+    }
+    else if (name == "instance_transforms") {
+        Desktop_app::run_instance_transform_benchmark(report_path);
+    }
+    else if (name == "transform_scaling") {
+        Desktop_app::run_transform_scaling_benchmark(report_path);
+    }
+    else if (name == "grab_queries") {
+        Desktop_app::run_grab_query_benchmark(report_path);
+    }
+    else {
+        throw std::runtime_error(fmt::format("Unknown benchmark {}, {}", name, usage));
+    }
+    return true;
+}
+
+}
@@ -16,6 +16,8 @@
 #include "engine/input_glfw_system.hpp"
 #include "engine/json_system.hpp"
 
+#include <array>
+#include <functional>
 #include <memory>
 #include <optional>
 
@@ -60,6 +62,20 @@ public:
     ~Desktop_app();
 
     void run();
+    // Trace the same camera path once per SPIR-V profile, write the GPU trace times to a json report
+    void run_benchmark(const std::filesystem::path& report_path);
+    // Add 1k, 10k then 100k instances of the first group, write the GPU times of the TLAS rebuild and refits to a json report
+    void run_tlas_benchmark(const std::filesystem::path& report_path);
+    // Time the Transform_system on hierarchies of 10k, 100k then 1M entities, CPU only so no app is needed
+    static void run_transform_benchmark(const std::filesystem::path& report_path);
+    // Time the Transform_system on props under the scene root, without scheduler then with 1 to N worker threads
+    // Binds its own schedulers, so it runs before any app exists
+    static void run_transform_scaling_benchmark(const std::filesystem::path& report_path);
+    // Time the conversion of 1M transforms to instance matrices with glm and with each SIMD level the CPU supports
+    static void run_instance_transform_benchmark(const std::filesystem::path& report_path);
+    // Time the grab candidate search with the Entity_bvh and with a visit of every entity, then the steps keeping the BVH up to date
+    // after a move and a hierarchy edit, on 1k, 10k then 100k entities
+    static void run_grab_query_benchmark(const std::filesystem::path& report_path);
 private:
     struct Imgui_context {
         Imgui_context() {
@@ -92,6 +108,27 @@ private:
     vulkan::Renderer m_renderer;
     vulkan::Desktop_mirror m_mirror;
     vulkan::Reusable_command_pools m_command_pools;
+
+    static constexpr int benchmark_warmup_frames = 30;
+    static constexpr int benchmark_frames = 600;
+    static constexpr std::array<size_t, 3> tlas_benchmark_instances{ 1'000u, 10'000u, 100'000u };
+    static constexpr int tlas_benchmark_frames = 120;
+    static constexpr std::array<size_t, 3> transform_benchmark_entities{ 10'000u, 100'000u, 1'000'000u };
+    static constexpr int transform_benchmark_steps = 20;
+    static constexpr size_t scaling_benchmark_props = 2'000u;
+    static constexpr size_t instance_transform_benchmark_count = 1'000'000u;
+    static constexpr int instance_transform_benchmark_runs = 20;
+    static constexpr std::array<size_t, 3> grab_benchmark_entities{ 1'000u, 10'000u, 100'000u };
+    static constexpr size_t grab_benchmark_queries = 10'000u;
+
+    void frame(float time);
+    // Every shader compiled with the profile and the pipeline using them swapped in
+    [[nodiscard]] bool shaders_ready(Spirv_profile profile) const;
 };
 
+using Desktop_app_factory = std::function<std::unique_ptr<Desktop_app>()>;
+// With --benchmark <name> <report.json> in the arguments, run that benchmark and return true so the main exits
+// Only the GPU benchmarks create the app with make_app
+[[nodiscard]] bool run_command_line_benchmark(int argc, char* argv[], const Desktop_app_factory& make_app);
+
 }
\ No newline at end of file
@@ -0,0 +1,134 @@
+#include "file_watcher.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <fmt/core.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace sdf_editor
+{
+
+static std::optional<std::string> read_file(const std::filesystem::path& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return std::nullopt;  // Removed again since the event, the next one will tell
+    }
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+File_watcher::File_watcher(std::vector<std::filesystem::path> directories, Filter filter) :
+    m_directories(std::move(directories)),
+    m_filter(std::move(filter))
+{
+#ifdef __linux__
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_fd < 0) {
+        fmt::print("File watcher: inotify_init1 failed, external edits won't be reloaded\n");
+        return;
+    }
+    for (const auto& directory : m_directories) {
+        // Close after write for editors writing in place, moved to for editors (and File_writer) renaming a temporary file
+        m_watch_descriptors.push_back(inotify_add_watch(m_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO));
+        if (m_watch_descriptors.back() < 0) {
+            fmt::print("File watcher: can't watch {}\n", directory.string());
+        }
+    }
+    m_thread = std::thread([this] { run(); });
+#else
+    fmt::print("File watcher: only supported on Linux, external edits won't be reloaded\n");
+#endif
+}
+
+File_watcher::~File_watcher()
+{
+    m_stop.store(true, std::memory_order_relaxed);
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+#ifdef __linux__
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+#endif
+}
+
+#ifdef __linux__
+void File_watcher::run()
+{
+    std::vector<std::pair<int, std::string>> changed;
+    pollfd poll_fd{ .fd = m_fd, .events = POLLIN };
+    while (!m_stop.load(std::memory_order_relaxed)) {
+        if (::poll(&poll_fd, 1, stop_check_ms) <= 0) {
+            continue;
+        }
+        do {
+            read_events(changed);
+        } while (::poll(&poll_fd, 1, settle_delay_ms) > 0);
+
+        std::ranges::sort(changed);
+        changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+        for (auto& [directory_id, name] : changed) {
+            auto data = read_file(m_directories[directory_id] / name);
+            if (!data) {
+                continue;
+            }
+            Change change{
+                .directory_id = directory_id,
+                .name = std::move(name),
+                .data = std::make_shared<const std::string>(std::move(*data))
+            };
+            // The frame thread empty the queue every step, a full queue only happen if it is stalled
+            while (!m_changes.push(std::move(change))) {
+                if (m_stop.load(std::memory_order_relaxed)) {
+                    return;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(stop_check_ms));
+            }
+        }
+        changed.clear();
+    }
+}
+
+void File_watcher::read_events(std::vector<std::pair<int, std::string>>& changed) const
+{
+    alignas(inotify_event) char buffer[4096];
+    while (true) {
+        ssize_t length = read(m_fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            return;  // EAGAIN, everything is read
+        }
+        for (char* ptr = buffer; ptr < buffer + length; ) {
+            const auto* event = reinterpret_cast<const inotify_event*>(ptr);
+            ptr += sizeof(inotify_event) + event->len;
+            if (event->len == 0u || (event->mask & IN_ISDIR)) {
+                continue;
+            }
+            auto it = std::ranges::find(m_watch_descriptors, event->wd);
+            if (it == m_watch_descriptors.end()) {
+                continue;
+            }
+            int directory_id = static_cast<int>(std::distance(m_watch_descriptors.begin(), it));
+            std::string_view name(event->name);
+            // Temporary and backup files of editors
+            if (name.starts_with('.') || name.ends_with('~') || name.ends_with(".tmp") || name.ends_with(".swp")) {
+                continue;
+            }
+            if (!m_filter || m_filter(directory_id, name)) {
+                changed.emplace_back(directory_id, std::string(name));
+            }
+        }
+    }
+}
+#else
+void File_watcher::run() {}
+void File_watcher::read_events(std::vector<std::pair<int, std::string>>&) const {}
+#endif
+
+}
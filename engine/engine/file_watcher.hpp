@@ -0,0 +1,57 @@
+#pragma once
+#include "spsc_queue.hpp"
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace sdf_editor
+{
+
+// Watch directories for files written by another program (inotify, Linux only)
+// The watcher thread read the new content itself so the frame thread never touch the disk
+class File_watcher
+{
+public:
+    struct Change
+    {
+        int directory_id;  // Index in the directories given to the constructor
+        std::string name;
+        std::shared_ptr<const std::string> data;
+    };
+    // Called from the watcher thread, only files accepted by the filter are read
+    using Filter = std::function<bool(int directory_id, std::string_view name)>;
+
+    File_watcher(std::vector<std::filesystem::path> directories, Filter filter = {});
+    File_watcher(const File_watcher& other) = delete;
+    File_watcher(File_watcher&& other) = delete;
+    File_watcher& operator=(const File_watcher& other) = delete;
+    File_watcher& operator=(File_watcher&& other) = delete;
+    ~File_watcher();
+
+    // Never block, return the changes in the order they were detected
+    [[nodiscard]] std::optional<Change> poll() { return m_changes.pop(); }
+private:
+    // Editors often save in several steps (truncate, write, rename), wait for the burst to end
+    static constexpr int settle_delay_ms = 30;
+    static constexpr int stop_check_ms = 100;
+
+    std::vector<std::filesystem::path> m_directories;
+    Filter m_filter;
+    Spsc_queue<Change, 64> m_changes;
+    std::atomic<bool> m_stop{ false };
+    int m_fd = -1;
+    std::vector<int> m_watch_descriptors;
+    std::thread m_thread;
+
+    void run();
+    // Append the (directory id, name) pairs of the pending events
+    void read_events(std::vector<std::pair<int, std::string>>& changed) const;
+};
+
+}
@@ -0,0 +1,113 @@
+#include "file_writer.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <fmt/core.h>
+
+namespace sdf_editor
+{
+
+File_writer::File_writer() :
+    m_thread([this] { run(); })
+{
+}
+
+File_writer::~File_writer()
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake_up.notify_one();
+    // Pending requests are written before the thread exit
+    m_thread.join();
+}
+
+void File_writer::write(std::filesystem::path path, std::shared_ptr<const std::string> data)
+{
+    {
+        std::lock_guard lock(m_mutex);
+        auto [it, inserted] = m_requests.try_emplace(std::move(path), Request{ .request_time = Clock::now() });
+        if (!inserted) {
+            // Keep the time of the first request to measure the real latency
+            m_stats.coalesced++;
+        }
+        it->second.data = std::move(data);
+    }
+    m_wake_up.notify_one();
+}
+
+void File_writer::flush()
+{
+    std::unique_lock lock(m_mutex);
+    m_idle.wait(lock, [this] { return m_requests.empty() && !m_writing; });
+}
+
+File_writer::Stats File_writer::stats()
+{
+    std::lock_guard lock(m_mutex);
+    return m_stats;
+}
+
+void File_writer::run()
+{
+    std::unique_lock lock(m_mutex);
+    while (true) {
+        m_wake_up.wait(lock, [this] { return m_stop || !m_requests.empty(); });
+        if (m_requests.empty()) {
+            return;  // Stopping and everything is written
+        }
+        auto node = m_requests.extract(m_requests.begin());
+        m_writing = true;
+        lock.unlock();
+
+        bool success = write_file(node.key(), *node.mapped().data);
+        std::chrono::duration<float, std::milli> latency = Clock::now() - node.mapped().request_time;
+
+        lock.lock();
+        m_writing = false;
+        if (success) {
+            m_stats.writes++;
+            m_stats.last_latency_ms = latency.count();
+            m_stats.max_latency_ms = std::max(m_stats.max_latency_ms, latency.count());
+        }
+        else {
+            m_stats.failures++;
+        }
+        if (m_requests.empty()) {
+            m_idle.notify_all();
+        }
+    }
+}
+
+bool File_writer::write_file(const std::filesystem::path& path, const std::string& data)
+{
+    if (!std::filesystem::is_regular_file(path)) {
+        fmt::print("Can't save {}: not a regular file\n", path.string());
+        return false;
+    }
+    auto temp_path = path;
+    temp_path += ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::trunc | std::ios::binary);
+        if (!file.is_open()) {
+            fmt::print("Can't save {}: failed to open {}\n", path.string(), temp_path.string());
+            return false;
+        }
+        file.write(data.data(), data.size());
+        if (!file) {
+            fmt::print("Can't save {}: write failed\n", path.string());
+            return false;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temp_path, path, error);
+    if (error) {
+        fmt::print("Can't save {}: {}\n", path.string(), error.message());
+        std::filesystem::remove(temp_path, error);
+        return false;
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace sdf_editor
+{
+
+// Write files on a background thread so a slow disk never stall the frame loop
+// Several saves of the same file before it is written are merged, only the latest content reach the disk
+// Files are written to a temporary file then renamed so a crash never leave a truncated shader
+class File_writer
+{
+public:
+    struct Stats
+    {
+        size_t writes = 0u;
+        size_t coalesced = 0u;
+        size_t failures = 0u;
+        float last_latency_ms = 0.0f;  // From the request to the rename
+        float max_latency_ms = 0.0f;
+    };
+
+    File_writer();
+    File_writer(const File_writer& other) = delete;
+    File_writer(File_writer&& other) = delete;
+    File_writer& operator=(const File_writer& other) = delete;
+    File_writer& operator=(File_writer&& other) = delete;
+    ~File_writer();
+
+    // Never touch the disk, the data is kept alive until written
+    void write(std::filesystem::path path, std::shared_ptr<const std::string> data);
+    // Block until every requested write is on disk
+    void flush();
+    [[nodiscard]] Stats stats();
+private:
+    using Clock = std::chrono::steady_clock;
+    struct Request
+    {
+        std::shared_ptr<const std::string> data;
+        Clock::time_point request_time;
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake_up;
+    std::condition_variable m_idle;
+    std::map<std::filesystem::path, Request> m_requests;
+    bool m_writing = false;
+    bool m_stop = false;
+    Stats m_stats;
+    std::thread m_thread;
+
+    void run();
+    [[nodiscard]] static bool write_file(const std::filesystem::path& path, const std::string& data);
+};
+
+}
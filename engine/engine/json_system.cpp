@@ -1,7 +1,11 @@
 #include "json_system.hpp"
 #include "core/scene.hpp"
 #include <nlohmann/json.hpp>
+#include <algorithm>
 #include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <fmt/core.h>
 #include <glm/glm.hpp>
 
 using json = nlohmann::json;
@@ -73,55 +77,150 @@ static Entity to_entity(const json& j) {
     return entity;
 }
 
-Json_system::Json_system(Scene& scene, std::filesystem::path path):
-    m_path(std::move(path))
+struct Json_scene
 {
-    parse(scene);
-}
+    std::vector<Entity> entities;
+    std::vector<Material> materials;
+    std::vector<Light> lights;
+};
 
-void Json_system::parse(Scene& scene)
+static Json_scene to_scene(const json& j)
 {
-    std::ifstream stream(m_path);
-    json j;
-    stream >> j;
-
-    const json& entities = j["entities"];
-    Entity& root = scene.entities.back();
-    root.children.clear();
-    root.children.reserve(entities.size());
+    Json_scene result;
+    const json& entities = j.at("entities");
+    result.entities.reserve(entities.size());
     for (const auto& entity : entities)
     {
-        root.children.emplace_back(to_entity(entity));
+        result.entities.emplace_back(to_entity(entity));
     }
 
-    const json& materials = j["materials"];
-    scene.materials.clear();
-    scene.materials.reserve(materials.size());
+    const json& materials = j.at("materials");
+    result.materials.reserve(materials.size());
     for (const auto& material : materials)
     {
-        scene.materials.push_back(Material{ 
+        result.materials.push_back(Material{ 
             .color = to_vec4(material["color"]),
             .ks = material["ks"],
             .shininess = material["shininess"],
             .f0 = material["f0"] });
     }
 
-    const json& lights = j["lights"];
-    scene.lights.clear();
-    scene.lights.reserve(lights.size());
+    const json& lights = j.at("lights");
+    result.lights.reserve(lights.size());
     for (const auto& light : lights)
     {
-        scene.lights.push_back(Light{ .local = to_vec3(light["position"]), .color = to_vec3(light["color"]) });
+        result.lights.push_back(Light{ .local = to_vec3(light["position"]), .color = to_vec3(light["color"]) });
     }
+    return result;
+}
+
+// Keep the entities that didn't change untouched, return the number of changed entities
+static size_t merge_entity(Entity& entity, Entity&& updated, bool& hierarchy_dirty)
+{
+    if (entity.name != updated.name || entity.group_id != updated.group_id || entity.children.size() != updated.children.size()) {
+        entity = std::move(updated);
+        entity.dirty_global = true;
+        hierarchy_dirty = true;
+        return 1u;
+    }
+    size_t changed = 0u;
+    if (!(entity.local_transform == updated.local_transform)) {
+        entity.local_transform = updated.local_transform;
+        entity.dirty_global = true;
+        changed++;
+    }
+    for (size_t i = 0u; i < entity.children.size(); i++) {
+        changed += merge_entity(entity.children[i], std::move(updated.children[i]), hierarchy_dirty);
+    }
+    return changed;
+}
+
+Json_system::Json_system(Scene& scene, std::filesystem::path path):
+    m_path(std::move(path)),
+    m_file_watcher(
+        { std::filesystem::absolute(m_path).parent_path() },
+        [name = m_path.filename().string()](int /*directory_id*/, std::string_view file_name) { return file_name == name; })
+{
+    parse(scene);
+}
+
+void Json_system::parse(Scene& scene)
+{
+    std::ifstream stream(m_path);
+    json j;
+    stream >> j;
+    auto parsed = to_scene(j);
+
+    Entity& root = scene.entities.back();
+    root.children = std::move(parsed.entities);
+    scene.materials = std::move(parsed.materials);
+    scene.lights = std::move(parsed.lights);
 
     for (auto& entity : scene.entities) {
         entity.dirty_global = true;
     }
+    scene.hierarchy_dirty = true;
     for (auto& light : scene.lights) {
         light.update(root.global_transform);
     }
 }
 
+void Json_system::reload(Scene& scene, const std::string& data)
+{
+    Json_scene parsed;
+    try {
+        parsed = to_scene(json::parse(data));
+    }
+    catch (const json::exception& e) {
+        // Probably saved in the middle of an edit, wait for the next save
+        fmt::print("Can't reload {}: {}\n", m_path.string(), e.what());
+        return;
+    }
+
+    Entity& root = scene.entities.back();
+    size_t entities_changed = 0u;
+    size_t common_count = std::min(root.children.size(), parsed.entities.size());
+    for (size_t i = 0u; i < common_count; i++) {
+        entities_changed += merge_entity(root.children[i], std::move(parsed.entities[i]), scene.hierarchy_dirty);
+    }
+    if (root.children.size() != parsed.entities.size()) {
+        entities_changed += std::max(root.children.size(), parsed.entities.size()) - common_count;
+        root.children.resize(common_count);
+        scene.hierarchy_dirty = true;
+        for (size_t i = common_count; i < parsed.entities.size(); i++) {
+            auto& added = root.children.emplace_back(std::move(parsed.entities[i]));
+            added.dirty_global = true;
+        }
+    }
+
+    size_t materials_changed = 0u;
+    scene.materials.resize(parsed.materials.size());
+    for (size_t i = 0u; i < parsed.materials.size(); i++) {
+        auto& material = scene.materials[i];
+        const auto& updated = parsed.materials[i];
+        if (material.color != updated.color || material.ks != updated.ks || material.shininess != updated.shininess || material.f0 != updated.f0) {
+            material = updated;
+            materials_changed++;
+        }
+    }
+
+    size_t lights_changed = 0u;
+    scene.lights.resize(parsed.lights.size());
+    for (size_t i = 0u; i < parsed.lights.size(); i++) {
+        auto& light = scene.lights[i];
+        const auto& updated = parsed.lights[i];
+        if (light.local != updated.local || light.color != updated.color) {
+            light.local = updated.local;
+            light.color = updated.color;
+            light.update(root.global_transform);
+            lights_changed++;
+        }
+    }
+
+    fmt::print("Reloaded {}: {} entities, {} materials, {} lights changed\n",
+        m_path.filename().string(), entities_changed, materials_changed, lights_changed);
+}
+
 void Json_system::write_to_file(const Scene& scene)
 {
     json entities;
@@ -151,8 +250,11 @@ void Json_system::write_to_file(const Scene& scene)
     j["materials"] = materials;
     j["lights"] = lights;
 
+    std::ostringstream stream;
+    stream << std::setw(4) << j << std::endl;
+    m_written = stream.str();
     std::ofstream ouput(m_path);
-    ouput << std::setw(4) << j << std::endl;
+    ouput << m_written;
 }
 
 
@@ -164,6 +266,15 @@ void Json_system::step(Scene& scene)
     if (scene.resetting) {
         parse(scene);
     }
+    // Only the latest version matter if several saves are waiting
+    std::shared_ptr<const std::string> data;
+    while (auto change = m_file_watcher.poll()) {
+        data = std::move(change->data);
+    }
+    // Our own save come back through the watcher too
+    if (data && *data != m_written) {
+        reload(scene, *data);
+    }
 }
 
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #pragma once
 #include "core/system.hpp"
+#include "file_watcher.hpp"
 #include <filesystem>
+#include <string>
 
 namespace sdf_editor
 {
@@ -17,11 +19,15 @@ public:
 	~Json_system() override = default;
 
 	void parse(Scene& scene);
+	// Apply an external edit of the file, only the entities, materials and lights that changed are touched
+	void reload(Scene& scene, const std::string& data);
 	void write_to_file(const Scene& scene);
 
 	void step(Scene& scene) override final;
 private:
 	std::filesystem::path m_path;
+	std::string m_written;  // Last content saved by write_to_file
+	File_watcher m_file_watcher;
 };
 
 }
\ No newline at end of file
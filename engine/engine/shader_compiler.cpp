@@ -0,0 +1,324 @@
+#include "shader_compiler.hpp"
+#include "spirv_optimizer.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <fmt/core.h>
+#include <spirv-tools/libspirv.h>
+
+namespace sdf_editor
+{
+
+class Includer : public shaderc::CompileOptions::IncluderInterface
+{
+public:
+    Includer(
+        std::vector<int>& included_file_id,
+        const Shader_dependencies& dependencies,
+        const std::vector<Shader_file>& engine_files,
+        const std::vector<Shader_file>& scene_files,
+        const std::string& group_name) :
+        m_included_file_id(included_file_id), m_dependencies(dependencies), m_engine_files(engine_files), m_scene_files(scene_files), m_group_name(group_name)
+    {}
+
+    shaderc_include_result* GetInclude(
+        const char* requested_source,
+        shaderc_include_type /*type*/,
+        const char* /*requesting_source*/,
+        size_t /*include_depth*/) override final
+    {
+        if (!m_group_name.empty() && strcmp(requested_source, "map_function") == 0) {
+            requested_source = m_group_name.c_str();
+        }
+        int file_id = m_dependencies.find_file(requested_source);
+        // An empty source name tells shaderc the include failed, the content is then the error message
+        if (file_id < 0) {
+            m_error = fmt::format("Unknown include file {}", requested_source);
+            data_holder.content = m_error.data();
+            data_holder.content_length = m_error.size();
+            data_holder.source_name = "";
+            data_holder.source_name_length = 0u;
+            data_holder.user_data = nullptr;
+            return &data_holder;
+        }
+        m_included_file_id.push_back(file_id);
+        const Shader_file& included_shader = m_dependencies.is_engine_file(file_id) ?
+            m_engine_files[file_id] :
+            m_scene_files[m_dependencies.scene_file_id(file_id)];
+
+        data_holder.content = included_shader.data->data();
+        data_holder.content_length = included_shader.data->size();
+        data_holder.source_name = included_shader.name.c_str();
+        data_holder.source_name_length = included_shader.name.size();
+        data_holder.user_data = nullptr;
+        return &data_holder;
+    }
+
+    void ReleaseInclude(shaderc_include_result* /*data*/) override final {}
+private:
+    shaderc_include_result data_holder;
+    std::string m_error;
+    std::vector<int>& m_included_file_id;
+    const Shader_dependencies& m_dependencies;
+    const std::vector<Shader_file>& m_engine_files;
+    const std::vector<Shader_file>& m_scene_files;
+    const std::string& m_group_name;
+};
+
+// Everything set on the shaderc options, the cache key is derived from the same values so they can't drift apart
+struct Compile_settings
+{
+    shaderc_optimization_level optimization_level;
+    bool warnings_as_errors;
+    shaderc_target_env target_env;
+    shaderc_env_version env_version;
+    shaderc_spirv_version spirv_version;
+    bool debug_info;
+};
+
+static shaderc::CompileOptions make_compile_options(const Compile_settings& settings)
+{
+    shaderc::CompileOptions options;
+    options.SetOptimizationLevel(settings.optimization_level);
+    if (settings.warnings_as_errors) {
+        options.SetWarningsAsErrors();
+    }
+    options.SetTargetEnvironment(settings.target_env, settings.env_version);
+    options.SetTargetSpirv(settings.spirv_version);
+    if (settings.debug_info) {
+        options.SetGenerateDebugInfo();
+    }
+    return options;
+}
+
+static std::string compile_options_key(const Compile_settings& settings, std::string_view toolchain_key)
+{
+    return fmt::format("{};{};{};{};{};{};{}", toolchain_key,
+        static_cast<int>(settings.optimization_level), settings.warnings_as_errors, static_cast<int>(settings.target_env),
+        static_cast<uint32_t>(settings.env_version), static_cast<uint32_t>(settings.spirv_version), settings.debug_info);
+}
+
+// Versions of the toolchain, plus the output for a probe shader so an upgraded glslang changing its code generation
+// without a version bump is caught too
+static std::string toolchain_key(const shaderc::Compiler& compiler)
+{
+    unsigned int spirv_version = 0u;
+    unsigned int spirv_revision = 0u;
+    shaderc_get_spv_version(&spirv_version, &spirv_revision);
+    constexpr std::string_view probe =
+        "#version 460\n"
+        "layout(local_size_x = 64) in;\n"
+        "layout(binding = 0) buffer Values { float values[]; };\n"
+        "void main() { values[gl_GlobalInvocationID.x] = sqrt(values[gl_GlobalInvocationID.x]) * 0.5; }\n";
+    auto result = compiler.CompileGlslToSpv(probe.data(), probe.size(), shaderc_compute_shader, "toolchain_probe");
+    std::string_view probe_output = result.GetCompilationStatus() == shaderc_compilation_status_success ?
+        std::string_view(reinterpret_cast<const char*>(result.cbegin()), static_cast<size_t>(result.cend() - result.cbegin()) * sizeof(uint32_t)) :
+        std::string_view(result.GetErrorMessage());
+    return fmt::format("{}.{};{};{:016x}", spirv_version, spirv_revision, spvSoftwareVersionString(),
+        Spirv_cache::hash(probe_output, shaderc_compute_shader, {}, {}));
+}
+
+Shader_compiler::Shader_compiler(std::optional<std::filesystem::path> cache_directory)
+{
+    Compile_settings group_settings{
+        .optimization_level = shaderc_optimization_level_performance,
+        .warnings_as_errors = true,
+        .target_env = shaderc_target_env_vulkan,
+        .env_version = shaderc_env_version_vulkan_1_2,
+        .spirv_version = shaderc_spirv_version_1_5,
+#ifdef USING_AFTERMATH
+        .debug_info = true
+#else
+        .debug_info = false
+#endif
+    };
+    // Same options without the optimizer, used for the first tier when editing
+    Compile_settings preview_settings = group_settings;
+    preview_settings.optimization_level = shaderc_optimization_level_zero;
+
+    std::string toolchain = toolchain_key(m_compiler);
+    m_group_compile_options = make_compile_options(group_settings);
+    m_group_compile_options_key = compile_options_key(group_settings, toolchain);
+    m_preview_compile_options = make_compile_options(preview_settings);
+    m_preview_compile_options_key = compile_options_key(preview_settings, toolchain);
+
+    if (cache_directory) {
+        m_spirv_cache.emplace(std::move(*cache_directory));
+    }
+}
+
+Shader_compiler::Result Shader_compiler::compile(
+    const Shader_dependencies& dependencies,
+    const std::vector<Shader_file>& engine_shader_files,
+    const std::vector<Shader_file>& scene_shader_files,
+    Translation_units& translation_units,
+    bool optimized,
+    int file_id, shaderc_shader_kind shader_kind, const std::string& group_name,
+    Shader_variant variant, Spirv_profile profile)
+{
+    using Clock = std::chrono::steady_clock;
+    auto start_time = Clock::now();
+    Result result;
+    auto& shader_file = engine_shader_files[file_id];
+    auto group_compile_options = optimized ? m_group_compile_options : m_preview_compile_options;
+    // The macro end up in the preprocessed source, no need to add it to the keys
+    const std::string& options_key = optimized ? m_group_compile_options_key : m_preview_compile_options_key;
+    if (const char* macro = shader_variant_macro(variant)) {
+        group_compile_options.AddMacroDefinition(macro);
+    }
+    if (!optimized) {
+        profile = Spirv_profile::none;
+    }
+
+    std::string group_name_file(group_name + ".glsl");
+    group_compile_options.SetIncluder(std::make_unique<Includer>(result.included_file_id, dependencies, engine_shader_files, scene_shader_files, group_name_file));
+
+    // The cache key is computed from the preprocessed source so that an edit in any included file invalidate it
+    auto preprocess_result = m_compiler.PreprocessGlsl(shader_file.data->data(), shader_file.data->size(), shader_kind, shader_file.name.c_str(), group_compile_options);
+    std::chrono::duration<float, std::milli> preprocess_time = Clock::now() - start_time;
+    result.preprocess_time_ms = preprocess_time.count();
+    if (preprocess_result.GetCompilationStatus() != shaderc_compilation_status_success) {
+        result.error = preprocess_result.GetErrorMessage();
+        fmt::print("GLSL preprocessing error: {}\n", result.error);
+        return result;
+    }
+    result.preprocessed.assign(preprocess_result.begin(), preprocess_result.end());
+    const std::string& preprocessed = result.preprocessed;
+
+    // Identical translation units (same preprocessed source, kind and options) are only compiled once per batch
+    // whatever the group they come from, the others wait for the result
+    auto [translation_unit, owner] = translation_units.find(Spirv_cache::hash(preprocessed, shader_kind, {}, options_key + spirv_profile_name(profile)));
+    if (owner) {
+        uint64_t cache_key = Spirv_cache::hash(preprocessed, shader_kind, group_name, options_key);
+        if (m_spirv_cache) {
+            translation_unit->code = m_spirv_cache->load(cache_key);
+        }
+        if (translation_unit->code.empty()) {
+            auto compile_result = m_compiler.CompileGlslToSpv(preprocessed.data(), preprocessed.size(), shader_kind, shader_file.name.c_str(), group_compile_options);
+            if (compile_result.GetCompilationStatus() != shaderc_compilation_status_success) {
+                translation_unit->error = compile_result.GetErrorMessage();
+                fmt::print("GLSL compilation error: {}\n", translation_unit->error);
+            }
+            else {
+                translation_unit->code.assign(compile_result.begin(), compile_result.end());
+                if (m_spirv_cache) {
+                    m_spirv_cache->store(cache_key, translation_unit->code);
+                }
+            }
+        }
+        translation_unit->instructions_before = count_spirv_instructions(translation_unit->code);
+        if (!translation_unit->code.empty() && profile != Spirv_profile::none) {
+            auto optimize_start = Clock::now();
+            std::string optimize_error;
+            if (!optimize_spirv(translation_unit->code, profile, optimize_error)) {
+                // The shaderc output is still valid, keep it
+                fmt::print("Warning: {} kept unoptimized by the {} profile: {}", shader_file.name, spirv_profile_name(profile), optimize_error);
+            }
+            std::chrono::duration<float, std::milli> optimize_time = Clock::now() - optimize_start;
+            translation_unit->optimize_time_ms = optimize_time.count();
+        }
+        translation_unit->done.signal();
+    }
+    else {
+        translation_unit->done.wait();
+    }
+    result.error = translation_unit->error;
+    result.translation_unit = std::move(translation_unit);
+    std::chrono::duration<float, std::milli> compile_time = Clock::now() - start_time;
+    result.compile_time_ms = compile_time.count();
+    return result;
+}
+
+std::string Shader_compiler::compile_assembly(std::string_view preprocessed, shaderc_shader_kind shader_kind, const std::string& name, bool optimized)
+{
+    auto assembly = m_compiler.CompileGlslToSpvAssembly(
+        preprocessed.data(), preprocessed.size(), shader_kind, name.c_str(),
+        optimized ? m_group_compile_options : m_preview_compile_options);
+    return std::string(assembly.begin(), assembly.end());
+}
+
+std::pair<std::shared_ptr<Shader_compiler::Translation_unit>, bool> Shader_compiler::Translation_units::find(uint64_t key)
+{
+    std::lock_guard lock(mutex);
+    auto [it, inserted] = units.try_emplace(key);
+    if (inserted) {
+        it->second = std::make_shared<Translation_unit>();
+    }
+    return { it->second, inserted };
+}
+
+std::vector<Shader_file> Shader_compiler::read_directory(const std::filesystem::path& directory)
+{
+    std::vector<Shader_file> files;
+    for (auto& directory_entry : std::filesystem::directory_iterator(directory))
+    {
+        auto& path = directory_entry.path();
+        files.push_back(Shader_file{
+            .name = path.filename().string(),
+            .data = std::make_shared<const std::string>(read_file(path))
+            });
+    }
+    return files;
+}
+
+std::string Shader_compiler::read_file(const std::filesystem::path& path)
+{
+    if (!std::filesystem::exists(path)) {
+        throw std::runtime_error("Shader path doesn't exist on filesystem.");
+    }
+    if (!std::filesystem::is_regular_file(path)) {
+        throw std::runtime_error("Shader path is not a regular file.");
+    }
+
+    std::ifstream file(path.string(), std::ios::ate | std::ios::binary);
+
+    if (!file.is_open()) {
+        throw std::runtime_error("failed to open file!");
+    }
+    size_t file_size = (size_t)file.tellg();
+    std::string buffer("");
+    buffer.resize(file_size);
+    file.seekg(0);
+    file.read(buffer.data(), file_size);
+    file.close();
+
+    return buffer;
+}
+
+void Shader_compiler::add_shaders(Shader_dependencies& dependencies, Shaders& shaders, bool desktop_mode)
+{
+    auto find_file = [&dependencies](const auto& name) {
+        int file_id = dependencies.find_file(name);
+        if (file_id < 0 || !dependencies.is_engine_file(file_id)) {
+            throw std::runtime_error(fmt::format("Engine shader {} not found", name));
+        }
+        return file_id;
+    };
+    shaders.raygen.file_id = find_file(desktop_mode ? "raygen_desktop.rgen" : "raygen.rgen");
+    shaders.primary_miss.file_id = find_file("primary.rmiss");
+    shaders.shadow_miss.file_id = find_file("shadow.rmiss");
+    shaders.shadow_intersection.file_id = find_file("shadow.rint");
+    for (auto& shader_group : shaders.groups) {
+        shader_group.primary_intersection.file_id = find_file("primary.rint");
+        shader_group.primary_closest_hit.file_id = find_file("primary.rchit");
+        shader_group.shadow_any_hit.file_id = find_file("shadow.rahit");
+        shader_group.ao_any_hit.file_id = find_file("ambient_occlusion.rahit");
+        shader_group.bounds.file_id = find_file("bounds.comp");
+    }
+
+    dependencies.add_shader(shaders.raygen, shaderc_raygen_shader);
+    dependencies.add_shader(shaders.primary_miss, shaderc_miss_shader);
+    dependencies.add_shader(shaders.shadow_miss, shaderc_miss_shader);
+    dependencies.add_shader(shaders.shadow_intersection, shaderc_intersection_shader);
+    for (auto& shader_group : shaders.groups) {
+        dependencies.add_shader(shader_group.primary_intersection, shaderc_intersection_shader, shader_group.name);
+        dependencies.add_shader(shader_group.primary_closest_hit, shaderc_closesthit_shader, shader_group.name);
+        dependencies.add_shader(shader_group.shadow_any_hit, shaderc_anyhit_shader, shader_group.name);
+        dependencies.add_shader(shader_group.ao_any_hit, shaderc_anyhit_shader, shader_group.name);
+        dependencies.add_shader(shader_group.bounds, shaderc_compute_shader, shader_group.name);
+    }
+}
+
+}
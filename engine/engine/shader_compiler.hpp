@@ -0,0 +1,84 @@
+#pragma once
+#include "core/shader.hpp"
+#include "shader_dependencies.hpp"
+#include "spirv_cache.hpp"
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <shaderc/shaderc.hpp>
+#include <marl/event.h>
+
+namespace sdf_editor
+{
+
+// GLSL to SPIR-V part of the shader system, without any Vulkan object
+// Shared by Shader_system and the offline shader compiler
+class Shader_compiler
+{
+public:
+    struct Translation_unit {
+        marl::Event done{ marl::Event::Mode::Manual };
+        std::vector<uint32_t> code;
+        std::string error;
+        size_t instructions_before = 0u;  // shaderc output, before the spirv-tools profile
+        float optimize_time_ms = 0.0f;
+    };
+    struct Translation_units {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, std::shared_ptr<Translation_unit>> units;
+
+        // Return the translation unit and true if the caller is the first to ask for it and need to compile it
+        [[nodiscard]] std::pair<std::shared_ptr<Translation_unit>, bool> find(uint64_t key);
+    };
+    struct Result {
+        std::shared_ptr<Translation_unit> translation_unit;  // Null if the preprocessing failed
+        std::string error;
+        std::string preprocessed;
+        std::vector<int> included_file_id;
+        float preprocess_time_ms = 0.0f;
+        float compile_time_ms = 0.0f;  // Include the time waiting for another task compiling the same unit
+        [[nodiscard]] bool success() const { return translation_unit && !translation_unit->code.empty(); }
+    };
+
+    // Without cache directory, every shader is compiled
+    Shader_compiler(std::optional<std::filesystem::path> cache_directory);
+    Shader_compiler(const Shader_compiler& other) = delete;
+    Shader_compiler(Shader_compiler&& other) = delete;
+    Shader_compiler& operator=(const Shader_compiler& other) = delete;
+    Shader_compiler& operator=(Shader_compiler&& other) = delete;
+    ~Shader_compiler() = default;
+
+    // Thread safe, variants sharing the same preprocessed source are only compiled once
+    // The spirv-tools profile is only run on optimized shaders, the cache hold the shaderc output
+    [[nodiscard]] Result compile(
+        const Shader_dependencies& dependencies,
+        const std::vector<Shader_file>& engine_shader_files,
+        const std::vector<Shader_file>& scene_shader_files,
+        Translation_units& translation_units,
+        bool optimized,
+        int file_id, shaderc_shader_kind shader_kind, const std::string& group_name = {},
+        Shader_variant variant = Shader_variant::quality,
+        Spirv_profile profile = Spirv_profile::none);
+    [[nodiscard]] std::string compile_assembly(std::string_view preprocessed, shaderc_shader_kind shader_kind, const std::string& name, bool optimized);
+
+    [[nodiscard]] size_t cache_hits() const { return m_spirv_cache ? m_spirv_cache->hits() : 0u; }
+    [[nodiscard]] size_t cache_misses() const { return m_spirv_cache ? m_spirv_cache->misses() : 0u; }
+
+    [[nodiscard]] static std::vector<Shader_file> read_directory(const std::filesystem::path& directory);
+    [[nodiscard]] static std::string read_file(const std::filesystem::path& path);
+    // Set the files of every stage and add them to the dependency graph, in pipeline order
+    static void add_shaders(Shader_dependencies& dependencies, Shaders& shaders, bool desktop_mode);
+private:
+    shaderc::Compiler m_compiler;
+    shaderc::CompileOptions m_group_compile_options;
+    std::string m_group_compile_options_key;  // Toolchain versions and options, used by the cache
+    shaderc::CompileOptions m_preview_compile_options;
+    std::string m_preview_compile_options_key;
+    std::optional<Spirv_cache> m_spirv_cache;
+};
+
+}
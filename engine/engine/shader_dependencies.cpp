@@ -0,0 +1,74 @@
+#include "shader_dependencies.hpp"
+
+#include <algorithm>
+
+namespace sdf_editor
+{
+
+void Shader_dependencies::set_files(const std::vector<Shader_file>& engine_files, const std::vector<Shader_file>& scene_files)
+{
+    m_file_ids.clear();
+    m_engine_file_count = static_cast<int>(std::ssize(engine_files));
+    int id = m_engine_file_count;
+    for (const auto& file : scene_files) {
+        m_file_ids.emplace(file.name, id++);
+    }
+    id = 0;
+    for (const auto& file : engine_files) {
+        m_file_ids.try_emplace(file.name, id++);
+    }
+    m_dependents.clear();
+    m_dependents.resize(m_engine_file_count + scene_files.size());
+    for (size_t node_id = 0u; node_id < m_nodes.size(); node_id++) {
+        update_edges(static_cast<int>(node_id));
+    }
+}
+
+int Shader_dependencies::find_file(std::string_view name) const
+{
+    auto it = m_file_ids.find(name);
+    return it == m_file_ids.end() ? -1 : it->second;
+}
+
+int Shader_dependencies::add_shader(Shader& shader, shaderc_shader_kind kind, std::string group_name)
+{
+    m_nodes.push_back(Node{
+        .shader = &shader,
+        .kind = kind,
+        .group_name = std::move(group_name)
+        });
+    m_visited_epoch.push_back(0u);
+    return static_cast<int>(std::ssize(m_nodes) - 1);
+}
+
+void Shader_dependencies::update_edges(int node_id)
+{
+    Node& node = m_nodes[node_id];
+    for (int file_id : node.files) {
+        std::erase(m_dependents[file_id], node_id);
+    }
+    node.files.clear();
+    node.files.push_back(node.shader->file_id);
+    node.files.insert(node.files.end(), node.shader->included_file_id.cbegin(), node.shader->included_file_id.cend());
+    // A file can be included by several includes (ex: common_types.glsl)
+    std::ranges::sort(node.files);
+    node.files.erase(std::unique(node.files.begin(), node.files.end()), node.files.end());
+    for (int file_id : node.files) {
+        m_dependents[file_id].push_back(node_id);
+    }
+}
+
+void Shader_dependencies::collect_dependents(const std::vector<int>& file_ids, std::vector<int>& node_ids)
+{
+    m_epoch++;
+    for (int file_id : file_ids) {
+        for (int node_id : m_dependents[file_id]) {
+            if (m_visited_epoch[node_id] != m_epoch) {
+                m_visited_epoch[node_id] = m_epoch;
+                node_ids.push_back(node_id);
+            }
+        }
+    }
+}
+
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include "core/shader.hpp"
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <shaderc/shaderc.hpp>
+
+namespace sdf_editor
+{
+
+// Include graph between shader files and the shaders compiled from them
+// Files are interned once, engine files keep their index and scene files come after them
+// Forward edges (shader -> files) are recorded by the includer, the reverse index (file -> shaders)
+// let us find the exact set of shaders to recompile when some files are edited
+class Shader_dependencies
+{
+public:
+    struct Node
+    {
+        Shader* shader;
+        shaderc_shader_kind kind;
+        std::string group_name;
+        std::vector<int> files;
+    };
+
+    Shader_dependencies() = default;
+    Shader_dependencies(const Shader_dependencies& other) = delete;
+    Shader_dependencies(Shader_dependencies&& other) = delete;
+    Shader_dependencies& operator=(const Shader_dependencies& other) = delete;
+    Shader_dependencies& operator=(Shader_dependencies&& other) = delete;
+    ~Shader_dependencies() = default;
+
+    void set_files(const std::vector<Shader_file>& engine_files, const std::vector<Shader_file>& scene_files);
+    // Scene files shadow engine files with the same name, return -1 if not found
+    [[nodiscard]] int find_file(std::string_view name) const;
+    [[nodiscard]] int engine_file_count() const { return m_engine_file_count; }
+    [[nodiscard]] bool is_engine_file(int file_id) const { return file_id < m_engine_file_count; }
+    [[nodiscard]] int scene_file_id(int file_id) const { return file_id - m_engine_file_count; }
+
+    int add_shader(Shader& shader, shaderc_shader_kind kind, std::string group_name = {});
+    // Replace the forward edges of a node by the main file and the includes of its shader
+    void update_edges(int node_id);
+    [[nodiscard]] const Node& node(int node_id) const { return m_nodes[node_id]; }
+    [[nodiscard]] size_t size() const { return m_nodes.size(); }
+
+    // Append every shader node depending on one of the files, each node only once
+    void collect_dependents(const std::vector<int>& file_ids, std::vector<int>& node_ids);
+private:
+    struct String_hash
+    {
+        using is_transparent = void;
+        size_t operator()(std::string_view str) const { return std::hash<std::string_view>{}(str); }
+    };
+
+    std::unordered_map<std::string, int, String_hash, std::equal_to<>> m_file_ids;
+    int m_engine_file_count = 0;
+    std::vector<Node> m_nodes;
+    std::vector<std::vector<int>> m_dependents;
+
+    // Avoid clearing a visited set each time
+    std::vector<uint32_t> m_visited_epoch;
+    uint32_t m_epoch = 0u;
+};
+
+}
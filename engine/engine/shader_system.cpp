@@ -1,68 +1,23 @@
 #include "shader_system.hpp"
 #include "core/scene.hpp"
 #include "vulkan/context.hpp"
+#include "spirv_optimizer.hpp"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <fstream>
-#include <iostream>
 #include <ranges>
+#include <iomanip>
 #include <fmt/core.h>
+#include <nlohmann/json.hpp>
 #include <marl/scheduler.h>
 #include <marl/waitgroup.h>
 
-namespace sdf_editor
-{
+using json = nlohmann::json;
 
-class Includer : public shaderc::CompileOptions::IncluderInterface
+namespace sdf_editor
 {
-public:
-    Includer(
-        Shader& shader,
-        const std::vector<Shader_file>& engine_files,
-        const std::vector<Shader_file>& scene_files,
-        const std::string& group_name) :
-        m_shader(shader), m_engine_files(engine_files), m_scene_files(scene_files), m_group_name(group_name)
-    {}
-
-    shaderc_include_result* GetInclude(
-        const char* requested_source,
-        shaderc_include_type /*type*/,
-        const char* /*requesting_source*/,
-        size_t /*include_depth*/) override final
-    {
-        if (!m_group_name.empty() && strcmp(requested_source, "map_function") == 0) {
-            requested_source = m_group_name.c_str();
-        }
-        std::vector<Shader_file>::const_iterator file_it = std::find_if(m_scene_files.cbegin(), m_scene_files.cend(), [requested_source](const Shader_file& shader_file) {
-            return shader_file.name == requested_source;
-            });
-        if (file_it != m_scene_files.cend()) {
-            m_shader.scene_included_id.push_back(static_cast<int>(std::distance(m_scene_files.cbegin(), file_it)));
-        }
-        else {
-            file_it = std::find_if(m_engine_files.cbegin(), m_engine_files.cend(), [requested_source](const Shader_file& shader_file) {
-                return shader_file.name == requested_source;
-                });
-            assert(file_it != m_engine_files.cend());
-            m_shader.engine_included_id.push_back(static_cast<int>(std::distance(m_engine_files.cbegin(), file_it)));
-        }
-        const Shader_file& included_shader = *file_it;
-
-        data_holder.content = included_shader.data.data();
-        data_holder.content_length = included_shader.size;
-        data_holder.source_name = included_shader.name.c_str();
-        data_holder.source_name_length = included_shader.name.size();
-        data_holder.user_data = nullptr;
-        return &data_holder;
-    }
-
-    void ReleaseInclude(shaderc_include_result* /*data*/) override final {}
-private:
-    shaderc_include_result data_holder;
-    Shader& m_shader;
-    const std::vector<Shader_file>& m_engine_files;
-    const std::vector<Shader_file>& m_scene_files;
-    const std::string& m_group_name;
-};
 
 Shader_system::Shader_system(vulkan::Context& context, Scene& scene, std::filesystem::path scene_shader_path, bool desktop_mode) :
     m_device(context.device),
@@ -73,197 +28,413 @@ Shader_system::Shader_system(vulkan::Context& context, Scene& scene, std::filesy
 #endif
 {
     m_scheduler.bind();
-    m_group_compile_options.SetOptimizationLevel(shaderc_optimization_level_performance);
-    //m_group_compile_options.SetOptimizationLevel(shaderc_optimization_level_zero);
-    m_group_compile_options.SetWarningsAsErrors();
-    m_group_compile_options.SetTargetEnvironment(shaderc_target_env_vulkan, shaderc_env_version_vulkan_1_2);
-    m_group_compile_options.SetTargetSpirv(shaderc_spirv_version_1_5);
-
-    // TODO Refactor
-    for (auto& directory_entry : std::filesystem::directory_iterator(m_engine_directory))
-    {
-        auto& path = directory_entry.path();
-        auto& back = scene.shaders.engine_files.emplace_back(Shader_file{
-            .name = path.filename().string(),
-            .data = read_file(path)
-            });
-        back.size = static_cast<int>(std::ssize(back.data));
-        m_engine_files_copy.push_back(Shader_file{
-            .name = path.filename().string(),
-            .data = scene.shaders.engine_files.back().data,
-            .size = back.size
-            });
+    scene.shaders.engine_files = Shader_compiler::read_directory(m_engine_directory);
+    scene.shaders.scene_files = Shader_compiler::read_directory(m_scene_directory);
+    m_dependencies.set_files(scene.shaders.engine_files, scene.shaders.scene_files);
+    Shader_compiler::add_shaders(m_dependencies, scene.shaders, desktop_mode);
+
+    m_node_generation = std::vector<std::atomic<uint64_t>>(m_dependencies.size());
+
+    m_saved_data.resize(scene.shaders.engine_files.size() + scene.shaders.scene_files.size());
+    std::array<std::vector<std::string>, 2> watched_names;
+    for (const auto& file : scene.shaders.engine_files) {
+        watched_names[0].push_back(file.name);
     }
-    for (auto& directory_entry : std::filesystem::directory_iterator(m_scene_directory))
-    {
-        auto& path = directory_entry.path();
-        auto& back = scene.shaders.scene_files.emplace_back(Shader_file{
-            .name = path.filename().string(),
-            .data = read_file(path)
-            });
-        back.size = static_cast<int>(std::ssize(back.data));
-        m_scene_files_copy.push_back(Shader_file{
-            .name = path.filename().string(),
-            .data = scene.shaders.scene_files.back().data,
-            .size = back.size
-            });
+    for (const auto& file : scene.shaders.scene_files) {
+        watched_names[1].push_back(file.name);
     }
-    auto find_file = [&scene](const auto& name) {
-        auto file_it = std::find_if(scene.shaders.engine_files.cbegin(), scene.shaders.engine_files.cend(), [name](const Shader_file& shader_file) {
-            return shader_file.name == name;
-            });
-        assert(file_it != scene.shaders.engine_files.cend());
-        return static_cast<int>(std::distance(scene.shaders.engine_files.cbegin(), file_it));
-    };
-    scene.shaders.raygen.file_id = find_file(desktop_mode ? "raygen_desktop.rgen" : "raygen.rgen");
-    scene.shaders.primary_miss.file_id = find_file("primary.rmiss");
-    scene.shaders.shadow_miss.file_id = find_file("shadow.rmiss");
-    scene.shaders.shadow_intersection.file_id = find_file("shadow.rint");
-    for (auto& shader_group : scene.shaders.groups) {
-        shader_group.primary_intersection.file_id = find_file("primary.rint");
-        shader_group.primary_closest_hit.file_id = find_file("primary.rchit");
-        shader_group.shadow_any_hit.file_id = find_file("shadow.rahit");
-        shader_group.ao_any_hit.file_id = find_file("ambient_occlusion.rahit");
-    }
-
-    marl::WaitGroup compile_shaders(static_cast<unsigned int>(scene.shaders.groups.size()));
-    for (auto& shader_group : scene.shaders.groups) {
-        marl::schedule([this, compile_shaders, &scene, &shader_group = shader_group]
-            {
-                compile(scene.shaders.engine_files, scene.shaders.scene_files, shader_group.primary_intersection, shaderc_intersection_shader, shader_group.name);
-                compile(scene.shaders.engine_files, scene.shaders.scene_files, shader_group.primary_closest_hit, shaderc_closesthit_shader, shader_group.name);
-                compile(scene.shaders.engine_files, scene.shaders.scene_files, shader_group.shadow_any_hit, shaderc_anyhit_shader, shader_group.name);
-                compile(scene.shaders.engine_files, scene.shaders.scene_files, shader_group.ao_any_hit, shaderc_anyhit_shader, shader_group.name);
-                compile_shaders.done();
-            });
+    // Files created after the start are ignored, the dependency graph can't grow
+    m_file_watcher.emplace(
+        std::vector<std::filesystem::path>{ m_engine_directory, m_scene_directory },
+        [watched_names = std::move(watched_names)](int directory_id, std::string_view name) {
+            return std::ranges::find(watched_names[directory_id], name) != watched_names[directory_id].end();
+        });
+
+    // Every variant of every stage get its own task, the four stages of a group don't wait on each other
+    auto start_time = Clock::now();
+    m_spirv_profile = scene.shaders.spirv_profile;
+    Shader_compiler::Translation_units translation_units;
+    std::vector<Variant_results> results(m_dependencies.size());
+    marl::WaitGroup compile_shaders(static_cast<unsigned int>(m_dependencies.size() * shader_variant_count));
+    for (int node_id = 0; node_id < std::ssize(m_dependencies); node_id++) {
+        for (size_t variant = 0u; variant < shader_variant_count; variant++) {
+            marl::schedule([this, compile_shaders, &scene, &translation_units, &node = m_dependencies.node(node_id), &result = results[node_id][variant], variant]
+                {
+                    compile(scene.shaders.engine_files, scene.shaders.scene_files, translation_units, true, m_spirv_profile, *node.shader, static_cast<Shader_variant>(variant), node.kind, node.group_name, result);
+                    compile_shaders.done();
+                });
+        }
     }
-    compile(scene.shaders.engine_files, scene.shaders.scene_files, scene.shaders.raygen, shaderc_raygen_shader);
-    compile(scene.shaders.engine_files, scene.shaders.scene_files, scene.shaders.primary_miss, shaderc_miss_shader);
-    compile(scene.shaders.engine_files, scene.shaders.scene_files, scene.shaders.shadow_miss, shaderc_miss_shader);
-    compile(scene.shaders.engine_files, scene.shaders.scene_files, scene.shaders.shadow_intersection, shaderc_intersection_shader);
     compile_shaders.wait();
+    std::chrono::duration<float, std::milli> compile_time = Clock::now() - start_time;
+    fmt::print("Compiled {} shaders in {} variants ({} unique) in {:.1f} ms\n", m_dependencies.size(), shader_variant_count, translation_units.units.size(), compile_time.count());
+    for (int node_id = 0; node_id < std::ssize(m_dependencies); node_id++) {
+        merge_variants(*m_dependencies.node(node_id).shader, results[node_id], Variant_mask().set(), true);
+        m_dependencies.update_edges(node_id);
+    }
+
+    scene.shaders.cache_hits = m_shader_compiler.cache_hits();
+    scene.shaders.cache_misses = m_shader_compiler.cache_misses();
+    fmt::print("Shader cache: {} hits, {} misses\n", scene.shaders.cache_hits, scene.shaders.cache_misses);
 }
 
 void Shader_system::step(Scene& scene)
 {
-    if (m_shaders_dirty)
+    // Finished jobs wait for the renderer to be done with the current modules
+    if (!scene.shaders.pipeline_building) {
+        apply_finished_jobs(scene);
+    }
+
+    // Specialization constants only need a new pipeline
+    // Wait for the background compile if the new variant isn't there yet
+    if (scene.shaders.raymarch_settings_dirty && all_modules_valid(scene.shaders.raymarch_settings.variant)) {
+        scene.shaders.raymarch_settings_dirty = false;
+        scene.shaders.pipeline_dirty = true;
+    }
+
+    bool edited = false;
+    int id = 0;
+    for (auto& file : scene.shaders.engine_files)
     {
-        if (!m_compiling.test(std::memory_order_relaxed)) {
-            scene.shaders.pipeline_dirty = true;
-            for (auto& shader_info : m_recompile_info) {
-                if (!shader_info.copy.module) {
-                    scene.shaders.pipeline_dirty = false;
-                }
-                if (shader_info.original->module) {
-                    m_device.destroyShaderModule(shader_info.original->module);
-                }
-                *shader_info.original = shader_info.copy;
-            }
-            m_shaders_dirty = false;
+        if (file.dirty) {
+            m_pending_file_ids.push_back(id);
+            m_pending_save_ids.push_back(id);
+            file.dirty = false;
+            edited = true;
         }
+        id++;
     }
-    else
+    for (auto& file : scene.shaders.scene_files)
     {
-        size_t id = 0u;
-        for (auto& file : scene.shaders.engine_files)
-        {
-            if (file.dirty) {
-                m_engine_files_copy[id] = file;
-                m_shaders_dirty = true;
-            }
-            id++;
+        if (file.dirty) {
+            m_pending_file_ids.push_back(id);
+            m_pending_save_ids.push_back(id);
+            file.dirty = false;
+            edited = true;
         }
-        id = 0u;
-        for (auto& file : scene.shaders.scene_files)
-        {
-            if (file.dirty) {
-                m_scene_files_copy[id] = file;
-                m_shaders_dirty = true;
-            }
-            id++;
+        id++;
+    }
+    while (auto change = m_file_watcher->poll()) {
+        edited |= apply_external_change(scene, *change);
+    }
+
+    auto now = Clock::now();
+    if (edited) {
+        if (m_pending_edit) {
+            scene.shaders.edits_coalesced++;
+        }
+        m_pending_edit = true;
+        m_last_edit = now;
+    }
+    if (m_pending_edit && now - m_last_edit >= debounce_delay) {
+        m_pending_edit = false;
+        schedule_job(scene, !scene.shaders.tiered_compilation);
+    }
+    // Only the optimized tier run the profile, skip the preview
+    if (scene.shaders.spirv_profile != m_spirv_profile && !m_pending_edit) {
+        m_spirv_profile = scene.shaders.spirv_profile;
+        for (int file_id = 0; file_id < std::ssize(scene.shaders.engine_files) + std::ssize(scene.shaders.scene_files); file_id++) {
+            m_pending_file_ids.push_back(file_id);
         }
+        schedule_job(scene, true);
+    }
+
+    auto write_stats = m_file_writer.stats();
+    scene.shaders.file_writes = write_stats.writes;
+    scene.shaders.file_writes_coalesced = write_stats.coalesced;
+    scene.shaders.file_write_failures = write_stats.failures;
+    scene.shaders.file_write_latency_ms = write_stats.last_latency_ms;
+    scene.shaders.file_write_max_latency_ms = write_stats.max_latency_ms;
+}
 
-        if (m_shaders_dirty)
+void Shader_system::schedule_job(Scene& scene, bool optimized)
+{
+    std::ranges::sort(m_pending_file_ids);
+    m_pending_file_ids.erase(std::unique(m_pending_file_ids.begin(), m_pending_file_ids.end()), m_pending_file_ids.end());
+
+    auto job = std::make_shared<Compile_job>();
+    job->generation = ++m_generation;
+    job->optimized = optimized;
+    job->active_variant = scene.shaders.raymarch_settings.variant;
+    job->profile = m_spirv_profile;
+    // Only the snapshot handles are copied, the sources are shared with the editor
+    job->engine_files = scene.shaders.engine_files;
+    job->scene_files = scene.shaders.scene_files;
+
+    std::vector<int> node_ids;
+    m_dependencies.collect_dependents(m_pending_file_ids, node_ids);
+    job->recompile_info.reserve(node_ids.size());
+    for (int node_id : node_ids) {
+        const auto& node = m_dependencies.node(node_id);
+        // Older jobs compiling this shader are now obsolete
+        m_node_generation[node_id].store(job->generation, std::memory_order_relaxed);
+        auto& info = job->recompile_info.emplace_back(Recompile_info{
+            .original = node.shader,
+            .copy = *node.shader,
+            .kind = node.kind,
+            .name = node.group_name,
+            .node_id = node_id,
+            .compiled_variants = Variant_mask().set(static_cast<size_t>(used_variant(node.kind, job->active_variant)))
+            });
+        info.copy.modules = {};
+    }
+
+    std::ranges::sort(m_pending_save_ids);
+    m_pending_save_ids.erase(std::unique(m_pending_save_ids.begin(), m_pending_save_ids.end()), m_pending_save_ids.end());
+    for (int file_id : m_pending_save_ids) {
+        save_file(scene, file_id);
+    }
+    m_pending_save_ids.clear();
+    m_pending_file_ids.clear();
+
+    run_job(std::move(job));
+}
+
+void Shader_system::run_job(std::shared_ptr<Compile_job> job)
+{
+    marl::schedule([this, job]
         {
-            m_compiling.test_and_set(std::memory_order_relaxed);
-            marl::schedule([&scene, this]
-                {
-                    m_recompile_info.clear();
-                    check_if_dirty(scene.shaders.raygen, shaderc_raygen_shader);
-                    check_if_dirty(scene.shaders.primary_miss, shaderc_miss_shader);
-                    check_if_dirty(scene.shaders.shadow_miss, shaderc_miss_shader);
-                    check_if_dirty(scene.shaders.shadow_intersection, shaderc_intersection_shader);
-                    for (auto& shader_group : scene.shaders.groups) {
-                        check_if_dirty(shader_group.primary_intersection, shaderc_intersection_shader, shader_group.name);
-                        check_if_dirty(shader_group.primary_closest_hit, shaderc_closesthit_shader, shader_group.name);
-                        check_if_dirty(shader_group.shadow_any_hit, shaderc_anyhit_shader, shader_group.name);
-                        check_if_dirty(shader_group.ao_any_hit, shaderc_anyhit_shader, shader_group.name);
+            size_t compile_count = 0u;
+            for (const auto& shader_info : job->recompile_info) {
+                compile_count += shader_info.compiled_variants.count();
+            }
+            marl::WaitGroup compile_shaders(static_cast<unsigned int>(compile_count));
+            for (auto& shader_info : job->recompile_info) {
+                for (size_t variant = 0u; variant < shader_variant_count; variant++) {
+                    if (!shader_info.compiled_variants.test(variant)) {
+                        continue;
                     }
+                    marl::schedule([this, compile_shaders, &job, &shader_info = shader_info, variant]
+                        {
+                            auto superseded = [this, &job, &shader_info] {
+                                return m_node_generation[shader_info.node_id].load(std::memory_order_relaxed) != job->generation;
+                            };
+                            if (superseded()) {
+                                m_compiles_skipped.fetch_add(1u, std::memory_order_relaxed);
+                            }
+                            else {
+                                compile(job->engine_files, job->scene_files, job->translation_units, job->optimized, job->profile, shader_info.copy, static_cast<Shader_variant>(variant),
+                                    shader_info.kind, shader_info.name, shader_info.variants[variant], superseded);
+                            }
+                            compile_shaders.done();
+                        });
+                }
+            }
+            compile_shaders.wait();
+            for (auto& shader_info : job->recompile_info) {
+                merge_variants(shader_info.copy, shader_info.variants, shader_info.compiled_variants, job->optimized);
+            }
+            job->finished.signal();
+        });
+    m_jobs.push_back(std::move(job));
+}
 
-                    marl::WaitGroup compile_shaders(static_cast<unsigned int>(m_recompile_info.size()));
-                    for (auto& shader_info : m_recompile_info) {
-                        marl::schedule([this, compile_shaders, &shader_info = shader_info]
-                            {
-                                compile(m_engine_files_copy, m_scene_files_copy, shader_info.copy, shader_info.kind, shader_info.name);
-                                compile_shaders.done();
-                            });
+void Shader_system::apply_finished_jobs(Scene& scene)
+{
+    bool applied = false;
+    Shader_variant active_variant = scene.shaders.raymarch_settings.variant;
+    std::vector<std::shared_ptr<Compile_job>> next_jobs;
+    std::erase_if(m_jobs, [this, &applied, &next_jobs, active_variant](const std::shared_ptr<Compile_job>& job) {
+        if (!job->finished.isSignalled()) {
+            return false;
+        }
+        std::shared_ptr<Compile_job> next_job;
+        for (auto& shader_info : job->recompile_info) {
+            if (m_node_generation[shader_info.node_id].load(std::memory_order_relaxed) == job->generation) {
+                if (job->background) {
+                    // The variant in use is already swapped in, only add the other ones
+                    auto& original = *shader_info.original;
+                    for (size_t variant = 0u; variant < shader_variant_count; variant++) {
+                        if (shader_info.compiled_variants.test(variant) && shader_info.copy.modules[variant]) {
+                            if (original.modules[variant]) {
+                                m_device.destroyShaderModule(original.modules[variant]);
+                            }
+                            original.modules[variant] = std::exchange(shader_info.copy.modules[variant], vk::ShaderModule{});
+                        }
                     }
-                    compile_shaders.wait();
-                    m_compiling.clear(std::memory_order_release);
-                });
+                    if (original.error.empty()) {
+                        original.error = std::move(shader_info.copy.error);
+                    }
+                    if (shader_info.compiled_variants.test(static_cast<size_t>(Shader_variant::quality))) {
+                        original.stats = shader_info.copy.stats;
+                    }
+                    original.included_file_id.insert(original.included_file_id.end(), shader_info.copy.included_file_id.cbegin(), shader_info.copy.included_file_id.cend());
+                    m_dependencies.update_edges(shader_info.node_id);
+                    // The variant was switched while this job ran, the pipeline was waiting for it
+                    if (shader_info.compiled_variants.test(static_cast<size_t>(used_variant(shader_info.kind, active_variant)))) {
+                        original.revision++;
+                        applied = true;
+                    }
+                    continue;
+                }
+                if (job->optimized && shader_info.copy.empty() && shader_info.original->tier == Shader_tier::preview) {
+                    // Keep the working preview rather than losing the shader
+                    shader_info.original->error = std::move(shader_info.copy.error);
+                    continue;
+                }
+                destroy_modules(*shader_info.original);
+                uint32_t revision = shader_info.original->revision;
+                *shader_info.original = std::move(shader_info.copy);
+                shader_info.original->revision = revision + 1u;
+                // Includes might have changed with the edit
+                m_dependencies.update_edges(shader_info.node_id);
+                applied = true;
 
-            for (auto& file : scene.shaders.engine_files)
-            {
-                if (file.dirty) {
-                    write_file(file, true);  // Do during destructor or multithread if too slow
-                    file.dirty = false;
+                // Next tier: optimized build of the variant in use, then of the other variants in the background,
+                // with the same generation so it get thrown away if the user edit the shader in the meantime
+                Variant_mask next_variants = job->optimized ? ~shader_info.compiled_variants : shader_info.compiled_variants;
+                if (!shader_info.original->empty() && next_variants.any()) {
+                    if (!next_job) {
+                        next_job = std::make_shared<Compile_job>();
+                        next_job->generation = job->generation;
+                        next_job->optimized = true;
+                        next_job->background = job->optimized;
+                        next_job->active_variant = job->active_variant;
+                        next_job->profile = job->profile;
+                        next_job->engine_files = std::move(job->engine_files);
+                        next_job->scene_files = std::move(job->scene_files);
+                    }
+                    auto& info = next_job->recompile_info.emplace_back(Recompile_info{
+                        .original = shader_info.original,
+                        .copy = *shader_info.original,
+                        .kind = shader_info.kind,
+                        .name = shader_info.name,
+                        .node_id = shader_info.node_id,
+                        .compiled_variants = next_variants
+                        });
+                    info.copy.modules = {};
                 }
             }
-            for (auto& file : scene.shaders.scene_files)
-            {
-                if (file.dirty) {
-                    write_file(file, false);
-                    file.dirty = false;
-                }
+            else if (!shader_info.copy.empty()) {
+                // Superseded after the module creation
+                destroy_modules(shader_info.copy);
+                m_compiles_skipped.fetch_add(1u, std::memory_order_relaxed);
             }
         }
+        if (next_job) {
+            next_jobs.push_back(std::move(next_job));
+        }
+        return true;
+        });
+    for (auto& job : next_jobs) {
+        run_job(std::move(job));
+    }
+
+    if (applied) {
+        // Keep the current pipeline until every shader compile
+        scene.shaders.pipeline_dirty = all_modules_valid(active_variant);
     }
+    scene.shaders.cache_hits = m_shader_compiler.cache_hits();
+    scene.shaders.cache_misses = m_shader_compiler.cache_misses();
+    scene.shaders.compiles_skipped = m_compiles_skipped.load(std::memory_order_relaxed);
 }
 
-void Shader_system::check_if_dirty(Shader& shader, shaderc_shader_kind shader_kind, const std::string& group_name)
+void Shader_system::save_file(const Scene& scene, int file_id)
 {
-    if (m_engine_files_copy[shader.file_id].dirty ||
-        std::ranges::any_of(shader.engine_included_id, [this](size_t id) { return m_engine_files_copy[id].dirty; }) ||
-        std::ranges::any_of(shader.scene_included_id, [this](size_t id) { return m_scene_files_copy[id].dirty; }))
-    {
-        m_recompile_info.emplace_back(Recompile_info{
-            .original = &shader,
-            .copy = shader,
-            .kind = shader_kind,
-            .name = group_name
-            });
+    const auto& file = m_dependencies.is_engine_file(file_id) ?
+        scene.shaders.engine_files[file_id] :
+        scene.shaders.scene_files[m_dependencies.scene_file_id(file_id)];
+    auto& saved_data = m_saved_data[file_id];
+    if (saved_data.size() == saved_history_size) {
+        saved_data.erase(saved_data.begin());
     }
+    saved_data.push_back(file.data);
+    m_file_writer.write((m_dependencies.is_engine_file(file_id) ? m_engine_directory : m_scene_directory) / file.name, file.data);
+}
+
+bool Shader_system::apply_external_change(Scene& scene, const File_watcher::Change& change)
+{
+    auto& files = change.directory_id == 0 ? scene.shaders.engine_files : scene.shaders.scene_files;
+    auto it = std::ranges::find(files, change.name, &Shader_file::name);
+    if (it == files.end()) {
+        return false;
+    }
+    int file_id = static_cast<int>(std::distance(files.begin(), it));
+    if (change.directory_id != 0) {
+        file_id += m_dependencies.engine_file_count();
+    }
+    auto same_content = [&change](const std::shared_ptr<const std::string>& data) { return *data == *change.data; };
+    if (same_content(it->data) || std::ranges::any_of(m_saved_data[file_id], same_content)) {
+        return false;
+    }
+    fmt::print("Reloading {} edited outside of the editor\n", change.name);
+    it->data = change.data;
+    m_saved_data[file_id].clear();
+    m_pending_file_ids.push_back(file_id);
+    return true;
+}
+
+void Shader_system::export_stats(const Shaders& shaders, const std::filesystem::path& path) const
+{
+    json rows = json::array();
+    std::ofstream csv(std::filesystem::path(path).replace_extension(".csv"));
+    csv << "group,file,tier,profile,preprocess_time_ms,compile_time_ms,optimize_time_ms,spirv_words,instructions_before,instructions,include_count,last_compiled,error\n";
+    shaders.visit([&](const std::string& group_name, const Shader& shader) {
+        const auto& file_name = shaders.engine_files[shader.file_id].name;
+        const char* tier = shader.tier == Shader_tier::optimized ? "optimized" : shader.tier == Shader_tier::preview ? "preview" : "none";
+        auto last_compiled = std::chrono::duration_cast<std::chrono::seconds>(shader.stats.last_compiled.time_since_epoch()).count();
+        rows.push_back(json{
+            { "group", group_name },
+            { "file", file_name },
+            { "tier", tier },
+            { "profile", spirv_profile_name(shader.stats.profile) },
+            { "preprocess_time_ms", shader.stats.preprocess_time_ms },
+            { "compile_time_ms", shader.stats.compile_time_ms },
+            { "optimize_time_ms", shader.stats.optimize_time_ms },
+            { "spirv_words", shader.stats.spirv_words },
+            { "instructions_before", shader.stats.instructions_before },
+            { "instructions", shader.stats.instructions },
+            { "include_count", shader.stats.include_count },
+            { "last_compiled", last_compiled },
+            { "error", !shader.error.empty() } });
+        csv << fmt::format("{},{},{},{},{:.3f},{:.3f},{:.3f},{},{},{},{},{},{}\n",
+            group_name, file_name, tier, spirv_profile_name(shader.stats.profile),
+            shader.stats.preprocess_time_ms, shader.stats.compile_time_ms, shader.stats.optimize_time_ms,
+            shader.stats.spirv_words, shader.stats.instructions_before, shader.stats.instructions,
+            shader.stats.include_count, last_compiled, shader.error.empty() ? 0 : 1);
+        });
+    std::ofstream output(std::filesystem::path(path).replace_extension(".json"));
+    output << std::setw(4) << json{ { "shaders", rows } } << std::endl;
+    fmt::print("Shader stats written to {}.json/.csv\n", path.string());
+}
+
+Shader_variant Shader_system::used_variant(shaderc_shader_kind kind, Shader_variant active_variant)
+{
+    // The bounds are always estimated with the quality variant, see Renderer::update_group_bounds
+    return kind == shaderc_compute_shader ? Shader_variant::quality : active_variant;
+}
+
+bool Shader_system::all_modules_valid(Shader_variant active_variant) const
+{
+    for (int node_id = 0; node_id < std::ssize(m_dependencies); node_id++) {
+        const auto& node = m_dependencies.node(node_id);
+        if (!node.shader->module(used_variant(node.kind, active_variant))) {
+            return false;
+        }
+    }
+    return true;
 }
 
 void Shader_system::cleanup(Scene& scene)
 {
-    if (scene.shaders.raygen.module)
-        m_device.destroyShaderModule(scene.shaders.raygen.module);
-    if (scene.shaders.primary_miss.module)
-        m_device.destroyShaderModule(scene.shaders.primary_miss.module);
-    if (scene.shaders.shadow_miss.module)
-        m_device.destroyShaderModule(scene.shaders.shadow_miss.module);
-    if (scene.shaders.shadow_intersection.module)
-        m_device.destroyShaderModule(scene.shaders.shadow_intersection.module);
-    for (auto& shader_group : scene.shaders.groups) {
-        if (shader_group.primary_intersection.module)
-            m_device.destroyShaderModule(shader_group.primary_intersection.module);
-        if (shader_group.primary_closest_hit.module)
-            m_device.destroyShaderModule(shader_group.primary_closest_hit.module);
-        if (shader_group.shadow_any_hit.module)
-            m_device.destroyShaderModule(shader_group.shadow_any_hit.module);
-        if (shader_group.ao_any_hit.module)
-            m_device.destroyShaderModule(shader_group.ao_any_hit.module);
+    // Edits still in the debounce delay are saved too
+    m_file_watcher.reset();
+    for (int file_id : m_pending_save_ids) {
+        save_file(scene, file_id);
+    }
+    m_pending_save_ids.clear();
+    m_file_writer.flush();
+    export_stats(scene.shaders, "shader_stats");
+
+    for (auto& job : m_jobs) {
+        job->finished.wait();
+        for (auto& shader_info : job->recompile_info) {
+            destroy_modules(shader_info.copy);
+        }
+    }
+    m_jobs.clear();
+    for (int node_id = 0; node_id < std::ssize(m_dependencies); node_id++) {
+        destroy_modules(*m_dependencies.node(node_id).shader);
     }
     m_scheduler.unbind();
 }
@@ -271,111 +442,131 @@ void Shader_system::cleanup(Scene& scene)
 void Shader_system::compile(
     const std::vector<Shader_file>& engine_shader_files,
     const std::vector<Shader_file>& scene_shader_files,
-    Shader& shader, shaderc_shader_kind shader_kind, const std::string& group_name)
+    Shader_compiler::Translation_units& translation_units,
+    bool optimized, Spirv_profile profile,
+    const Shader& shader, Shader_variant variant, shaderc_shader_kind shader_kind, const std::string& group_name,
+    Variant_result& variant_result,
+    const std::function<bool()>& superseded)
 {
-    auto& shader_file = engine_shader_files[shader.file_id];
-    shader.engine_included_id.clear();
-    shader.scene_included_id.clear();
-    auto group_compile_options = m_group_compile_options;
-#ifdef USING_AFTERMATH
-    group_compile_options.SetGenerateDebugInfo();
-#endif
-
-    std::string group_name_file(group_name + ".glsl");
-    group_compile_options.SetIncluder(std::make_unique<Includer>(shader, engine_shader_files, scene_shader_files, group_name_file));
-    auto compile_result = m_compiler.CompileGlslToSpv(shader_file.data.data(), shader_file.size, shader_kind, shader_file.name.c_str(), group_compile_options);
-    if (compile_result.GetCompilationStatus() != shaderc_compilation_status_success) {
-        shader.error = compile_result.GetErrorMessage();
-        shader.module = vk::ShaderModule{};
-        fmt::print("GLSL compilation error: {}\n", shader.error);
+    auto result = m_shader_compiler.compile(m_dependencies, engine_shader_files, scene_shader_files, translation_units, optimized, shader.file_id, shader_kind, group_name, variant, profile);
+    variant_result.included_file_id = std::move(result.included_file_id);
+    std::vector<int> includes = variant_result.included_file_id;
+    std::ranges::sort(includes);
+    variant_result.stats = Shader_stats{
+        .preprocess_time_ms = result.preprocess_time_ms,
+        .compile_time_ms = result.compile_time_ms,
+        .optimize_time_ms = result.success() ? result.translation_unit->optimize_time_ms : 0.0f,
+        .spirv_words = result.success() ? result.translation_unit->code.size() : 0u,
+        .instructions_before = result.success() ? result.translation_unit->instructions_before : 0u,
+        .instructions = result.success() ? count_spirv_instructions(result.translation_unit->code) : 0u,
+        .profile = optimized ? profile : Spirv_profile::none,
+        .include_count = static_cast<size_t>(std::distance(includes.begin(), std::unique(includes.begin(), includes.end()))),
+        .last_compiled = std::chrono::system_clock::now()
+    };
+    if (!result.success()) {
+        variant_result.error = std::move(result.error);
+        return;
+    }
+    const std::vector<uint32_t>& code = result.translation_unit->code;
+    if (superseded && superseded()) {
+        // A newer edit will replace this result anyway, don't bother creating the module
+        m_compiles_skipped.fetch_add(1u, std::memory_order_relaxed);
+        return;
     }
-    else {
-        shader.error = "";
-        size_t code_size = sizeof(shaderc::SpvCompilationResult::element_type) * std::distance(compile_result.begin(), compile_result.end());
-        shader.module = m_device.createShaderModule(vk::ShaderModuleCreateInfo{
-            .codeSize = code_size,
-            .pCode = compile_result.begin()
-            });
+
+    size_t code_size = sizeof(uint32_t) * code.size();
+    variant_result.module = m_device.createShaderModule(vk::ShaderModuleCreateInfo{
+        .codeSize = code_size,
+        .pCode = code.data()
+        });
 
 #ifdef USING_AFTERMATH
-        m_aftermath_database->add_binary(std::vector<uint8_t>((uint8_t*)compile_result.begin(), (uint8_t*)compile_result.end()));
+    m_aftermath_database->add_binary(std::vector<uint8_t>(reinterpret_cast<const uint8_t*>(code.data()), reinterpret_cast<const uint8_t*>(code.data()) + code_size));
 
-        auto assembly = m_compiler.CompileGlslToSpvAssembly(shader_file.data.data(), shader_file.size, shader_kind, shader_file.name.c_str(), group_compile_options);
+    auto& shader_file = engine_shader_files[shader.file_id];
+    auto assembly = m_shader_compiler.compile_assembly(result.preprocessed, shader_kind, shader_file.name, optimized);
+    std::string output_name = variant == Shader_variant::quality ?
+        fmt::format("{}_{}.spv", group_name, shader_file.name) :
+        fmt::format("{}_{}.{}.spv", group_name, shader_file.name, shader_variant_name(variant));
 
-        std::filesystem::path assembly_dir("assembly");
-        std::filesystem::path bin_dir("binary");
-        if (!std::filesystem::exists(assembly_dir)) {
-            std::filesystem::create_directory(assembly_dir);
-        }
-        if (!std::filesystem::exists(bin_dir)) {
-            std::filesystem::create_directory(bin_dir);
-        }
+    std::filesystem::path assembly_dir("assembly");
+    std::filesystem::path bin_dir("binary");
+    if (!std::filesystem::exists(assembly_dir)) {
+        std::filesystem::create_directory(assembly_dir);
+    }
+    if (!std::filesystem::exists(bin_dir)) {
+        std::filesystem::create_directory(bin_dir);
+    }
 
-        {
-            std::ofstream file(assembly_dir / fmt::format("{}_{}.spv", group_name, shader_file.name), std::ios::trunc | std::ios::binary);
-            if (!file.is_open()) {
-                throw std::runtime_error("failed to open file!");
-            }
-            file.write(
-                assembly.begin(),
-                sizeof(shaderc::AssemblyCompilationResult::element_type) * std::distance(assembly.begin(), assembly.end()));
-            file.close();
+    {
+        std::ofstream file(assembly_dir / output_name, std::ios::trunc | std::ios::binary);
+        if (!file.is_open()) {
+            throw std::runtime_error("failed to open file!");
         }
-        {
-            std::ofstream file(bin_dir / fmt::format("{}_{}.spv", group_name, shader_file.name), std::ios::trunc | std::ios::binary);
-            if (!file.is_open()) {
-                throw std::runtime_error("failed to open file!");
-            }
-            file.write(
-                reinterpret_cast<const char*>(compile_result.begin()),
-                code_size);
-            file.close();
+        file.write(assembly.data(), assembly.size());
+        file.close();
+    }
+    {
+        std::ofstream file(bin_dir / output_name, std::ios::trunc | std::ios::binary);
+        if (!file.is_open()) {
+            throw std::runtime_error("failed to open file!");
         }
-#endif
+        file.write(
+            reinterpret_cast<const char*>(code.data()),
+            code_size);
+        file.close();
     }
+#endif
 }
 
-std::string Shader_system::read_file(std::filesystem::path path) const
+void Shader_system::merge_variants(Shader& shader, Variant_results& variants, Variant_mask compiled_variants, bool optimized)
 {
-    if (!std::filesystem::exists(path)) {
-        throw std::runtime_error("Shader path doesn't exist on filesystem.");
+    shader.error.clear();
+    shader.included_file_id.clear();
+    float compile_time_ms = 0.0f;
+    bool stats_set = false;
+    for (size_t variant = 0u; variant < shader_variant_count; variant++) {
+        if (!compiled_variants.test(variant)) {
+            continue;
+        }
+        auto& result = variants[variant];
+        shader.modules[variant] = std::exchange(result.module, vk::ShaderModule{});
+        if (!result.error.empty() && shader.error.empty()) {
+            shader.error = fmt::format("[{}] {}", shader_variant_name(static_cast<Shader_variant>(variant)), result.error);
+        }
+        shader.included_file_id.insert(shader.included_file_id.end(), result.included_file_id.cbegin(), result.included_file_id.cend());
+        compile_time_ms = std::max(compile_time_ms, result.stats.compile_time_ms);
+        // The quality variant comes first when compiled
+        if (!stats_set) {
+            shader.stats = result.stats;
+            stats_set = true;
+        }
     }
-    if (!std::filesystem::is_regular_file(path)) {
-        throw std::runtime_error("Shader path is not a regular file.");
+    // Either every compiled variant is kept or none, so an edit never applies to only some of them
+    for (size_t variant = 0u; variant < shader_variant_count; variant++) {
+        if (compiled_variants.test(variant) && !shader.modules[variant]) {
+            destroy_modules(shader);
+            return;
+        }
     }
-
-    std::ifstream file(path.string(), std::ios::ate | std::ios::binary);
-
-    if (!file.is_open()) {
-        throw std::runtime_error("failed to open file!");
+    if (optimized) {
+        shader.tier = Shader_tier::optimized;
+        shader.optimized_time_ms = compile_time_ms;
+    }
+    else {
+        shader.tier = Shader_tier::preview;
+        shader.preview_time_ms = compile_time_ms;
     }
-    size_t file_size = (size_t)file.tellg();
-    std::string buffer("");
-    buffer.resize(file_size);
-    file.seekg(0);
-    file.read(buffer.data(), file_size);
-    file.close();
-
-    return buffer;
 }
 
-void Shader_system::write_file(Shader_file shader_file, bool engine_shader)
+void Shader_system::destroy_modules(Shader& shader)
 {
-    auto path = (engine_shader ? m_engine_directory : m_scene_directory) / shader_file.name;
-    if (!std::filesystem::exists(path)) {
-        throw std::runtime_error("Shader path doesn't exist on filesystem.");
-    }
-    if (!std::filesystem::is_regular_file(path)) {
-        throw std::runtime_error("Shader path is not a regular file.");
-    }
-
-    std::ofstream file(path, std::ios::trunc | std::ios::binary);
-
-    if (!file.is_open()) {
-        throw std::runtime_error("failed to open file!");
+    for (auto& module : shader.modules) {
+        if (module) {
+            m_device.destroyShaderModule(module);
+            module = vk::ShaderModule{};
+        }
     }
-    file.write(shader_file.data.data(), shader_file.size);
-    file.close();
 }
 
-}
\ No newline at end of file
+}
@@ -2,9 +2,21 @@
 #include "core/scene.hpp"
 #include "core/system.hpp"
 #include "core/shader.hpp"
+#include "file_watcher.hpp"
+#include "file_writer.hpp"
+#include "shader_compiler.hpp"
+#include "shader_dependencies.hpp"
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <chrono>
 #include <filesystem>
+#include <functional>
 #include <shaderc/shaderc.hpp>
+#include <marl/event.h>
 #include <marl/scheduler.h>
+#include <memory>
+#include <optional>
 #ifdef USING_AFTERMATH
 #include "vulkan/aftermath_database.hpp"
 #endif
@@ -27,18 +39,50 @@ public:
     void step(Scene& scene) override final;
     void cleanup(Scene& scene)  override final;
 private:
+    using Clock = std::chrono::steady_clock;
+    // Edits closer than that are merged in a single compilation
+    static constexpr std::chrono::milliseconds debounce_delay{ 150 };
+
+    // Variants of a shader are compiled by separate tasks, then merged in the shader
+    struct Variant_result {
+        vk::ShaderModule module;
+        std::string error;
+        std::vector<int> included_file_id;
+        Shader_stats stats;
+    };
+    using Variant_results = std::array<Variant_result, shader_variant_count>;
+    using Variant_mask = std::bitset<shader_variant_count>;
     struct Recompile_info {
         Shader* original;
         Shader copy;
         shaderc_shader_kind kind;
         std::string name;  // TODO stringview
+        int node_id;
+        Variant_mask compiled_variants;
+        Variant_results variants{};
+    };
+    // A compile job own a snapshot of the files so that several jobs can run while the user keep editing
+    // Results are only swapped in if no newer job was scheduled for the same shader
+    // The preview and optimized tiers only compile the variant in use, a background job then adds the other ones
+    struct Compile_job {
+        uint64_t generation;
+        bool optimized;
+        bool background = false;  // Add its variants to the shader instead of replacing it
+        Shader_variant active_variant;
+        Spirv_profile profile;
+        std::vector<Shader_file> engine_files;
+        std::vector<Shader_file> scene_files;
+        std::vector<Recompile_info> recompile_info;
+        Shader_compiler::Translation_units translation_units;
+        marl::Event finished{ marl::Event::Mode::Manual };
     };
 
     vk::Device m_device;
-    shaderc::Compiler m_compiler;
     std::filesystem::path m_engine_directory;
     std::filesystem::path m_scene_directory;
-    shaderc::CompileOptions m_group_compile_options;
+    Shader_compiler m_shader_compiler{ "shader_cache" };
+    File_writer m_file_writer;
+    std::optional<File_watcher> m_file_watcher;  // Created once the file list is known
 
     marl::Scheduler m_scheduler{ marl::Scheduler::Config::allCores() };
 
@@ -46,20 +90,45 @@ private:
     Aftermath_database* m_aftermath_database;
 #endif
 
-    // For multithread access
-    std::vector<Shader_file> m_engine_files_copy;
-    std::vector<Shader_file> m_scene_files_copy;
-    std::vector<Recompile_info> m_recompile_info;
-    std::atomic_flag m_compiling;
-    bool m_shaders_dirty = false;
+    Shader_dependencies m_dependencies;
+
+    // Edits waiting for the debounce delay
+    std::vector<int> m_pending_file_ids;
+    std::vector<int> m_pending_save_ids;  // Only the edits made in the editor, external ones are already on disk
+    Clock::time_point m_last_edit{};
+    bool m_pending_edit = false;
+
+    uint64_t m_generation = 0u;
+    std::vector<std::atomic<uint64_t>> m_node_generation;  // Generation of the latest job for each shader
+    std::vector<std::shared_ptr<Compile_job>> m_jobs;
+    std::atomic<size_t> m_compiles_skipped{ 0u };
+    Spirv_profile m_spirv_profile = Spirv_profile::none;  // Of the latest job
+
+    // Last contents sent to the disk for each file, a watcher event with one of them is our own save
+    static constexpr size_t saved_history_size = 4u;
+    std::vector<std::vector<std::shared_ptr<const std::string>>> m_saved_data;
 
+    void schedule_job(Scene& scene, bool optimized);
+    void run_job(std::shared_ptr<Compile_job> job);
+    void apply_finished_jobs(Scene& scene);
+    // The variant of a shader the renderer use when this one is selected
+    [[nodiscard]] static Shader_variant used_variant(shaderc_shader_kind kind, Shader_variant active_variant);
+    [[nodiscard]] bool all_modules_valid(Shader_variant active_variant) const;
+    void save_file(const Scene& scene, int file_id);  // Never block, see File_writer
+    [[nodiscard]] bool apply_external_change(Scene& scene, const File_watcher::Change& change);
+    // Write <path>.json and <path>.csv with the stats of every shader
+    void export_stats(const Shaders& shaders, const std::filesystem::path& path) const;
     void compile(
         const std::vector<Shader_file>& engine_shader_files,
         const std::vector<Shader_file>& scene_shader_files,
-        Shader& shader, shaderc_shader_kind shader_kind, const std::string& group_name = {});
-    [[nodiscard]] std::string read_file(std::filesystem::path path) const;
-    void write_file(Shader_file shader_file, bool engine_shader);
-    void check_if_dirty(Shader& shader, shaderc_shader_kind shader_kind, const std::string& group_name = {});
+        Shader_compiler::Translation_units& translation_units,
+        bool optimized, Spirv_profile profile,
+        const Shader& shader, Shader_variant variant, shaderc_shader_kind shader_kind, const std::string& group_name,
+        Variant_result& variant_result,
+        const std::function<bool()>& superseded = {});
+    // Move the compiled modules in the shader, keep all of them or none
+    void merge_variants(Shader& shader, Variant_results& variants, Variant_mask compiled_variants, bool optimized);
+    void destroy_modules(Shader& shader);
 
 };
 
@@ -0,0 +1,149 @@
+#include "spirv_cache.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include <fmt/core.h>
+
+namespace sdf_editor
+{
+
+constexpr uint32_t spirv_magic_number = 0x07230203;
+
+// FNV-1a, good enough to identify a translation unit
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size)
+{
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0u; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+Spirv_cache::Spirv_cache(std::filesystem::path directory) :
+    m_directory(std::move(directory))
+{
+    std::error_code error;
+    std::filesystem::create_directories(m_directory, error);
+    if (error) {
+        fmt::print("Warning: can't create shader cache directory {}: {}\n", m_directory.string(), error.message());
+        return;
+    }
+    prune();
+}
+
+uint64_t Spirv_cache::hash(
+    std::string_view preprocessed_source, shaderc_shader_kind shader_kind,
+    std::string_view group_name, std::string_view options_key)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = fnv1a(hash, preprocessed_source.data(), preprocessed_source.size());
+    hash = fnv1a(hash, &shader_kind, sizeof(shader_kind));
+    // Separators so that "ab" + "c" doesn't collide with "a" + "bc"
+    hash = fnv1a(hash, "\0", 1u);
+    hash = fnv1a(hash, group_name.data(), group_name.size());
+    hash = fnv1a(hash, "\0", 1u);
+    hash = fnv1a(hash, options_key.data(), options_key.size());
+    return hash;
+}
+
+std::filesystem::path Spirv_cache::path(uint64_t key) const
+{
+    return m_directory / fmt::format("{:016x}.spv", key);
+}
+
+std::vector<uint32_t> Spirv_cache::load(uint64_t key)
+{
+    std::vector<uint32_t> code;
+    std::ifstream file(path(key), std::ios::ate | std::ios::binary);
+    if (file.is_open()) {
+        auto file_size = static_cast<size_t>(file.tellg());
+        if (file_size >= sizeof(uint32_t) && file_size % sizeof(uint32_t) == 0u) {
+            code.resize(file_size / sizeof(uint32_t));
+            file.seekg(0);
+            file.read(reinterpret_cast<char*>(code.data()), file_size);
+            if (!file || code.front() != spirv_magic_number) {
+                code.clear();
+            }
+        }
+    }
+    if (code.empty()) {
+        m_misses.fetch_add(1u, std::memory_order_relaxed);
+    }
+    else {
+        m_hits.fetch_add(1u, std::memory_order_relaxed);
+        // Used recently, so kept by the next pruning
+        std::error_code error;
+        std::filesystem::last_write_time(path(key), std::filesystem::file_time_type::clock::now(), error);
+    }
+    return code;
+}
+
+void Spirv_cache::store(uint64_t key, const std::vector<uint32_t>& code) const
+{
+    // Write to a temporary file first so a concurrent load never see a partial binary
+    auto final_path = path(key);
+    auto temp_path = final_path;
+    temp_path += fmt::format(".{}.tmp", std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    {
+        std::ofstream file(temp_path, std::ios::trunc | std::ios::binary);
+        if (!file.is_open()) {
+            return;
+        }
+        file.write(reinterpret_cast<const char*>(code.data()), code.size() * sizeof(uint32_t));
+        if (!file) {
+            return;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temp_path, final_path, error);
+    if (error) {
+        std::filesystem::remove(temp_path, error);
+    }
+}
+
+void Spirv_cache::prune() const
+{
+    struct Entry
+    {
+        std::filesystem::path path;
+        std::filesystem::file_time_type last_used;
+        uintmax_t size;
+    };
+    std::vector<Entry> entries;
+    auto now = std::filesystem::file_time_type::clock::now();
+    std::error_code error;
+    for (std::filesystem::directory_iterator it(m_directory, error), end; !error && it != end; it.increment(error)) {
+        std::error_code entry_error;
+        auto last_write = it->last_write_time(entry_error);
+        auto size = it->file_size(entry_error);
+        if (entry_error) {
+            continue;
+        }
+        // A temporary file an hour old is not being written anymore
+        if (it->path().extension() == ".tmp" && now - last_write > std::chrono::hours(1)) {
+            std::filesystem::remove(it->path(), entry_error);
+        }
+        else if (it->path().extension() == ".spv") {
+            entries.push_back(Entry{ it->path(), last_write, size });
+        }
+    }
+
+    std::ranges::sort(entries, [](const Entry& a, const Entry& b) { return a.last_used > b.last_used; });
+    uintmax_t kept_size = 0u;
+    size_t removed = 0u;
+    for (const auto& entry : entries) {
+        kept_size += entry.size;
+        if (kept_size > max_size) {
+            std::filesystem::remove(entry.path, error);
+            removed++;
+        }
+    }
+    if (removed > 0u) {
+        fmt::print("Shader cache over {} MiB, {} least recently used binaries removed\n", max_size / (1024u * 1024u), removed);
+    }
+}
+
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <string_view>
+#include <vector>
+#include <shaderc/shaderc.hpp>
+
+namespace sdf_editor
+{
+
+// On-disk SPIR-V cache, one file per binary named after the hash of everything that influence the compilation
+// Safe to use from several compile tasks at the same time
+// A hit refreshes the modification time of its file, the least recently used ones are pruned when the cache is opened
+class Spirv_cache
+{
+public:
+    // Size kept by the pruning
+    static constexpr uintmax_t max_size = 256u * 1024u * 1024u;
+
+    Spirv_cache(std::filesystem::path directory);
+    Spirv_cache(const Spirv_cache& other) = delete;
+    Spirv_cache(Spirv_cache&& other) = delete;
+    Spirv_cache& operator=(const Spirv_cache& other) = delete;
+    Spirv_cache& operator=(Spirv_cache&& other) = delete;
+    ~Spirv_cache() = default;
+
+    [[nodiscard]] static uint64_t hash(
+        std::string_view preprocessed_source, shaderc_shader_kind shader_kind,
+        std::string_view group_name, std::string_view options_key);
+
+    // Return an empty vector on miss
+    [[nodiscard]] std::vector<uint32_t> load(uint64_t key);
+    void store(uint64_t key, const std::vector<uint32_t>& code) const;
+
+    [[nodiscard]] size_t hits() const { return m_hits.load(std::memory_order_relaxed); }
+    [[nodiscard]] size_t misses() const { return m_misses.load(std::memory_order_relaxed); }
+private:
+    std::filesystem::path m_directory;
+    std::atomic<size_t> m_hits{ 0u };
+    std::atomic<size_t> m_misses{ 0u };
+
+    [[nodiscard]] std::filesystem::path path(uint64_t key) const;
+    // Remove the least recently used binaries over max_size, and the temporary files left by a crash
+    void prune() const;
+};
+
+}
@@ -0,0 +1,61 @@
+#include "spirv_optimizer.hpp"
+
+#include <spirv-tools/optimizer.hpp>
+#include <fmt/core.h>
+
+namespace sdf_editor
+{
+
+bool optimize_spirv(std::vector<uint32_t>& code, Spirv_profile profile, std::string& error)
+{
+    if (profile == Spirv_profile::none) {
+        return true;
+    }
+    // Same target as the compile options of Shader_compiler
+    spvtools::Optimizer optimizer(SPV_ENV_VULKAN_1_2);
+    optimizer.SetMessageConsumer([&error](spv_message_level_t level, const char* /*source*/, const spv_position_t& position, const char* message) {
+        if (level <= SPV_MSG_ERROR) {
+            error += fmt::format("spirv-opt: {} (instruction {})\n", message, position.index);
+        }
+    });
+    switch (profile) {
+    case Spirv_profile::performance:
+        // Unrolling only touch loops marked [[unroll]] with a constant trip count (soft_shadow_miss, ambient_occlusion_miss)
+        // the performance passes then fold the constants it exposes and remove the dead branches
+        optimizer.RegisterPass(spvtools::CreateInlineExhaustivePass())
+            .RegisterPass(spvtools::CreateLoopUnrollPass(true))
+            .RegisterPerformancePasses();
+        break;
+    case Spirv_profile::size:
+        optimizer.RegisterSizePasses();
+        break;
+    default:
+        break;
+    }
+    std::vector<uint32_t> optimized;
+    if (!optimizer.Run(code.data(), code.size(), &optimized)) {
+        if (error.empty()) {
+            error = fmt::format("spirv-opt: {} profile failed\n", spirv_profile_name(profile));
+        }
+        return false;
+    }
+    code = std::move(optimized);
+    return true;
+}
+
+size_t count_spirv_instructions(const std::vector<uint32_t>& code)
+{
+    // 5 words of header, then each instruction start with its word count in the high half
+    constexpr size_t header_size = 5u;
+    size_t count = 0u;
+    for (size_t i = header_size; i < code.size(); count++) {
+        uint32_t word_count = code[i] >> 16u;
+        if (word_count == 0u) {
+            break;  // Malformed
+        }
+        i += word_count;
+    }
+    return count;
+}
+
+}
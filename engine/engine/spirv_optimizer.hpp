@@ -0,0 +1,16 @@
+#pragma once
+#include "core/shader.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace sdf_editor
+{
+
+// Run the spirv-tools passes of the profile on a shaderc binary
+// Thread safe, each call use its own optimizer. Return false and leave the code untouched on failure
+[[nodiscard]] bool optimize_spirv(std::vector<uint32_t>& code, Spirv_profile profile, std::string& error);
+
+[[nodiscard]] size_t count_spirv_instructions(const std::vector<uint32_t>& code);
+
+}
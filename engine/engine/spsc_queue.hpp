@@ -0,0 +1,50 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <optional>
+
+namespace sdf_editor
+{
+
+// Lock-free bounded queue with exactly one producer thread and one consumer thread
+template<typename T, size_t capacity>
+class Spsc_queue
+{
+public:
+    // Producer only, return false if the queue is full
+    bool push(T&& value)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) == capacity) {
+            return false;
+        }
+        m_slots[tail % capacity] = std::move(value);
+        m_tail.store(tail + 1u, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only
+    std::optional<T> pop()
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire)) {
+            return std::nullopt;
+        }
+        std::optional<T> value(std::move(m_slots[head % capacity]));
+        m_head.store(head + 1u, std::memory_order_release);
+        return value;
+    }
+private:
+    static constexpr size_t cache_line_size = 64u;
+
+    // Padded onto separate cache lines so the two threads don't fight over them
+    // alignas would pad the class instead, which MSVC warns about (C4324)
+    std::array<T, capacity> m_slots{};
+    std::array<std::byte, cache_line_size> m_slots_padding{};
+    std::atomic<size_t> m_head{ 0u };
+    std::array<std::byte, cache_line_size - sizeof(std::atomic<size_t>)> m_head_padding{};
+    std::atomic<size_t> m_tail{ 0u };
+};
+
+}
@@ -1,93 +1,117 @@
 #include "transform_system.hpp"
 #include "core/scene.hpp"
 
+#include <cstring>
+
 namespace sdf_editor
 {
 
-static size_t update_entity(Scene& scene, Entity& entity, size_t id = 0, const Entity* parent = nullptr)
+// Tag the instance with the generation when it differs from the previous step, each range has its own slots
+static void update_instance(Scene& scene, uint32_t slot, const vk::AccelerationStructureInstanceKHR& instance, uint64_t generation, bool& changed, bool& structure_changed)
 {
-    if (entity.dirty_local) {
-        if (parent) {
-            entity.local_transform = parent->global_transform.inverse() * entity.global_transform;
-        }
-        else {
-            entity.local_transform = entity.global_transform;
-        }
-        for (auto& child : entity.children) {
-            child.dirty_global = true;
-        }
-        entity.dirty_local = false;
-    }
-    if (entity.dirty_global) {
-        if (parent) {
-            entity.global_transform = parent->global_transform * entity.local_transform;
-        }
-        else {
-            entity.global_transform = entity.local_transform;
-        }
-        for (auto& child : entity.children) {
-            child.dirty_global = true;
-        }
-        entity.dirty_global = false;
-    }
-
-    if (entity.group_id >= Entity::empty_id)
-    {
-        id = id - 1;
-        if (entity.group_id == Entity::scene_id) {
-            scene.scene_global.transform = glm::translate(entity.global_transform.position) * glm::toMat4(entity.global_transform.rotation) * glm::scale(glm::vec3(entity.global_transform.scale));
-            scene.scene_global.transform = glm::inverse(scene.scene_global.transform);
-        }
-    }
-    else
-    {
-        glm::mat4 inv = glm::translate(entity.global_transform.position) * glm::toMat4(entity.global_transform.rotation) * glm::scale(glm::vec3(entity.local_transform.flip_axis)) * glm::scale(glm::vec3(entity.global_transform.scale));
-        if (scene.entities_instances.size() > id) {
-            scene.entities_instances[id].transform.matrix = std::array<std::array<float, 4>, 3>{
-                std::array<float, 4>{ inv[0].x, inv[1].x, inv[2].x, inv[3].x },
-                    std::array<float, 4>{ inv[0].y, inv[1].y, inv[2].y, inv[3].y },
-                    std::array<float, 4>{ inv[0].z, inv[1].z, inv[2].z, inv[3].z }
-            };
-            scene.entities_instances[id].instanceShaderBindingTableRecordOffset = 3 * static_cast<uint32_t>(entity.group_id); // 2 for primary + shadow
-        }
-        else {
-            uint64_t blas = scene.entities_instances.empty() ? 0 : scene.entities_instances.front().accelerationStructureReference;
-            scene.entities_instances.push_back(vk::AccelerationStructureInstanceKHR{
-                .transform = {
-                    .matrix = std::array<std::array<float, 4>, 3>{
-                        std::array<float, 4>{ inv[0].x, inv[1].x, inv[2].x, inv[3].x },
-                        std::array<float, 4>{ inv[0].y, inv[1].y, inv[2].y, inv[3].y },
-                        std::array<float, 4>{ inv[0].z, inv[1].z, inv[2].z, inv[3].z }
-                } },
-                .instanceCustomIndex = static_cast<uint32_t>(id),
-                .mask = 0xFF,
-                .instanceShaderBindingTableRecordOffset = 3 * static_cast<uint32_t>(entity.group_id), // 2 for primary + shadow
-                .accelerationStructureReference = blas
-                });
-        }
-    }
-    for (auto& child : entity.children) {
-        id = update_entity(scene, child, id + 1, &entity);
+    auto& previous = scene.entities_instances[slot];
+    if (std::memcmp(&previous, &instance, sizeof(instance)) == 0) {
+        return;
     }
-    return id;
+    // A refit can only move the instances
+    bool moved_only = previous.instanceCustomIndex == instance.instanceCustomIndex &&
+        previous.instanceShaderBindingTableRecordOffset == instance.instanceShaderBindingTableRecordOffset &&
+        previous.accelerationStructureReference == instance.accelerationStructureReference;
+    structure_changed = structure_changed || !moved_only;
+    changed = true;
+    previous = instance;
+    scene.instance_generations[slot] = generation;
 }
 
 Transform_system::Transform_system(Scene& scene)
 {
-    /*for (auto& entity : scene.entities) {
-        entity.dirty_global = true;
-    }*/
     step(scene);
 }
 
 void Transform_system::step(Scene& scene)
 {
-    size_t id = 0;
-    for (auto& entity : scene.entities)
-    {
-        id = update_entity(scene, entity, id);
-        id++;
+    auto& graph = scene.graph;
+    uint64_t generation = scene.instances_generation + 1u;
+    bool rebuilt = scene.hierarchy_dirty;
+    std::vector<uint32_t> released_slots;
+    if (scene.hierarchy_dirty) {
+        graph.build(scene.entities, scene.instance_slots, released_slots);
+        scene.hierarchy_dirty = false;
+        // New slots start inactive, the released ones are made inactive, both tagged so every TLAS uploads them
+        if (scene.entities_instances.size() != scene.instance_slots.size()) {
+            scene.entities_instances.resize(scene.instance_slots.size(), vk::AccelerationStructureInstanceKHR{});
+            scene.instance_generations.resize(scene.instance_slots.size(), generation);
+            scene.instances_generation = generation;
+            scene.instances_structure_generation = generation;
+        }
+        for (uint32_t slot : released_slots) {
+            scene.entities_instances[slot] = vk::AccelerationStructureInstanceKHR{};
+            scene.instance_generations[slot] = generation;
+            scene.instances_generation = generation;
+            scene.instances_structure_generation = generation;
+        }
+    }
+    graph.gather();
+    graph.propagate();
+    graph.scatter();
+    if (rebuilt) {
+        scene.entity_bvh.update_hierarchy(graph, scene.entities, Scene::hand_count, released_slots);
+    }
+    scene.entity_bvh.refit(graph);
+
+    m_ranges.resize(graph.range_count());
+    graph.for_each_range([this, &scene, &graph, generation](size_t range, uint32_t first, uint32_t last) {
+        auto& instances = m_ranges[range];
+        instances.nodes.clear();
+        instances.changed = false;
+        instances.structure_changed = false;
+        for (uint32_t id = first; id < last; id++) {
+            size_t group_id = graph.group_ids[id];
+            if (group_id == Entity::scene_id && graph.changed.test(id)) {
+                scene.scene_global.transform = glm::translate(graph.global_positions[id]) * glm::toMat4(graph.global_rotations[id]) * glm::scale(glm::vec3(graph.global_scales[id]));
+                scene.scene_global.transform = glm::inverse(scene.scene_global.transform);
+            }
+            uint32_t slot = graph.handles[id].slot;
+            const auto& previous = scene.entities_instances[slot];
+            if (group_id >= Entity::empty_id) {
+                // Entities without a group keep an inactive instance, with a null reference and no mask
+                if (previous.mask != 0u) {
+                    update_instance(scene, slot, vk::AccelerationStructureInstanceKHR{}, generation, instances.changed, instances.structure_changed);
+                }
+                continue;
+            }
+            uint64_t blas = group_id < scene.group_blas_addresses.size() ? scene.group_blas_addresses[group_id] : 0u;
+            // The renderer moves a group to another BLAS when its bounds change, with the AABBs in another block
+            uint32_t block = group_id < scene.group_primitive_blocks.size() ? scene.group_primitive_blocks[group_id] : static_cast<uint32_t>(group_id);
+            if (graph.changed.test(id) || previous.instanceCustomIndex != block || previous.accelerationStructureReference != blas) {
+                instances.nodes.push_back(id);
+            }
+        }
+
+        instances.transforms.resize(instances.nodes.size());
+        instance_transforms(graph, instances.nodes.data(), instances.nodes.size(), instances.transforms.data());
+        for (size_t i = 0u; i < instances.nodes.size(); i++) {
+            uint32_t id = instances.nodes[i];
+            auto group_id = static_cast<uint32_t>(graph.group_ids[id]);
+            uint64_t blas = group_id < scene.group_blas_addresses.size() ? scene.group_blas_addresses[group_id] : 0u;
+            uint32_t block = group_id < scene.group_primitive_blocks.size() ? scene.group_primitive_blocks[group_id] : group_id;
+            update_instance(scene, graph.handles[id].slot, vk::AccelerationStructureInstanceKHR{
+                .transform = { .matrix = instances.transforms[i] },
+                .instanceCustomIndex = block,  // Index of the BLAS primitives in the shaders
+                .mask = 0xFF,
+                .instanceShaderBindingTableRecordOffset = Scene::hit_groups_per_group * group_id,
+                .accelerationStructureReference = blas
+            }, generation, instances.changed, instances.structure_changed);
+        }
+        });
+    for (const auto& instances : m_ranges) {
+        if (instances.changed) {
+            scene.instances_generation = generation;
+        }
+        if (instances.structure_changed) {
+            scene.instances_structure_generation = generation;
+        }
     }
 }
 
-}
\ No newline at end of file
+}
@@ -1,5 +1,8 @@
 #pragma once
 #include "core/system.hpp"
+#include "core/instance_transforms.hpp"
+
+#include <vector>
 
 namespace sdf_editor
 {
@@ -14,6 +17,17 @@ public:
     Transform_system& operator=(Transform_system&& other) = delete;
     ~Transform_system() override = default;
     void step(Scene& scene) override final;
+private:
+    // Instances of a range of the Scene_graph, the ranges are merged in order once all are done
+    struct Range_instances
+    {
+        // Nodes whose instance is rewritten this step and their transforms, kept to reuse the allocations
+        std::vector<uint32_t> nodes;
+        std::vector<Instance_transform> transforms;
+        bool changed = false;
+        bool structure_changed = false;
+    };
+    std::vector<Range_instances> m_ranges;
 };
 
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #include "ui_system.hpp"
 #include "core/scene.hpp"
 #include <imgui.h>
+#include <algorithm>
+#include <chrono>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtx/quaternion.hpp>
@@ -23,11 +25,6 @@ Ui_system::Ui_system()
 
 void Ui_system::step(Scene& scene)
 {
-    if (!m_editor_init) {
-        m_editor_init = true;
-        m_editor.SetText(scene.shaders.engine_files.front().data);
-    }
-
     scene.saving = false;
     scene.resetting = false;
     // imgui input should be done before this call
@@ -57,8 +54,6 @@ void Ui_system::step(Scene& scene)
                 m_selected = Selected::engine_shader;
                 m_selected_id = id;
                 //m_selected_scene_group = Entity::empty_id;
-
-                m_editor.SetText(shader_file.data);
             }
             id++;
         }
@@ -77,7 +72,6 @@ void Ui_system::step(Scene& scene)
             if (ImGui::IsItemClicked()) {
                 m_selected = Selected::scenes_shader;
                 m_selected_id = id;
-                m_editor.SetText(shader_file.data);
 
                 size_t i = 0u;
                 m_selected_scene_group = Entity::empty_id;
@@ -138,6 +132,17 @@ void Ui_system::step(Scene& scene)
         }
         ImGui::TreePop();
     }
+    {
+        ImGuiTreeNodeFlags leaf_flags = ImGuiTreeNodeFlags_Leaf | ImGuiTreeNodeFlags_NoTreePushOnOpen;
+        if (m_selected == Selected::raymarch_settings) {
+            leaf_flags |= ImGuiTreeNodeFlags_Selected;
+        }
+        ImGui::TreeNodeEx("Raymarch settings", leaf_flags);
+        if (ImGui::IsItemClicked()) {
+            m_selected = Selected::raymarch_settings;
+            m_selected_id = 0;
+        }
+    }
     ImGui::Separator();
     if (ImGui::Button("Save")) {
         scene.saving = true;
@@ -185,12 +190,134 @@ int Ui_system::entity_node(Entity& entity, int id)
 
 void Ui_system::shader_text(Shader_file& shader_file)
 {
+    // Another file was selected or the file was reloaded after an external edit
+    if (shader_file.data != m_editor_source) {
+        m_editor.SetText(*shader_file.data);
+        m_editor_source = shader_file.data;
+    }
     m_editor.Render("TextEditor");
     if (m_editor.IsTextChanged()) {
         shader_file.dirty = true;
-        shader_file.data = m_editor.GetText();
-        shader_file.size = static_cast<int>(shader_file.data.size());
+        shader_file.data = std::make_shared<const std::string>(m_editor.GetText());
+        m_editor_source = shader_file.data;
+    }
+}
+
+void Ui_system::compilation_table(const Shaders& shaders)
+{
+    enum Column { group, file, tier, preprocess, compile, preview, optimized, spirv, instructions_before, instructions, includes, last_compiled, count };
+    ImGuiTableFlags flags = ImGuiTableFlags_Sortable | ImGuiTableFlags_SortMulti | ImGuiTableFlags_RowBg |
+        ImGuiTableFlags_BordersOuter | ImGuiTableFlags_BordersV | ImGuiTableFlags_Resizable | ImGuiTableFlags_ScrollY;
+    if (!ImGui::BeginTable("##compilation_table", Column::count, flags)) {
+        return;
+    }
+    ImGui::TableSetupScrollFreeze(0, 1);
+    ImGui::TableSetupColumn("Group");
+    ImGui::TableSetupColumn("File");
+    ImGui::TableSetupColumn("Tier");
+    ImGui::TableSetupColumn("Preprocess ms");
+    ImGui::TableSetupColumn("Compile ms", ImGuiTableColumnFlags_DefaultSort | ImGuiTableColumnFlags_PreferSortDescending);
+    ImGui::TableSetupColumn("Preview ms", ImGuiTableColumnFlags_PreferSortDescending);
+    ImGui::TableSetupColumn("Optimized ms", ImGuiTableColumnFlags_PreferSortDescending);
+    ImGui::TableSetupColumn("SPIR-V words", ImGuiTableColumnFlags_PreferSortDescending);
+    ImGui::TableSetupColumn("Instructions shaderc", ImGuiTableColumnFlags_PreferSortDescending);
+    ImGui::TableSetupColumn("Instructions", ImGuiTableColumnFlags_PreferSortDescending);
+    ImGui::TableSetupColumn("Includes", ImGuiTableColumnFlags_PreferSortDescending);
+    ImGui::TableSetupColumn("Last compiled");
+    ImGui::TableHeadersRow();
+
+    struct Row
+    {
+        const std::string* group_name;
+        const std::string* file_name;
+        const Shader* shader;
+    };
+    std::vector<Row> rows;
+    shaders.visit([&rows, &shaders](const std::string& group_name, const Shader& shader) {
+        rows.push_back(Row{ &group_name, &shaders.engine_files[shader.file_id].name, &shader });
+        });
+
+    // Stats change with every compile, sort every frame rather than only when the specs change
+    if (ImGuiTableSortSpecs* sort_specs = ImGui::TableGetSortSpecs()) {
+        auto compare = [](const Row& lhs, const Row& rhs, int column) -> int {
+            auto three_way = [](const auto& a, const auto& b) { return a < b ? -1 : (b < a ? 1 : 0); };
+            switch (column) {
+            case Column::group: return three_way(*lhs.group_name, *rhs.group_name);
+            case Column::file: return three_way(*lhs.file_name, *rhs.file_name);
+            case Column::tier: return three_way(lhs.shader->tier, rhs.shader->tier);
+            case Column::preprocess: return three_way(lhs.shader->stats.preprocess_time_ms, rhs.shader->stats.preprocess_time_ms);
+            case Column::compile: return three_way(lhs.shader->stats.compile_time_ms, rhs.shader->stats.compile_time_ms);
+            case Column::preview: return three_way(lhs.shader->preview_time_ms, rhs.shader->preview_time_ms);
+            case Column::optimized: return three_way(lhs.shader->optimized_time_ms, rhs.shader->optimized_time_ms);
+            case Column::spirv: return three_way(lhs.shader->stats.spirv_words, rhs.shader->stats.spirv_words);
+            case Column::instructions_before: return three_way(lhs.shader->stats.instructions_before, rhs.shader->stats.instructions_before);
+            case Column::instructions: return three_way(lhs.shader->stats.instructions, rhs.shader->stats.instructions);
+            case Column::includes: return three_way(lhs.shader->stats.include_count, rhs.shader->stats.include_count);
+            case Column::last_compiled: return three_way(lhs.shader->stats.last_compiled, rhs.shader->stats.last_compiled);
+            default: return 0;
+            }
+        };
+        std::ranges::stable_sort(rows, [&](const Row& lhs, const Row& rhs) {
+            for (int i = 0; i < sort_specs->SpecsCount; i++) {
+                const auto& spec = sort_specs->Specs[i];
+                int result = compare(lhs, rhs, spec.ColumnIndex);
+                if (result != 0) {
+                    return spec.SortDirection == ImGuiSortDirection_Ascending ? result < 0 : result > 0;
+                }
+            }
+            return false;
+            });
+        sort_specs->SpecsDirty = false;
+    }
+
+    for (const auto& row : rows) {
+        const auto& stats = row.shader->stats;
+        const char* tier = "none";
+        if (row.shader->tier == Shader_tier::preview) {
+            tier = "preview";
+        }
+        else if (row.shader->tier == Shader_tier::optimized) {
+            tier = "optimized";
+        }
+        ImGui::TableNextRow();
+        ImGui::TableNextColumn();
+        ImGui::TextUnformatted(row.group_name->c_str());
+        ImGui::TableNextColumn();
+        ImGui::TextUnformatted(row.file_name->c_str());
+        ImGui::TableNextColumn();
+        ImGui::TextUnformatted(tier);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.1f", stats.preprocess_time_ms);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.1f", stats.compile_time_ms);
+        // Slowest variant of the last compile of each tier, none until the tier compiled
+        for (float tier_time_ms : { row.shader->preview_time_ms, row.shader->optimized_time_ms }) {
+            ImGui::TableNextColumn();
+            if (tier_time_ms > 0.0f) {
+                ImGui::Text("%.1f", tier_time_ms);
+            }
+            else {
+                ImGui::TextUnformatted("-");
+            }
+        }
+        ImGui::TableNextColumn();
+        ImGui::Text("%zu", stats.spirv_words);
+        ImGui::TableNextColumn();
+        ImGui::Text("%zu", stats.instructions_before);
+        ImGui::TableNextColumn();
+        ImGui::Text("%zu (%s)", stats.instructions, spirv_profile_name(stats.profile));
+        ImGui::TableNextColumn();
+        ImGui::Text("%zu", stats.include_count);
+        ImGui::TableNextColumn();
+        if (stats.last_compiled.time_since_epoch().count() == 0) {
+            ImGui::TextUnformatted("never");
+        }
+        else {
+            auto age = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now() - stats.last_compiled);
+            ImGui::Text("%llds ago", static_cast<long long>(age.count()));
+        }
     }
+    ImGui::EndTable();
 }
 
 void Ui_system::record_selected(Scene& scene)
@@ -218,6 +345,11 @@ void Ui_system::record_selected(Scene& scene)
 
             if (ImGui::BeginTabItem("Error"))
             {
+                ImGui::Text("SPIR-V cache: %zu hits, %zu misses", scene.shaders.cache_hits, scene.shaders.cache_misses);
+                ImGui::Text("Edits coalesced: %zu, compiles skipped: %zu", scene.shaders.edits_coalesced, scene.shaders.compiles_skipped);
+                ImGui::Text("Files saved: %zu (%zu coalesced, %zu failed), latency %.1f ms (max %.1f ms)",
+                    scene.shaders.file_writes, scene.shaders.file_writes_coalesced, scene.shaders.file_write_failures,
+                    scene.shaders.file_write_latency_ms, scene.shaders.file_write_max_latency_ms);
                 auto print_error = [](const Shader& shader) {
                     if (!shader.error.empty()) {
                         ImGui::TextWrapped(shader.error.c_str());
@@ -232,9 +364,27 @@ void Ui_system::record_selected(Scene& scene)
                     print_error(shader_group.primary_closest_hit);
                     print_error(shader_group.shadow_any_hit);
                     print_error(shader_group.ao_any_hit);
+                    print_error(shader_group.bounds);
                 }
                 ImGui::EndTabItem();
             }
+
+            if (ImGui::BeginTabItem("Compilation"))
+            {
+                ImGui::Checkbox("Preview unoptimized shaders first", &scene.shaders.tiered_compilation);
+                // Applied by the shader system, every shader is recompiled
+                if (ImGui::BeginCombo("SPIR-V profile", spirv_profile_name(scene.shaders.spirv_profile))) {
+                    for (size_t i = 0u; i < spirv_profile_count; i++) {
+                        auto profile = static_cast<Spirv_profile>(i);
+                        if (ImGui::Selectable(spirv_profile_name(profile), profile == scene.shaders.spirv_profile)) {
+                            scene.shaders.spirv_profile = profile;
+                        }
+                    }
+                    ImGui::EndCombo();
+                }
+                compilation_table(scene.shaders);
+                ImGui::EndTabItem();
+            }
             ImGui::EndTabBar();
         }
         break;
@@ -276,16 +426,17 @@ void Ui_system::record_selected(Scene& scene)
                         }
                         if (found) {
                             entity.children.pop_back();
-                            scene.entities_instances.pop_back();
                         }
                      });
                 }
                 scene.entities[3].dirty_global = true;
+                scene.hierarchy_dirty = true;
             }
             if (ImGui::Button("Add new")) {
                 selected->children.emplace_back(Entity{
                     .dirty_global = true
                 });
+                scene.hierarchy_dirty = true;
             }
         }
         break;
@@ -330,6 +481,45 @@ void Ui_system::record_selected(Scene& scene)
         }
         break;
     }
+    case Selected::raymarch_settings:
+    {
+        auto& settings = scene.shaders.raymarch_settings;
+        // Sliders are applied when released, each change recreate the pipeline
+        bool dirty = ImGui::Checkbox("Override advance ratio", &settings.override_advance_ratio);
+        ImGui::SliderFloat("Advance ratio", &settings.advance_ratio, 0.3f, 1.5f, "%.2f");
+        dirty = dirty | (settings.override_advance_ratio && ImGui::IsItemDeactivatedAfterEdit());
+        dirty = dirty | ImGui::Checkbox("Override miss advance ratio", &settings.override_advance_ratio_miss);
+        ImGui::SliderFloat("Miss advance ratio", &settings.advance_ratio_miss, 0.3f, 1.5f, "%.2f");
+        dirty = dirty | (settings.override_advance_ratio_miss && ImGui::IsItemDeactivatedAfterEdit());
+        ImGui::SliderInt("Max steps", &settings.max_steps, 8, 512);
+        dirty = dirty | ImGui::IsItemDeactivatedAfterEdit();
+        ImGui::SliderInt("Max miss steps", &settings.max_steps_miss, 8, 2048);
+        dirty = dirty | ImGui::IsItemDeactivatedAfterEdit();
+        ImGui::SliderFloat("Black angle", &settings.angle_black, 0.1f, 3.0f, "%.2f");
+        dirty = dirty | ImGui::IsItemDeactivatedAfterEdit();
+        ImGui::SliderFloat("Two samples angle", &settings.angle_ms, 0.0f, 3.0f, "%.2f");
+        dirty = dirty | ImGui::IsItemDeactivatedAfterEdit();
+        dirty = dirty | ImGui::Checkbox("Two samples", &settings.sample_2);
+        // Every variant is already compiled, switching only recreate the pipeline
+        // After an edit the other variants are compiled in the background, the switch wait for them
+        if (ImGui::BeginCombo("Shader variant", shader_variant_name(settings.variant))) {
+            for (size_t i = 0u; i < shader_variant_count; i++) {
+                auto variant = static_cast<Shader_variant>(i);
+                if (ImGui::Selectable(shader_variant_name(variant), variant == settings.variant) && variant != settings.variant) {
+                    settings.variant = variant;
+                    dirty = true;
+                }
+            }
+            ImGui::EndCombo();
+        }
+        if (dirty) {
+            scene.shaders.raymarch_settings_dirty = true;
+        }
+        const auto& tlas_stats = scene.tlas_stats;
+        ImGui::Text("TLAS updates: %zu skipped, %zu refits, %zu rebuilds (%zu reallocations), %zu instances uploaded",
+            tlas_stats.skipped, tlas_stats.refits, tlas_stats.rebuilds, tlas_stats.reallocations, tlas_stats.instances_uploaded);
+        break;
+    }
     }
     ImGui::EndChild();
 
@@ -5,6 +5,8 @@
 #include <TextEditor.h>
 
 #include <limits>
+#include <memory>
+#include <string>
 
 namespace sdf_editor
 {
@@ -26,11 +28,12 @@ private:
         scenes_shader,
         entity,
         material,
-        light
+        light,
+        raymarch_settings
     };
 
     TextEditor m_editor;
-    bool m_editor_init = false;
+    std::shared_ptr<const std::string> m_editor_source;  // Snapshot displayed in m_editor
 
     Selected m_selected{ Selected::engine_shader };
     int m_selected_id{ 0 };
@@ -38,6 +41,7 @@ private:
 
     int entity_node(Entity& entity, int id = 0);
     void shader_text(Shader_file& shader_file);
+    void compilation_table(const Shaders& shaders);
 
     void record_selected(Scene& scene);
 };
@@ -54,6 +54,14 @@ struct Hit
     float transparency;
 };
 
+// Box of one primitive of a group BLAS, see Bounds_estimator
+struct Aabb
+{
+    vec3 lower;
+    vec3 upper;
+};
+const uint max_group_primitives = 64;  // Same as Bounds_estimator::max_primitives
+
 Hit make_hit(in float dist, in uint material_id)
 {
     return Hit(dist, material_id, 0.0);
@@ -1,5 +1,9 @@
+// Need GL_EXT_control_flow_attributes, the [[unroll]] loops are unrolled by the performance SPIR-V profile
 #include "miss.glsl"
 
+// Specialization constants, ids shared with Raytracing_pipeline::create_pipeline
+layout(constant_id = 1) const float advance_ratio_miss = ADVANCE_RATIO_MISS;
+
 layout(binding = 0, set = 0) uniform accelerationStructureEXT topLevelAS;
 layout(location = 1) rayPayloadEXT float shadow_payload;
 
@@ -8,7 +12,7 @@ float ambient_occlusion_miss(in Ray ray)
 	float occlusion = 0.0;
     float scale = 1.0;
     float len = length(ray.direction);
-    for(int i = 0; i < 5; i++)
+    [[unroll]] for(int i = 0; i < 5; i++)
     {
         float h = 0.01 + 0.15 * float(i) / 4.0;
         float d = map_miss(ray.origin + h / len * ray.direction).dist;
@@ -23,7 +27,7 @@ float soft_shadow_miss(in Ray ray, in float factor)
     float res = 1.0;
     float len = length(ray.direction);
     float t = 0.03;
-    for (int i = 0; i < 4; i++)
+    [[unroll]] for (int i = 0; i < 4; i++)
     {
         float distance = map_miss(ray.origin + t * ray.direction).dist;
         if(distance < 0.001) {
@@ -31,7 +35,7 @@ float soft_shadow_miss(in Ray ray, in float factor)
         }
         distance = distance / len;
         res = min(res, factor * distance / t);
-        t += ADVANCE_RATIO_MISS * distance;
+        t += advance_ratio_miss * distance;
     }
     return res;
 }
@@ -1,14 +1,40 @@
-Hit raymarch(in Ray ray)
+// Specialization constants, ids shared with Raytracing_pipeline::create_pipeline
+layout(constant_id = 0) const float advance_ratio = ADVANCE_RATIO;
+layout(constant_id = 2) const int max_steps = 128;
+
+// Boxes of the BLAS primitives, max_group_primitives per block, instances have the block of their BLAS as custom index
+layout(binding = 7, set = 0, scalar) buffer Primitives { Aabb a[]; } primitives;
+
+Aabb primitive_box()
+{
+    return primitives.a[gl_InstanceCustomIndexEXT * max_group_primitives + gl_PrimitiveID];
+}
+
+// Part of the ray inside the box, empty if x > y
+vec2 box_range(in Ray ray, in Aabb box)
+{
+    vec3 inv_direction = 1.0 / ray.direction;
+    vec3 t0 = (box.lower - ray.origin) * inv_direction;
+    vec3 t1 = (box.upper - ray.origin) * inv_direction;
+    vec3 t_near = min(t0, t1);
+    vec3 t_far = max(t0, t1);
+    return vec2(max(max(t_near.x, t_near.y), max(t_near.z, gl_RayTminEXT)),
+                min(min(t_far.x, t_far.y), min(t_far.z, gl_RayTmaxEXT)));
+}
+
+// Only march the part of the ray in the box, the other primitives are invoked for their own part
+Hit raymarch(in Ray ray, in Aabb box)
 {
+    vec2 range = box_range(ray, box);
     float len = length(ray.direction);
-    float t = gl_RayTminEXT;
-    for (int i = 0; i < 128 && t < gl_RayTmaxEXT; i++)
+    float t = range.x;
+    for (int i = 0; i < max_steps && t < range.y; i++)
     {
         Hit hit = map(ray.origin + t * ray.direction);
         if(hit.dist < 0.0001) {
             return Hit(t, hit.material_id, hit.transparency);
         }
-        t += ADVANCE_RATIO * hit.dist / len;
+        t += advance_ratio * hit.dist / len;
     }
     return Hit(-1.0, 0, 0.0);
 }
@@ -7,6 +7,8 @@
 #include <glm/gtx/quaternion.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include <limits>
+
 namespace sdf_editor::vr
 {
 
@@ -89,47 +91,45 @@ void Scene_vr_input::step(Scene& scene, xr::Session session, xr::Time display_ti
             const auto& hand = scene.entities[i];
             if (m_was_grabing[i])
             {
-                for (size_t p_id = 2u; p_id < scene.entities.size(); p_id++) {
-                    Entity& entity = scene.entities[p_id];
-                    entity.visit([this, &scene, &hand, scale, i](Entity& entity) {
-                        if (entity.hand_grabbing == i) {
-                            auto global_scale = entity.global_transform.scale;
-                            if (entity.group_id == Entity::scene_id) {
-                                entity.global_transform = Transform{ .position = hand.global_transform.position } * m_diff[i];
-                                for (auto& light : scene.lights) {
-                                    light.update(entity.global_transform);
-                                }
-                            }
-                            else {
-                                entity.global_transform = hand.global_transform * m_diff[i];
-                            }
-                            entity.global_transform.scale = std::clamp(scale * global_scale, 0.03f, 10.0f);
-                            entity.dirty_local = true;
+                // Skipped until the graph is rebuilt, its entity pointers may be stale
+                uint32_t node = scene.hierarchy_dirty ? Scene_graph::no_node : scene.graph.node(m_grabbed[i]);
+                if (node != Scene_graph::no_node) {
+                    Entity& entity = *scene.graph.entities[node];
+                    auto global_scale = entity.global_transform.scale;
+                    if (entity.group_id == Entity::scene_id) {
+                        entity.global_transform = Transform{ .position = hand.global_transform.position } * m_diff[i];
+                        for (auto& light : scene.lights) {
+                            light.update(entity.global_transform);
                         }
-                        });
+                    }
+                    else {
+                        entity.global_transform = hand.global_transform * m_diff[i];
+                    }
+                    entity.global_transform.scale = std::clamp(scale * global_scale, 0.03f, 10.0f);
+                    entity.dirty_local = true;
                 }
             }
-            else
+            else if (!scene.hierarchy_dirty)
             {
-                Entity* candidate = nullptr; // To make sure only one is selected
-                for (size_t p_id = 2u; p_id < scene.entities.size(); p_id++) {
-                    auto& entity = scene.entities[p_id];
-                    entity.visit([this, &hand, &candidate](Entity& entity) {
-                        entity.hand_grabbing = -1;
-                        if (entity.group_id >= Entity::empty_id) {
-                            if (!candidate && entity.group_id == Entity::scene_id) {
-                                candidate = &entity;
-                            }
-                        }
-                        else {
-                            if (glm::length2(entity.global_transform.position - hand.global_transform.position) <= (0.25 * entity.global_transform.scale * entity.global_transform.scale)) {
-                                candidate = &entity;
-                            }
-                        }
-                        });
+                // The nearest entity with a group whose sphere holds the hand, else the scene
+                const auto& graph = scene.graph;
+                glm::vec3 hand_position = hand.global_transform.position;
+                uint32_t node = scene.entity_bvh.nearest(hand_position, [&graph, &hand_position](uint32_t id) {
+                    float distance2 = glm::length2(graph.global_positions[id] - hand_position);
+                    float scale = graph.global_scales[id];
+                    if (graph.group_ids[id] >= Entity::empty_id || distance2 > 0.25f * scale * scale) {
+                        return std::numeric_limits<float>::infinity();
+                    }
+                    return distance2;
+                    });
+                Entity* candidate = node != Entity_bvh::no_node ? graph.entities[node] : nullptr;
+                for (size_t p_id = Scene::hand_count; !candidate && p_id < scene.entities.size(); p_id++) {
+                    if (scene.entities[p_id].group_id == Entity::scene_id) {
+                        candidate = &scene.entities[p_id];
+                    }
                 }
                 if (candidate) {
-                    candidate->hand_grabbing = i;
+                    m_grabbed[i] = candidate->handle;
                     if (candidate->group_id == Entity::scene_id) {
                         m_diff[i] = Transform{ .position = hand.global_transform.position }.inverse() * candidate->global_transform;
                     }
@@ -30,6 +30,7 @@ private:
 
     std::array<bool, 2> m_was_grabing;
     std::array<Transform, 2> m_diff;
+    std::array<Entity_handle, 2> m_grabbed;
 
 };
 
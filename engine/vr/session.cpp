@@ -85,6 +85,11 @@ Session::~Session()
     }
 }
 
+void Session::wait_pipeline_build(Scene& scene)
+{
+    m_renderer.wait_pipeline_build(scene);
+}
+
 void Session::step(xr::Instance instance, Scene& scene, std::vector<std::unique_ptr<System>>& systems)
 {
     poll_events(instance);
@@ -189,7 +194,7 @@ void Session::draw_frame(Scene& scene, std::vector<std::unique_ptr<System>>& sys
 
             auto total_extent = m_swapchain.vk_view_extent();
             total_extent.width *= 2;
-            m_renderer.start_recording(command_buffer, scene);
+            m_renderer.start_recording(command_buffer, scene, command_pool_id);
             m_renderer.barrier_vr_swapchain(command_buffer, m_swapchain.vk_images[swapchain_index]);
             m_renderer.trace(command_buffer, scene, command_pool_id, total_extent);
             m_mirror.copy(command_buffer, m_renderer.per_frame[command_pool_id].storage_image.image, command_pool_id, m_swapchain.vk_view_extent());
@@ -33,6 +33,7 @@ public:
     ~Session();
 
     void step(xr::Instance instance, Scene& scene, std::vector<std::unique_ptr<System>>& systems);
+    void wait_pipeline_build(Scene& scene);
 private:
     xr::SystemId m_system_id;
     xr::Space m_stage_space;
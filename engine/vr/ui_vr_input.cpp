@@ -5,9 +5,23 @@
 #include <glm/gtx/transform.hpp>
 #include "core/transform.hpp"
 
+#include <cmath>
+#include <limits>
+
 namespace sdf_editor::vr
 {
 
+// Where the pointer line of the hand crosses the panel plane, in [0, 1] over the panel, and how far from the hand
+static float pointed_position(const Transform& panel, const Transform& hand, glm::vec3& mouse)
+{
+    Transform transf = panel.inverse() * hand;
+    glm::vec3 ptr_direction = glm::rotate(transf.rotation, glm::vec3(0.0f, 0.0f, 1.0f));
+    float t = -transf.position.z / ptr_direction.z;
+    mouse = transf.position + t * ptr_direction;
+    mouse = mouse + 0.5f;
+    return std::abs(t) * panel.scale;
+}
+
 Ui_vr_input::Ui_vr_input(xr::Instance instance, xr::Session /*session*/, std::vector<xr::ActionSet>& action_sets)
 {
     m_action_set = instance.createActionSet(xr::ActionSetCreateInfo{
@@ -57,23 +71,24 @@ void Ui_vr_input::step(Scene& scene, xr::Session session, xr::Time /*display_tim
 
     if (!scene.mouse_control)
     {
-        for (const auto& entity : scene.entities) {
-            if (entity.group_id == 1)
-            {
-                Entity& hand = scene.entities[m_last_active_hand];
-
-                Transform transf = entity.global_transform.inverse() * hand.global_transform;
-                glm::vec3 ptr_direction = glm::rotate(transf.rotation, glm::vec3(0.0f, 0.0f, 1.0f));
-                float t = -transf.position.z / ptr_direction.z;
-                glm::vec3 mouse = transf.position + t * ptr_direction;
-                mouse = mouse + 0.5f;
-
-                if (mouse.x >= 0.0f && mouse.x <= 1.0f && mouse.y >= 0.0f && mouse.y <= 1.0f)
-                {
-                    ImGuiIO& io = ImGui::GetIO();
-                    io.MousePos = ImVec2(mouse.x * io.DisplaySize.x, (1.0f - mouse.y) * io.DisplaySize.y);
-                }
+        // The top level panel closest along the pointer line
+        const auto& graph = scene.graph;
+        const Transform& hand = scene.entities[m_last_active_hand].global_transform;
+        glm::vec3 ptr_direction = glm::rotate(hand.rotation, glm::vec3(0.0f, 0.0f, 1.0f));
+        glm::vec3 mouse;
+        uint32_t node = scene.entity_bvh.nearest_on_line(hand.position, ptr_direction, [&graph, &hand, &mouse](uint32_t id) {
+            if (graph.group_ids[id] != 1u || graph.parents[id] != Scene_graph::no_parent) {
+                return std::numeric_limits<float>::infinity();
             }
+            float distance = pointed_position(graph.global_transform(id), hand, mouse);
+            bool inside = mouse.x >= 0.0f && mouse.x <= 1.0f && mouse.y >= 0.0f && mouse.y <= 1.0f;
+            return inside ? distance : std::numeric_limits<float>::infinity();
+            });
+        if (node != Entity_bvh::no_node)
+        {
+            pointed_position(graph.global_transform(node), hand, mouse);
+            ImGuiIO& io = ImGui::GetIO();
+            io.MousePos = ImVec2(mouse.x * io.DisplaySize.x, (1.0f - mouse.y) * io.DisplaySize.y);
         }
     }
 }
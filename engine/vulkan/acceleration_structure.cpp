@@ -3,8 +3,10 @@
 #include "command_buffer.hpp"
 #include "core/scene.hpp"
 
+#include <algorithm>
 #include <glm/gtx/string_cast.hpp>
 #include <fmt/core.h>
+#include <stdexcept>
 
 namespace sdf_editor::vulkan
 {
@@ -46,21 +48,27 @@ Blas::Blas(Context& context) :
     Acceleration_structure(context)
 {}
 
-void Blas::build(vk::CommandBuffer command_buffer)
+void Blas::build(vk::CommandBuffer command_buffer, const std::vector<vk::AabbPositionsKHR>& new_aabbs, uint32_t max_primitive_count)
 {
-    vk::AabbPositionsKHR aabb{ -0.5f, -0.5f, -0.5f, 0.5f, 0.5f, 0.5f };
-
-    m_aabbs_buffer = Vma_buffer(
-        m_device, m_allocator,
-        vk::BufferCreateInfo{
-            .size = sizeof(vk::AabbPositionsKHR) * 1,
-            .usage = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress
-        },
-        VmaAllocationCreateInfo{
-            .flags = VMA_ALLOCATION_CREATE_MAPPED_BIT,
-            .usage = VMA_MEMORY_USAGE_CPU_TO_GPU
-        });
-    m_aabbs_buffer.copy(reinterpret_cast<void*>(&aabb), 1 * sizeof(vk::AabbPositionsKHR));
+    bool first_build = !acceleration_structure;
+    if (first_build) {
+        m_max_primitive_count = max_primitive_count;
+        m_aabbs_buffer = Vma_buffer(
+            m_device, m_allocator,
+            vk::BufferCreateInfo{
+                .size = sizeof(vk::AabbPositionsKHR) * m_max_primitive_count,
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress
+            },
+            VmaAllocationCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                .usage = VMA_MEMORY_USAGE_CPU_TO_GPU
+            });
+    }
+    if (new_aabbs.empty() || new_aabbs.size() > m_max_primitive_count) {
+        throw std::runtime_error(fmt::format("BLAS built with {} AABBs, between 1 and {} expected", new_aabbs.size(), m_max_primitive_count));
+    }
+    aabbs = new_aabbs;
+    m_aabbs_buffer.copy(reinterpret_cast<const void*>(aabbs.data()), aabbs.size() * sizeof(vk::AabbPositionsKHR));
     m_aabbs_buffer.flush();
 
     vk::DeviceAddress aabb_buffer_address = m_device.getBufferAddress(vk::BufferDeviceAddressInfo{ .buffer = m_aabbs_buffer.buffer });
@@ -80,59 +88,78 @@ void Blas::build(vk::CommandBuffer command_buffer)
             .pGeometries = &acceleration_structure_geometry
     };
 
-    vk::AccelerationStructureBuildSizesInfoKHR build_size = m_device.getAccelerationStructureBuildSizesKHR(
-        vk::AccelerationStructureBuildTypeKHR::eDevice, geom_info, 1u);
+    if (first_build) {
+        vk::AccelerationStructureBuildSizesInfoKHR build_size = m_device.getAccelerationStructureBuildSizesKHR(
+            vk::AccelerationStructureBuildTypeKHR::eDevice, geom_info, m_max_primitive_count);
 
-    m_structure_buffer = Vma_buffer(
-        m_device, m_allocator,
-        vk::BufferCreateInfo{
+        m_structure_buffer = Vma_buffer(
+            m_device, m_allocator,
+            vk::BufferCreateInfo{
+                .size = build_size.accelerationStructureSize,
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                .sharingMode = vk::SharingMode::eExclusive },
+                VmaAllocationCreateInfo{ .usage = VMA_MEMORY_USAGE_GPU_ONLY });
+        m_scratch_buffer = Vma_buffer(
+            m_device, m_allocator,
+            vk::BufferCreateInfo{
+                .size = std::max(build_size.buildScratchSize, build_size.updateScratchSize),
+                .usage = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                .sharingMode = vk::SharingMode::eExclusive },
+                VmaAllocationCreateInfo{ .usage = VMA_MEMORY_USAGE_GPU_ONLY });
+
+        acceleration_structure = m_device.createAccelerationStructureKHR(vk::AccelerationStructureCreateInfoKHR{
+            .createFlags = {},
+            .buffer = m_structure_buffer.buffer,
+            .offset = 0u,
             .size = build_size.accelerationStructureSize,
-            .usage = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress,
-            .sharingMode = vk::SharingMode::eExclusive },
-            VmaAllocationCreateInfo{ .usage = VMA_MEMORY_USAGE_GPU_ONLY });
-    m_scratch_buffer = Vma_buffer(
-        m_device, m_allocator,
-        vk::BufferCreateInfo{
-            .size = std::max(build_size.buildScratchSize, build_size.updateScratchSize),
-            .usage = vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress,
-            .sharingMode = vk::SharingMode::eExclusive },
-            VmaAllocationCreateInfo{ .usage = VMA_MEMORY_USAGE_GPU_ONLY });
+            .type = vk::AccelerationStructureTypeKHR::eBottomLevel });
+        structure_address = m_device.getAccelerationStructureAddressKHR(vk::AccelerationStructureDeviceAddressInfoKHR{
+            .accelerationStructure = acceleration_structure });
+    }
     vk::DeviceAddress scratch_address = m_device.getBufferAddress(vk::BufferDeviceAddressInfo{ .buffer = m_scratch_buffer.buffer });
 
-    acceleration_structure = m_device.createAccelerationStructureKHR(vk::AccelerationStructureCreateInfoKHR{
-        .createFlags = {},
-        .buffer = m_structure_buffer.buffer,
-        .offset = 0u,
-        .size = build_size.accelerationStructureSize,
-        .type = vk::AccelerationStructureTypeKHR::eBottomLevel });
-
     geom_info.dstAccelerationStructure = acceleration_structure;
     geom_info.scratchData = scratch_address;
 
     vk::AccelerationStructureBuildRangeInfoKHR build_range{
-            .primitiveCount = 1u,
+            .primitiveCount = static_cast<uint32_t>(aabbs.size()),
             .primitiveOffset = 0u,
             .firstVertex = 0u,
             .transformOffset = 0u
     };
     command_buffer.buildAccelerationStructuresKHR(geom_info, &build_range);
-
-    structure_address = m_device.getAccelerationStructureAddressKHR(vk::AccelerationStructureDeviceAddressInfoKHR{
-        .accelerationStructure = acceleration_structure });
 }
 
 
-Tlas::Tlas(vk::CommandBuffer command_buffer, Context& context, const Blas& blas, Scene& scene) :
+Tlas::Tlas(vk::CommandBuffer command_buffer, Context& context, Scene& scene) :
     Acceleration_structure(context)
 {
+    // Instances created before the BLAS of their group existed, the inactive slots have no mask
     for (auto& instance : scene.entities_instances) {
-        instance.accelerationStructureReference = blas.structure_address;
+        if (instance.mask == 0u) {
+            continue;
+        }
+        size_t group_id = instance.instanceShaderBindingTableRecordOffset / Scene::hit_groups_per_group;
+        instance.instanceCustomIndex = scene.group_primitive_blocks[group_id];
+        instance.accelerationStructureReference = scene.group_blas_addresses[group_id];
+    }
+
+    allocate(std::max(scene.entities_instances.size(), initial_capacity));
+    update(command_buffer, scene, true, scene.tlas_stats);
+}
+
+void Tlas::allocate(size_t capacity)
+{
+    if (acceleration_structure) {
+        m_device.destroyAccelerationStructureKHR(acceleration_structure);
     }
+    m_capacity = capacity;
+    m_generation = 0u;  // The new instance buffer needs every instance
 
     m_instance_buffer = Vma_buffer(
-        context.device, context.allocator,
+        m_device, m_allocator,
         vk::BufferCreateInfo{
-            .size = sizeof(vk::AccelerationStructureInstanceKHR) * Scene::max_entities,
+            .size = sizeof(vk::AccelerationStructureInstanceKHR) * m_capacity,
             .usage = vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress
         },
         VmaAllocationCreateInfo{
@@ -156,7 +183,7 @@ Tlas::Tlas(vk::CommandBuffer command_buffer, Context& context, const Blas& blas,
         .pGeometries = &m_acceleration_structure_geometry
     };
     vk::AccelerationStructureBuildSizesInfoKHR build_size = m_device.getAccelerationStructureBuildSizesKHR(
-        vk::AccelerationStructureBuildTypeKHR::eDevice, geom_info, Scene::max_entities);
+        vk::AccelerationStructureBuildTypeKHR::eDevice, geom_info, static_cast<uint32_t>(m_capacity));
     m_structure_buffer = Vma_buffer(
         m_device, m_allocator,
         vk::BufferCreateInfo{
@@ -178,22 +205,50 @@ Tlas::Tlas(vk::CommandBuffer command_buffer, Context& context, const Blas& blas,
         .offset = 0u,
         .size = build_size.accelerationStructureSize,
         .type = vk::AccelerationStructureTypeKHR::eTopLevel });
-
-    update(command_buffer, scene, true);
 }
 
-void Tlas::update(vk::CommandBuffer command_buffer, const Scene& scene, bool first_build)
+void Tlas::update(vk::CommandBuffer command_buffer, const Scene& scene, bool force_rebuild, Tlas_stats& stats)
 {
-    // Update instances
-    m_instance_buffer.copy(reinterpret_cast<const void*>(scene.entities_instances.data()), scene.entities_instances.size() * sizeof(vk::AccelerationStructureInstanceKHR));
-    m_instance_buffer.flush();
+    const auto& instances = scene.entities_instances;
+    bool rebuild = force_rebuild || instances.size() != m_primitive_count || scene.instances_structure_generation > m_generation;
+    // The previous frame using this TLAS completed, so its resources can be replaced right away
+    if (instances.size() > m_capacity) {
+        allocate(std::max(instances.size(), 2u * m_capacity));
+        rebuild = true;
+        stats.reallocations++;
+    }
+    if (!rebuild && scene.instances_generation == m_generation) {
+        stats.skipped++;
+        return;
+    }
+
+    // Each per-frame TLAS has its own instance buffer, so the range is from its own last update
+    // The instances keep their slot, so a rebuild after adding or removing entities only uploads those
+    const auto& generations = scene.instance_generations;
+    size_t first = instances.size();
+    size_t last = 0u;
+    for (size_t i = 0u; i < instances.size(); i++) {
+        if (i >= generations.size() || generations[i] > m_generation) {
+            first = std::min(first, i);
+            last = i + 1u;
+        }
+    }
+    if (first < last) {
+        m_instance_buffer.copy(instances.data() + first, (last - first) * sizeof(vk::AccelerationStructureInstanceKHR), first * sizeof(vk::AccelerationStructureInstanceKHR));
+        m_instance_buffer.flush();
+        stats.instances_uploaded += last - first;
+    }
+    m_generation = scene.instances_generation;
+    m_primitive_count = instances.size();
+    if (rebuild) {
+        stats.rebuilds++;
+    }
+    else {
+        stats.refits++;
+    }
 
     vk::DeviceAddress scratch_address = m_device.getBufferAddress(vk::BufferDeviceAddressInfo{ .buffer = m_scratch_buffer.buffer });
 
-    if (scene.entities_instances.size() != m_primitive_count) {
-        first_build = true;
-        m_primitive_count = scene.entities_instances.size();
-    }
     vk::AccelerationStructureBuildRangeInfoKHR build_range{
             .primitiveCount = static_cast<uint32_t>(m_primitive_count),
             .primitiveOffset = 0u,
@@ -204,8 +259,8 @@ void Tlas::update(vk::CommandBuffer command_buffer, const Scene& scene, bool fir
         vk::AccelerationStructureBuildGeometryInfoKHR{
             .type = vk::AccelerationStructureTypeKHR::eTopLevel,
             .flags = vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace | vk::BuildAccelerationStructureFlagBitsKHR::eAllowUpdate,
-            .mode = first_build ? vk::BuildAccelerationStructureModeKHR::eBuild : vk::BuildAccelerationStructureModeKHR::eUpdate,
-            .srcAccelerationStructure = first_build ? nullptr : acceleration_structure,
+            .mode = rebuild ? vk::BuildAccelerationStructureModeKHR::eBuild : vk::BuildAccelerationStructureModeKHR::eUpdate,
+            .srcAccelerationStructure = rebuild ? nullptr : acceleration_structure,
             .dstAccelerationStructure = acceleration_structure,
             .geometryCount = 1,
             .pGeometries = &m_acceleration_structure_geometry,
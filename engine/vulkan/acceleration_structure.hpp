@@ -5,6 +5,7 @@
 namespace sdf_editor
 {
 struct Scene;
+struct Tlas_stats;
 }
 
 namespace sdf_editor::vulkan
@@ -39,32 +40,44 @@ public:
 
     Blas(Context& context);
     Blas(const Blas& other) = delete;
-    Blas(Blas&& other) = delete;
+    Blas(Blas&& other) = default;
     Blas& operator=(const Blas& other) = delete;
-    Blas& operator=(Blas&& other) = delete;
+    Blas& operator=(Blas&& other) = default;
     ~Blas() = default;
 
-    void build(vk::CommandBuffer command_buffer);
+    // The structure is created by the first call for max_primitive_count AABBs, rebuilding keeps the same address
+    void build(vk::CommandBuffer command_buffer, const std::vector<vk::AabbPositionsKHR>& new_aabbs, uint32_t max_primitive_count);
 private:
     Vma_buffer m_aabbs_buffer;
+    uint32_t m_max_primitive_count = 0u;
 };
 
 class Tlas : public Acceleration_structure
 {
 public:
-    Tlas(vk::CommandBuffer command_buffer, Context& context, const Blas& blas, Scene& scene);
+    static constexpr size_t initial_capacity = 32u;
+
+    Tlas(vk::CommandBuffer command_buffer, Context& context, Scene& scene);
     Tlas(const Tlas& other) = delete;
     Tlas(Tlas&& other) = default;
     Tlas& operator=(const Tlas& other) = delete;
     Tlas& operator=(Tlas&& other) = delete;
     ~Tlas() = default;
 
-    void update(vk::CommandBuffer command_buffer, const Scene& scene, bool first_build);
+    // Skip when no instance changed since the last update of this TLAS, refit when they only moved, otherwise rebuild
+    // Only the range of instances changed since then is uploaded
+    // Must be called once the previous frame using this TLAS completed, the structure is reallocated when the instances outgrow it
+    void update(vk::CommandBuffer command_buffer, const Scene& scene, bool force_rebuild, Tlas_stats& stats);
 protected:
     Vma_buffer m_instance_buffer;
+    uint64_t m_generation = 0u;  // Scene::instances_generation at the last update
+    size_t m_capacity = 0u;
     //std::vector<vk::AccelerationStructureInstanceKHR> m_instances{};
     vk::AccelerationStructureGeometryKHR m_acceleration_structure_geometry;
     size_t m_primitive_count = 0u;
+
+    // Instance, structure and scratch buffers sized for capacity instances, the previous structure is destroyed
+    void allocate(size_t capacity);
 };
 
 }
@@ -0,0 +1,265 @@
+#include "bounds_estimator.hpp"
+#include "context.hpp"
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <memory>
+
+namespace sdf_editor::vulkan
+{
+
+Bounds_estimator::Bounds_estimator(Context& context, vk::Sampler noise_sampler, vk::ImageView noise_view) :
+    m_device(context.device),
+    m_queue(context.graphics_queue),
+    m_command_pool(context.command_pool)
+{
+    std::array pool_sizes{
+        vk::DescriptorPoolSize{
+            .type = vk::DescriptorType::eCombinedImageSampler,
+            .descriptorCount = 1 },
+        vk::DescriptorPoolSize{
+            .type = vk::DescriptorType::eStorageBuffer,
+            .descriptorCount = 1 }
+    };
+    m_descriptor_pool = m_device.createDescriptorPool(vk::DescriptorPoolCreateInfo{
+        .maxSets = 2u,
+        .poolSizeCount = static_cast<uint32_t>(pool_sizes.size()),
+        .pPoolSizes = pool_sizes.data() });
+
+    // Same binding as in the ray tracing pipeline
+    vk::DescriptorSetLayoutBinding texture_binding{  // Noise texture
+        .binding = 4u,
+        .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+        .descriptorCount = 1u,
+        .stageFlags = vk::ShaderStageFlagBits::eCompute,
+        .pImmutableSamplers = &noise_sampler };
+    m_texture_layout = m_device.createDescriptorSetLayout(vk::DescriptorSetLayoutCreateInfo{
+        .bindingCount = 1u,
+        .pBindings = &texture_binding });
+    vk::DescriptorSetLayoutBinding bounds_binding{
+        .binding = 0u,
+        .descriptorType = vk::DescriptorType::eStorageBuffer,
+        .descriptorCount = 1u,
+        .stageFlags = vk::ShaderStageFlagBits::eCompute };
+    m_bounds_layout = m_device.createDescriptorSetLayout(vk::DescriptorSetLayoutCreateInfo{
+        .bindingCount = 1u,
+        .pBindings = &bounds_binding });
+
+    std::array set_layouts{ m_texture_layout, m_bounds_layout };
+    vk::PushConstantRange push_constants{
+        .stageFlags = vk::ShaderStageFlagBits::eCompute,
+        .offset = 0,
+        .size = sizeof(Scene_global) };
+    m_pipeline_layout = m_device.createPipelineLayout(vk::PipelineLayoutCreateInfo{
+        .setLayoutCount = static_cast<uint32_t>(set_layouts.size()),
+        .pSetLayouts = set_layouts.data(),
+        .pushConstantRangeCount = 1u,
+        .pPushConstantRanges = &push_constants });
+
+    auto descriptor_sets = m_device.allocateDescriptorSets(vk::DescriptorSetAllocateInfo{
+        .descriptorPool = m_descriptor_pool,
+        .descriptorSetCount = static_cast<uint32_t>(set_layouts.size()),
+        .pSetLayouts = set_layouts.data() });
+    m_texture_set = descriptor_sets[0];
+    m_bounds_set = descriptor_sets[1];
+
+    m_occupancy_buffer = Vma_buffer(
+        context.device, context.allocator,
+        vk::BufferCreateInfo{
+            .size = sizeof(Occupancy),
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer },
+        VmaAllocationCreateInfo{
+            .flags = VMA_ALLOCATION_CREATE_MAPPED_BIT,
+            .usage = VMA_MEMORY_USAGE_GPU_TO_CPU
+        });
+
+    vk::DescriptorImageInfo image_info{
+        .imageView = noise_view,
+        .imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal };
+    vk::DescriptorBufferInfo buffer_info{
+        .buffer = m_occupancy_buffer.buffer,
+        .offset = 0u,
+        .range = sizeof(Occupancy) };
+    m_device.updateDescriptorSets(std::array{
+        vk::WriteDescriptorSet{
+            .dstSet = m_texture_set,
+            .dstBinding = 4u,
+            .dstArrayElement = 0u,
+            .descriptorCount = 1u,
+            .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+            .pImageInfo = &image_info },
+        vk::WriteDescriptorSet{
+            .dstSet = m_bounds_set,
+            .dstBinding = 0u,
+            .dstArrayElement = 0u,
+            .descriptorCount = 1u,
+            .descriptorType = vk::DescriptorType::eStorageBuffer,
+            .pBufferInfo = &buffer_info } }, {});
+
+    m_fence = m_device.createFence(vk::FenceCreateInfo{});
+}
+
+Bounds_estimator::~Bounds_estimator()
+{
+    if (m_command_buffer) {
+        [[maybe_unused]] auto result = m_device.waitForFences(m_fence, true, std::numeric_limits<uint64_t>::max());
+        finish();
+    }
+    m_device.destroyFence(m_fence);
+    m_device.destroyPipelineLayout(m_pipeline_layout);
+    m_device.destroyDescriptorSetLayout(m_texture_layout);
+    m_device.destroyDescriptorSetLayout(m_bounds_layout);
+    m_device.destroyDescriptorPool(m_descriptor_pool);
+}
+
+std::vector<vk::AabbPositionsKHR> Bounds_estimator::estimate(vk::ShaderModule module, const Scene_global& scene_global)
+{
+    start(module, scene_global);
+    if (m_command_buffer) {
+        [[maybe_unused]] auto result = m_device.waitForFences(m_fence, true, std::numeric_limits<uint64_t>::max());
+    }
+    return *poll();
+}
+
+void Bounds_estimator::start(vk::ShaderModule module, const Scene_global& scene_global)
+{
+    if (!module) {
+        m_surface_missing = true;
+        return;
+    }
+
+    vk::SpecializationMapEntry map_entry{ .constantID = 0u, .offset = 0u, .size = sizeof(uint32_t) };
+    vk::SpecializationInfo specialization_info{
+        .mapEntryCount = 1u,
+        .pMapEntries = &map_entry,
+        .dataSize = sizeof(grid_size),
+        .pData = &grid_size
+    };
+    m_pipeline = m_device.createComputePipeline(nullptr, vk::ComputePipelineCreateInfo{
+        .stage = vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eCompute,
+            .module = module,
+            .pName = "main",
+            .pSpecializationInfo = &specialization_info },
+        .layout = m_pipeline_layout }).value;
+
+    // Too big for the stack
+    auto occupancy = std::make_unique<Occupancy>();
+    m_occupancy_buffer.copy(occupancy.get(), sizeof(Occupancy));
+    m_occupancy_buffer.flush();
+
+    m_command_buffer = m_device.allocateCommandBuffers(vk::CommandBufferAllocateInfo{
+        .commandPool = m_command_pool,
+        .level = vk::CommandBufferLevel::ePrimary,
+        .commandBufferCount = 1 }).front();
+    m_command_buffer.begin(vk::CommandBufferBeginInfo{ .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
+    m_command_buffer.bindPipeline(vk::PipelineBindPoint::eCompute, m_pipeline);
+    m_command_buffer.bindDescriptorSets(vk::PipelineBindPoint::eCompute, m_pipeline_layout, 0u, { m_texture_set, m_bounds_set }, {});
+    m_command_buffer.pushConstants(m_pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0u, sizeof(Scene_global), &scene_global);
+    m_command_buffer.dispatch(grid_size / 4u, grid_size / 4u, grid_size / 4u);
+    m_command_buffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eComputeShader,
+        vk::PipelineStageFlagBits::eHost,
+        {},
+        vk::MemoryBarrier{
+            .srcAccessMask = vk::AccessFlagBits::eShaderWrite,
+            .dstAccessMask = vk::AccessFlagBits::eHostRead },
+        {}, {});
+    m_command_buffer.end();
+    m_queue.submit(vk::SubmitInfo{
+        .commandBufferCount = 1,
+        .pCommandBuffers = &m_command_buffer }, m_fence);
+}
+
+std::optional<std::vector<vk::AabbPositionsKHR>> Bounds_estimator::poll()
+{
+    if (m_surface_missing) {
+        m_surface_missing = false;
+        return std::vector<vk::AabbPositionsKHR>{ unit_cube };
+    }
+    if (m_device.getFenceStatus(m_fence) != vk::Result::eSuccess) {
+        return std::nullopt;
+    }
+    finish();
+
+    auto occupancy = std::make_unique<Occupancy>();
+    m_occupancy_buffer.read(occupancy.get(), sizeof(Occupancy));
+    std::vector<vk::AabbPositionsKHR> boxes;
+    subdivide(*occupancy, Cell{ 0u, 0u, 0u }, grid_size, 0u, boxes);
+    if (boxes.empty()) {
+        boxes.push_back(unit_cube);
+    }
+    return boxes;
+}
+
+void Bounds_estimator::finish()
+{
+    m_device.resetFences(m_fence);
+    m_device.freeCommandBuffers(m_command_pool, m_command_buffer);
+    m_command_buffer = vk::CommandBuffer{};
+    m_device.destroyPipeline(m_pipeline);
+    m_pipeline = vk::Pipeline{};
+}
+
+void Bounds_estimator::subdivide(const Occupancy& occupancy, Cell origin, uint32_t size, uint32_t depth, std::vector<vk::AabbPositionsKHR>& boxes)
+{
+    if (depth < octree_depth) {
+        uint32_t half = size / 2u;
+        for (uint32_t child = 0u; child < 8u; child++) {
+            Cell child_origin{
+                origin[0] + ((child & 1u) ? half : 0u),
+                origin[1] + ((child & 2u) ? half : 0u),
+                origin[2] + ((child & 4u) ? half : 0u) };
+            subdivide(occupancy, child_origin, half, depth + 1u, boxes);
+        }
+        return;
+    }
+
+    Cell min_cell{ grid_size, grid_size, grid_size };
+    Cell max_cell{ 0u, 0u, 0u };
+    for (uint32_t z = origin[2]; z < origin[2] + size; z++) {
+        for (uint32_t y = origin[1]; y < origin[1] + size; y++) {
+            for (uint32_t x = origin[0]; x < origin[0] + size; x++) {
+                uint32_t index = (z * grid_size + y) * grid_size + x;
+                if (occupancy[index / 32u] & (1u << (index % 32u))) {
+                    Cell cell{ x, y, z };
+                    for (size_t i = 0u; i < 3u; i++) {
+                        min_cell[i] = std::min(min_cell[i], cell[i]);
+                        max_cell[i] = std::max(max_cell[i], cell[i]);
+                    }
+                }
+            }
+        }
+    }
+    if (min_cell[0] > max_cell[0]) {
+        return;
+    }
+    // One cell of margin, kept inside the leaf so the boxes don't overlap
+    constexpr float cell_size = 1.0f / static_cast<float>(grid_size);
+    auto to_position = [cell_size](uint32_t cell) {
+        return static_cast<float>(cell) * cell_size - 0.5f;
+    };
+    boxes.push_back(vk::AabbPositionsKHR{
+        to_position(std::max(min_cell[0], origin[0] + 1u) - 1u),
+        to_position(std::max(min_cell[1], origin[1] + 1u) - 1u),
+        to_position(std::max(min_cell[2], origin[2] + 1u) - 1u),
+        to_position(std::min(max_cell[0] + 2u, origin[0] + size)),
+        to_position(std::min(max_cell[1] + 2u, origin[1] + size)),
+        to_position(std::min(max_cell[2] + 2u, origin[2] + size)) });
+}
+
+float Bounds_estimator::invocation_ratio(const std::vector<vk::AabbPositionsKHR>& boxes)
+{
+    // For uniformly distributed rays, the probability to hit a convex shape is proportional to its area
+    float area = 0.0f;
+    for (const auto& box : boxes) {
+        float x = box.maxX - box.minX;
+        float y = box.maxY - box.minY;
+        float z = box.maxZ - box.minZ;
+        area += 2.0f * (x * y + y * z + z * x);
+    }
+    return area / 6.0f;
+}
+
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include "vk_common.hpp"
+#include "vma_buffer.hpp"
+#include "core/scene.hpp"
+
+#include <array>
+#include <optional>
+#include <vector>
+
+namespace sdf_editor::vulkan
+{
+
+class Context;
+
+// Run bounds.comp of a group to get the cells of its unit cube the surface can cross,
+// then split them with an octree whose leaves are shrunk to their cells, one BLAS primitive per leaf
+// The descriptor set 0 only has the noise texture, the only resource used in map functions
+class Bounds_estimator
+{
+public:
+    static constexpr uint32_t grid_size = 64u;  // Cells per axis, a multiple of the workgroup size of 4
+    static constexpr uint32_t octree_depth = 2u;
+    static constexpr uint32_t max_primitives = 1u << (3u * octree_depth);  // Same as max_group_primitives in common_types.glsl
+    static constexpr vk::AabbPositionsKHR unit_cube{ -0.5f, -0.5f, -0.5f, 0.5f, 0.5f, 0.5f };
+
+    Bounds_estimator(Context& context, vk::Sampler noise_sampler, vk::ImageView noise_view);
+    Bounds_estimator(const Bounds_estimator& other) = delete;
+    Bounds_estimator(Bounds_estimator&& other) = delete;
+    Bounds_estimator& operator=(const Bounds_estimator& other) = delete;
+    Bounds_estimator& operator=(Bounds_estimator&& other) = delete;
+    ~Bounds_estimator();
+
+    // Submit and wait, the unit cube if the surface wasn't found
+    [[nodiscard]] std::vector<vk::AabbPositionsKHR> estimate(vk::ShaderModule module, const Scene_global& scene_global);
+    // Submit with a fence, one estimate at a time: poll it until the boxes are ready
+    void start(vk::ShaderModule module, const Scene_global& scene_global);
+    // The boxes once the GPU finished, nothing while it is still running
+    [[nodiscard]] std::optional<std::vector<vk::AabbPositionsKHR>> poll();
+    // Intersection shader invocations of the boxes for a ray hitting the unit cube, on average
+    [[nodiscard]] static float invocation_ratio(const std::vector<vk::AabbPositionsKHR>& boxes);
+private:
+    using Cell = std::array<uint32_t, 3>;
+    static constexpr size_t occupancy_size = grid_size * grid_size * grid_size / 32u;
+    using Occupancy = std::array<uint32_t, occupancy_size>;
+
+    static void subdivide(const Occupancy& occupancy, Cell origin, uint32_t size, uint32_t depth, std::vector<vk::AabbPositionsKHR>& boxes);
+    // Free the resources of the finished estimate
+    void finish();
+
+    vk::Device m_device;
+    vk::Queue m_queue;
+    vk::CommandPool m_command_pool;
+    vk::DescriptorPool m_descriptor_pool;
+    vk::DescriptorSetLayout m_texture_layout;
+    vk::DescriptorSetLayout m_bounds_layout;
+    vk::PipelineLayout m_pipeline_layout;
+    vk::DescriptorSet m_texture_set;
+    vk::DescriptorSet m_bounds_set;
+    Vma_buffer m_occupancy_buffer;
+    vk::Fence m_fence;
+    vk::CommandBuffer m_command_buffer;  // With the pipeline, only while an estimate is running
+    vk::Pipeline m_pipeline;
+    bool m_surface_missing = false;  // Started without a module, the unit cube is ready right away
+};
+
+}
@@ -125,7 +125,6 @@ void Context::init_device(vr::Instance* vr_instance)
         VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
         VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
         VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME
-        // VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME
     };
 
 #ifdef USING_AFTERMATH
@@ -226,6 +225,14 @@ void Context::init_device(vr::Instance* vr_instance)
             }
         }
 
+        // Optional, the ray tracing pipeline fallback to a monolithic pipeline without it
+        pipeline_library_supported = std::any_of(available_extensions.cbegin(), available_extensions.cend(), [](const VkExtensionProperties& prop) {
+            return strcmp(prop.extensionName, VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME) == 0;
+        });
+        if (pipeline_library_supported) {
+            required_device_extensions.push_back(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
+        }
+
         // Create device now that we found a suitable gpu 
         physical_device = potential_physical_device;
         float queue_priority = 1.0f;
@@ -347,7 +354,7 @@ void Context::init_descriptor_pool()
             .descriptorCount = max_swapchain_size },
         vk::DescriptorPoolSize {
             .type = vk::DescriptorType::eStorageBuffer,
-            .descriptorCount = 1 + max_swapchain_size },
+            .descriptorCount = 1 + 3 * max_swapchain_size },
         vk::DescriptorPoolSize {
             .type = vk::DescriptorType::eUniformBuffer,
             .descriptorCount = max_swapchain_size },
@@ -30,6 +30,7 @@ public:
     vk::Queue graphics_queue;
     VmaAllocator allocator;
     vk::DescriptorPool descriptor_pool;
+    bool pipeline_library_supported = false;
 
     Context(Window& window, vr::Instance* vr_instance);
     Context(const Context& other) = delete;
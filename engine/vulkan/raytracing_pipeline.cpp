@@ -2,19 +2,30 @@
 #include "context.hpp"
 #include "core/scene.hpp"
 #include "command_buffer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
 #include <fstream>
+#include <stdexcept>
 #include <fmt/core.h>
+#include <marl/scheduler.h>
+#include <marl/waitgroup.h>
 
 namespace sdf_editor::vulkan
 {
 
 Raytracing_pipeline::Raytracing_pipeline(Context& context, Scene& scene, vk::Sampler immutable_sampler_noise, vk::Sampler immutable_sampler_ui) :
-    m_device(context.device)
+    m_device(context.device),
+    m_allocator(context.allocator)
 {
     vk::PhysicalDeviceProperties2 properties{};
     properties.pNext = &raytracing_properties;
     context.physical_device.getProperties2(&properties);
     fmt::print("Max ray {}\n", raytracing_properties.maxRayDispatchInvocationCount);
+    m_device_properties = properties.properties;
+    load_pipeline_cache();
+    m_use_libraries = context.pipeline_library_supported;
+    fmt::print("Ray tracing pipeline: {}\n", m_use_libraries ? "one library per group" : "monolithic (no VK_KHR_pipeline_library)");
 
     std::array array_bindings
     {
@@ -55,7 +66,12 @@ Raytracing_pipeline::Raytracing_pipeline(Context& context, Scene& scene, vk::Sam
             .descriptorType = vk::DescriptorType::eCombinedImageSampler,
             .descriptorCount = 1u,
             .stageFlags = vk::ShaderStageFlagBits::eMissKHR,
-            .pImmutableSamplers = &immutable_sampler_noise }
+            .pImmutableSamplers = &immutable_sampler_noise },
+        vk::DescriptorSetLayoutBinding{  // BLAS primitives
+            .binding = 7u,
+            .descriptorType = vk::DescriptorType::eStorageBuffer,
+            .descriptorCount = 1u,
+            .stageFlags = vk::ShaderStageFlagBits::eIntersectionKHR | vk::ShaderStageFlagBits::eAnyHitKHR }
     };
     descriptor_set_layout = m_device.createDescriptorSetLayout(vk::DescriptorSetLayoutCreateInfo{
         .bindingCount = static_cast<uint32_t>(array_bindings.size()),
@@ -74,32 +90,36 @@ Raytracing_pipeline::Raytracing_pipeline(Context& context, Scene& scene, vk::Sam
         .pushConstantRangeCount = 1u,
         .pPushConstantRanges = &push_constants });
 
-    create_pipeline(scene);
+    nb_group_miss = 2u;
+    nb_group_primary = scene.shaders.groups.size();
+    compute_shader_binding_table_layout();
 
-    auto temp_buffer_aligned = create_shader_binding_table();
+    auto build = build_pipeline(scene.shaders, scene.shaders.raymarch_settings);
+    pipeline = build.pipeline;
+    shader_binding_table = std::move(build.shader_binding_table);
     One_time_command_buffer command_buffer(context.device, context.command_pool, context.graphics_queue);
-    Buffer_from_staged buffer_and_staged(
-        context.device, context.allocator, command_buffer.command_buffer,
-        vk::BufferCreateInfo{
-            .size = temp_buffer_aligned.size(),
-            .usage = vk::BufferUsageFlagBits::eShaderBindingTableKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress
-        },
-        temp_buffer_aligned.data());
-    shader_binding_table = std::move(buffer_and_staged.result);
+    command_buffer.command_buffer.copyBuffer(build.staging.buffer, shader_binding_table.buffer, vk::BufferCopy{
+        .srcOffset = 0,
+        .dstOffset = 0,
+        .size = m_shader_binding_table_size });
     command_buffer.submit_and_wait_idle();
 }
 
 Raytracing_pipeline::~Raytracing_pipeline()
 {
+    save_pipeline_cache();
+    m_device.destroyPipelineCache(m_pipeline_cache);
     m_device.destroyPipeline(pipeline);
+    m_device.destroyPipeline(m_base_library.pipeline);
+    for (auto& library : m_group_libraries) {
+        m_device.destroyPipeline(library.pipeline);
+    }
     m_device.destroyPipelineLayout(pipeline_layout);
     m_device.destroyDescriptorSetLayout(descriptor_set_layout);
 }
 
-std::vector<uint8_t> Raytracing_pipeline::create_shader_binding_table()
+void Raytracing_pipeline::compute_shader_binding_table_layout()
 {
-    auto group_count = static_cast<uint32_t>(1 + nb_group_miss + 3 * nb_group_primary);
-
     auto base_alignement = [alignement = raytracing_properties.shaderGroupBaseAlignment](vk::DeviceSize offset) {
         auto ret = offset % alignement;
         return ret == 0 ? offset : offset + alignement - ret;
@@ -110,13 +130,19 @@ std::vector<uint8_t> Raytracing_pipeline::create_shader_binding_table()
     }
     offset_miss_group = base_alignement(1u * handle_size);
     offset_hit_group = base_alignement(offset_miss_group + nb_group_miss * handle_size);
+    shader_binding_table_stride = handle_size;
+    m_shader_binding_table_size = static_cast<uint32_t>(offset_hit_group + handle_size * 3 * nb_group_primary);
+}
 
+std::vector<uint8_t> Raytracing_pipeline::create_shader_binding_table(vk::Pipeline new_pipeline) const
+{
+    auto group_count = static_cast<uint32_t>(1 + nb_group_miss + 3 * nb_group_primary);
+    auto handle_size = shader_binding_table_stride;
     auto shader_binding_table_size = raytracing_properties.shaderGroupHandleSize * group_count;
-    auto shader_binding_table_size_aligned = static_cast<uint32_t>(offset_hit_group + handle_size * 3 * nb_group_primary);
 
-    std::vector<uint8_t> temp_buffer = m_device.getRayTracingShaderGroupHandlesKHR<uint8_t>(pipeline, 0u, group_count, shader_binding_table_size);
+    std::vector<uint8_t> temp_buffer = m_device.getRayTracingShaderGroupHandlesKHR<uint8_t>(new_pipeline, 0u, group_count, shader_binding_table_size);
 
-    std::vector<uint8_t> temp_buffer_aligned(shader_binding_table_size_aligned, 0);
+    std::vector<uint8_t> temp_buffer_aligned(m_shader_binding_table_size, 0);
     // Copy raygen
     memcpy(temp_buffer_aligned.data(), temp_buffer.data(), raytracing_properties.shaderGroupHandleSize);
     // Copy miss
@@ -128,108 +154,402 @@ std::vector<uint8_t> Raytracing_pipeline::create_shader_binding_table()
         memcpy(temp_buffer_aligned.data() + offset_hit_group + (3 * i + 1) * handle_size, temp_buffer.data() + (1 + nb_group_miss + 3 * i + 1) * raytracing_properties.shaderGroupHandleSize, raytracing_properties.shaderGroupHandleSize);
         memcpy(temp_buffer_aligned.data() + offset_hit_group + (3 * i + 2) * handle_size, temp_buffer.data() + (1 + nb_group_miss + 3 * i + 2) * raytracing_properties.shaderGroupHandleSize, raytracing_properties.shaderGroupHandleSize);
     }
-    shader_binding_table_stride = handle_size;
     return temp_buffer_aligned;
 }
 
-void Raytracing_pipeline::create_pipeline(Scene& scene)
+Raytracing_pipeline::Pipeline_build Raytracing_pipeline::build_pipeline(const Shaders& shaders, const Raymarch_settings& settings)
 {
-    std::vector shader_stages{
-        vk::PipelineShaderStageCreateInfo{
-            .stage = vk::ShaderStageFlagBits::eRaygenKHR,
-            .module = scene.shaders.raygen.module,
-            .pName = "main" },
-        vk::PipelineShaderStageCreateInfo{
-            .stage = vk::ShaderStageFlagBits::eMissKHR,
-            .module = scene.shaders.primary_miss.module,
-            .pName = "main" },
-        vk::PipelineShaderStageCreateInfo{
-            .stage = vk::ShaderStageFlagBits::eMissKHR,
-            .module = scene.shaders.shadow_miss.module,
-            .pName = "main" },
-        vk::PipelineShaderStageCreateInfo{
-            .stage = vk::ShaderStageFlagBits::eIntersectionKHR,
-            .module = scene.shaders.shadow_intersection.module,
-            .pName = "main" }
+    auto start_time = std::chrono::steady_clock::now();
+    Pipeline_build build;
+    build.pipeline = create_pipeline(shaders, settings, build.retired_libraries);
+
+    // The copy to the device local buffer is recorded by the frame thread
+    auto temp_buffer_aligned = create_shader_binding_table(build.pipeline);
+    build.staging = Vma_buffer(
+        m_device, m_allocator,
+        vk::BufferCreateInfo{
+            .size = temp_buffer_aligned.size(),
+            .usage = vk::BufferUsageFlagBits::eTransferSrc },
+        VmaAllocationCreateInfo{ .usage = VMA_MEMORY_USAGE_CPU_ONLY });
+    build.staging.map();
+    build.staging.copy(temp_buffer_aligned.data(), temp_buffer_aligned.size());
+    build.staging.unmap();
+    build.shader_binding_table = Vma_buffer(
+        m_device, m_allocator,
+        vk::BufferCreateInfo{
+            .size = temp_buffer_aligned.size(),
+            .usage = vk::BufferUsageFlagBits::eShaderBindingTableKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress | vk::BufferUsageFlagBits::eTransferDst },
+        VmaAllocationCreateInfo{ .usage = VMA_MEMORY_USAGE_GPU_ONLY });
+
+    std::chrono::duration<float, std::milli> build_time = std::chrono::steady_clock::now() - start_time;
+    build.build_time_ms = build_time.count();
+    return build;
+}
+
+vk::Pipeline Raytracing_pipeline::create_raytracing_pipeline(const vk::RayTracingPipelineCreateInfoKHR& create_info)
+{
+    // The pipeline handle is written when the operation completes, it must outlive it
+    vk::Pipeline new_pipeline;
+    vk::DeferredOperationKHR operation = m_device.createDeferredOperationKHR();
+    vk::Result result = m_device.createRayTracingPipelinesKHR(operation, m_pipeline_cache, 1u, &create_info, nullptr, &new_pipeline);
+    // The joins are scheduled on the marl workers of the thread, the calling thread joins too
+    // A thread returns once there is no work left for it, the operation may still be running on the others
+    marl::Scheduler* scheduler = marl::Scheduler::get();
+    while (result == vk::Result::eOperationDeferredKHR || result == vk::Result::eNotReady) {
+        uint32_t helper_count = 0u;
+        if (scheduler) {
+            uint32_t max_concurrency = m_device.getDeferredOperationMaxConcurrencyKHR(operation);
+            helper_count = std::min(std::max(max_concurrency, 1u) - 1u, static_cast<uint32_t>(scheduler->config().workerThread.count));
+        }
+        marl::WaitGroup helpers(helper_count);
+        for (uint32_t i = 0u; i < helper_count; i++) {
+            marl::schedule([this, operation, helpers] {
+                static_cast<void>(m_device.deferredOperationJoinKHR(operation));
+                helpers.done();
+                });
+        }
+        static_cast<void>(m_device.deferredOperationJoinKHR(operation));
+        helpers.wait();
+        result = m_device.getDeferredOperationResultKHR(operation);
+    }
+    m_device.destroyDeferredOperationKHR(operation);
+    if (result != vk::Result::eSuccess && result != vk::Result::eOperationNotDeferredKHR) {
+        throw std::runtime_error(fmt::format("Failed to create ray tracing pipeline: {}", vk::to_string(result)));
+    }
+    return new_pipeline;
+}
+
+vk::Pipeline Raytracing_pipeline::create_pipeline(const Shaders& shaders, const Raymarch_settings& settings, std::vector<vk::Pipeline>& retired_libraries)
+{
+    // Same ids as the constant_id in the shaders
+    struct Specialization_data
+    {
+        float advance_ratio;
+        float advance_ratio_miss;
+        int32_t max_steps;
+        int32_t max_steps_miss;
+        float angle_black;
+        float angle_ms;
+        vk::Bool32 sample_2;
     };
-    std::vector groups{
-        // Raygens (0)
-        vk::RayTracingShaderGroupCreateInfoKHR{
-            .type = vk::RayTracingShaderGroupTypeKHR::eGeneral,
-            .generalShader = 0, // Raygen shader id
-            .closestHitShader = VK_SHADER_UNUSED_KHR,
-            .anyHitShader = VK_SHADER_UNUSED_KHR,
-            .intersectionShader = VK_SHADER_UNUSED_KHR },
-        // Miss (1 and 2)
-        vk::RayTracingShaderGroupCreateInfoKHR{
-            .type = vk::RayTracingShaderGroupTypeKHR::eGeneral,
-            .generalShader = 1, // miss shader id
-            .closestHitShader = VK_SHADER_UNUSED_KHR,
-            .anyHitShader = VK_SHADER_UNUSED_KHR,
-            .intersectionShader = VK_SHADER_UNUSED_KHR},
-        vk::RayTracingShaderGroupCreateInfoKHR{
-            .type = vk::RayTracingShaderGroupTypeKHR::eGeneral,
-            .generalShader = 2, // miss shader id
-            .closestHitShader = VK_SHADER_UNUSED_KHR,
-            .anyHitShader = VK_SHADER_UNUSED_KHR,
-            .intersectionShader = VK_SHADER_UNUSED_KHR},
+    Specialization_data specialization_data{
+        .advance_ratio = settings.advance_ratio,
+        .advance_ratio_miss = settings.advance_ratio_miss,
+        .max_steps = settings.max_steps,
+        .max_steps_miss = settings.max_steps_miss,
+        .angle_black = settings.angle_black,
+        .angle_ms = settings.angle_ms,
+        .sample_2 = settings.sample_2 ? VK_TRUE : VK_FALSE
+    };
+    std::vector<vk::SpecializationMapEntry> map_entries;
+    auto add_entry = [&map_entries](uint32_t constant_id, uint32_t offset, size_t size) {
+        map_entries.push_back(vk::SpecializationMapEntry{ .constantID = constant_id, .offset = offset, .size = size });
+    };
+    // Without entry, the advance ratios keep the value defined in the scene shaders
+    if (settings.override_advance_ratio) {
+        add_entry(0u, offsetof(Specialization_data, advance_ratio), sizeof(float));
+    }
+    if (settings.override_advance_ratio_miss) {
+        add_entry(1u, offsetof(Specialization_data, advance_ratio_miss), sizeof(float));
+    }
+    add_entry(2u, offsetof(Specialization_data, max_steps), sizeof(int32_t));
+    add_entry(3u, offsetof(Specialization_data, max_steps_miss), sizeof(int32_t));
+    add_entry(4u, offsetof(Specialization_data, angle_black), sizeof(float));
+    add_entry(5u, offsetof(Specialization_data, angle_ms), sizeof(float));
+    add_entry(6u, offsetof(Specialization_data, sample_2), sizeof(vk::Bool32));
+    // Entries not used by a stage are ignored, so every stage can share it
+    vk::SpecializationInfo specialization_info{
+        .mapEntryCount = static_cast<uint32_t>(map_entries.size()),
+        .pMapEntries = map_entries.data(),
+        .dataSize = sizeof(Specialization_data),
+        .pData = &specialization_data
     };
-    nb_group_miss = 2u;
-    nb_group_primary = scene.shaders.groups.size();
-
-    shader_stages.reserve(shader_stages.size() + 4 * nb_group_primary);
-    groups.reserve(groups.size() + 3 * nb_group_primary);
-    uint32_t id = static_cast<uint32_t>(shader_stages.size());
 
-    for (const auto shader_group : scene.shaders.groups) {
+    auto start_time = std::chrono::steady_clock::now();
+    vk::Pipeline new_pipeline;
+    size_t nb_libraries_built = 0u;
+    if (m_use_libraries) {
+        new_pipeline = create_pipeline_from_libraries(shaders, settings, specialization_info, retired_libraries, nb_libraries_built);
+    }
+    else {
+        std::vector<vk::PipelineShaderStageCreateInfo> shader_stages;
+        std::vector<vk::RayTracingShaderGroupCreateInfoKHR> groups;
+        shader_stages.reserve(4 + 4 * nb_group_primary);
+        groups.reserve(1 + nb_group_miss + 3 * nb_group_primary);
+        add_raygen_miss_stages(shaders, settings.variant, specialization_info, shader_stages, groups);
         shader_stages.push_back(vk::PipelineShaderStageCreateInfo{
             .stage = vk::ShaderStageFlagBits::eIntersectionKHR,
-            .module = shader_group.primary_intersection.module,
-            .pName = "main" });
-        shader_stages.push_back(vk::PipelineShaderStageCreateInfo{
-            .stage = vk::ShaderStageFlagBits::eClosestHitKHR,
-            .module = shader_group.primary_closest_hit.module,
-            .pName = "main" });
-        shader_stages.push_back(vk::PipelineShaderStageCreateInfo{
-            .stage = vk::ShaderStageFlagBits::eAnyHitKHR,
-            .module = shader_group.shadow_any_hit.module,
-            .pName = "main" });
-        shader_stages.push_back(vk::PipelineShaderStageCreateInfo{
-            .stage = vk::ShaderStageFlagBits::eAnyHitKHR,
-            .module = shader_group.ao_any_hit.module,
-            .pName = "main" });
-
-        groups.push_back(vk::RayTracingShaderGroupCreateInfoKHR{  // Primary
-            .type = vk::RayTracingShaderGroupTypeKHR::eProceduralHitGroup,
-            .generalShader = VK_SHADER_UNUSED_KHR,
-            .closestHitShader = id + 1,
-            .anyHitShader = VK_SHADER_UNUSED_KHR,
-            .intersectionShader = id });
-        groups.push_back(vk::RayTracingShaderGroupCreateInfoKHR{  // Shadow
-            .type = vk::RayTracingShaderGroupTypeKHR::eProceduralHitGroup,
-            .generalShader = VK_SHADER_UNUSED_KHR,
-            .closestHitShader = VK_SHADER_UNUSED_KHR,
-            .anyHitShader = id + 2,
-            .intersectionShader = 3 });
-        groups.push_back(vk::RayTracingShaderGroupCreateInfoKHR{  // AO
-            .type = vk::RayTracingShaderGroupTypeKHR::eProceduralHitGroup,
-            .generalShader = VK_SHADER_UNUSED_KHR,
-            .closestHitShader = VK_SHADER_UNUSED_KHR,
-            .anyHitShader = id + 3,
-            .intersectionShader = 3 });
-        id += 4;
-    }
+            .module = shaders.shadow_intersection.module(settings.variant),
+            .pName = "main",
+            .pSpecializationInfo = &specialization_info });
+        const uint32_t shadow_intersection_id = 3u;
+        for (const auto& shader_group : shaders.groups) {
+            add_group_stages(shader_group, settings.variant, shadow_intersection_id, specialization_info, shader_stages, groups);
+        }
 
-    pipeline = m_device.createRayTracingPipelineKHR(
-        nullptr, nullptr,
-        vk::RayTracingPipelineCreateInfoKHR{
+        new_pipeline = create_raytracing_pipeline(vk::RayTracingPipelineCreateInfoKHR{
             //.flags = vk::PipelineCreateFlagBits::eRayTracingSkipTrianglesKHR,
             .stageCount = static_cast<uint32_t>(shader_stages.size()),
             .pStages = shader_stages.data(),
             .groupCount = static_cast<uint32_t>(groups.size()),
             .pGroups = groups.data(),
-            .maxPipelineRayRecursionDepth = 4, //raytracing_properties.maxRayRecursionDepth, // * std::min(4u, raytracing_properties.maxRayRecursionDepth),
-            .layout = pipeline_layout }).value;
+            .maxPipelineRayRecursionDepth = max_recursion_depth, //raytracing_properties.maxRayRecursionDepth, // * std::min(4u, raytracing_properties.maxRayRecursionDepth),
+            .layout = pipeline_layout });
+    }
+    std::chrono::duration<float, std::milli> creation_time = std::chrono::steady_clock::now() - start_time;
+    if (m_use_libraries) {
+        fmt::print("Ray tracing pipeline linked in {:.1f} ms, {}/{} libraries rebuilt (pipeline cache {} bytes)\n",
+            creation_time.count(), nb_libraries_built, 1u + m_group_libraries.size(), m_device.getPipelineCacheData(m_pipeline_cache).size());
+    }
+    else {
+        fmt::print("Ray tracing pipeline created in {:.1f} ms (pipeline cache {} bytes)\n",
+            creation_time.count(), m_device.getPipelineCacheData(m_pipeline_cache).size());
+    }
+    return new_pipeline;
+}
+
+void Raytracing_pipeline::add_raygen_miss_stages(
+    const Shaders& shaders, Shader_variant variant, const vk::SpecializationInfo& specialization_info,
+    std::vector<vk::PipelineShaderStageCreateInfo>& shader_stages, std::vector<vk::RayTracingShaderGroupCreateInfoKHR>& groups)
+{
+    auto id = static_cast<uint32_t>(shader_stages.size());
+    shader_stages.push_back(vk::PipelineShaderStageCreateInfo{
+        .stage = vk::ShaderStageFlagBits::eRaygenKHR,
+        .module = shaders.raygen.module(variant),
+        .pName = "main",
+        .pSpecializationInfo = &specialization_info });
+    shader_stages.push_back(vk::PipelineShaderStageCreateInfo{
+        .stage = vk::ShaderStageFlagBits::eMissKHR,
+        .module = shaders.primary_miss.module(variant),
+        .pName = "main",
+        .pSpecializationInfo = &specialization_info });
+    shader_stages.push_back(vk::PipelineShaderStageCreateInfo{
+        .stage = vk::ShaderStageFlagBits::eMissKHR,
+        .module = shaders.shadow_miss.module(variant),
+        .pName = "main",
+        .pSpecializationInfo = &specialization_info });
+
+    // Raygen (0) then miss (1 and 2)
+    for (uint32_t i = 0u; i < 3u; i++) {
+        groups.push_back(vk::RayTracingShaderGroupCreateInfoKHR{
+            .type = vk::RayTracingShaderGroupTypeKHR::eGeneral,
+            .generalShader = id + i,
+            .closestHitShader = VK_SHADER_UNUSED_KHR,
+            .anyHitShader = VK_SHADER_UNUSED_KHR,
+            .intersectionShader = VK_SHADER_UNUSED_KHR });
+    }
 }
 
-}
\ No newline at end of file
+void Raytracing_pipeline::add_group_stages(
+    const Shader_group& shader_group, Shader_variant variant, uint32_t shadow_intersection_id, const vk::SpecializationInfo& specialization_info,
+    std::vector<vk::PipelineShaderStageCreateInfo>& shader_stages, std::vector<vk::RayTracingShaderGroupCreateInfoKHR>& groups)
+{
+    auto id = static_cast<uint32_t>(shader_stages.size());
+    shader_stages.push_back(vk::PipelineShaderStageCreateInfo{
+        .stage = vk::ShaderStageFlagBits::eIntersectionKHR,
+        .module = shader_group.primary_intersection.module(variant),
+        .pName = "main",
+        .pSpecializationInfo = &specialization_info });
+    shader_stages.push_back(vk::PipelineShaderStageCreateInfo{
+        .stage = vk::ShaderStageFlagBits::eClosestHitKHR,
+        .module = shader_group.primary_closest_hit.module(variant),
+        .pName = "main",
+        .pSpecializationInfo = &specialization_info });
+    shader_stages.push_back(vk::PipelineShaderStageCreateInfo{
+        .stage = vk::ShaderStageFlagBits::eAnyHitKHR,
+        .module = shader_group.shadow_any_hit.module(variant),
+        .pName = "main",
+        .pSpecializationInfo = &specialization_info });
+    shader_stages.push_back(vk::PipelineShaderStageCreateInfo{
+        .stage = vk::ShaderStageFlagBits::eAnyHitKHR,
+        .module = shader_group.ao_any_hit.module(variant),
+        .pName = "main",
+        .pSpecializationInfo = &specialization_info });
+
+    groups.push_back(vk::RayTracingShaderGroupCreateInfoKHR{  // Primary
+        .type = vk::RayTracingShaderGroupTypeKHR::eProceduralHitGroup,
+        .generalShader = VK_SHADER_UNUSED_KHR,
+        .closestHitShader = id + 1,
+        .anyHitShader = VK_SHADER_UNUSED_KHR,
+        .intersectionShader = id });
+    groups.push_back(vk::RayTracingShaderGroupCreateInfoKHR{  // Shadow
+        .type = vk::RayTracingShaderGroupTypeKHR::eProceduralHitGroup,
+        .generalShader = VK_SHADER_UNUSED_KHR,
+        .closestHitShader = VK_SHADER_UNUSED_KHR,
+        .anyHitShader = id + 2,
+        .intersectionShader = shadow_intersection_id });
+    groups.push_back(vk::RayTracingShaderGroupCreateInfoKHR{  // AO
+        .type = vk::RayTracingShaderGroupTypeKHR::eProceduralHitGroup,
+        .generalShader = VK_SHADER_UNUSED_KHR,
+        .closestHitShader = VK_SHADER_UNUSED_KHR,
+        .anyHitShader = id + 3,
+        .intersectionShader = shadow_intersection_id });
+}
+
+vk::Pipeline Raytracing_pipeline::create_library(
+    const std::vector<vk::PipelineShaderStageCreateInfo>& shader_stages,
+    const std::vector<vk::RayTracingShaderGroupCreateInfoKHR>& groups)
+{
+    return create_raytracing_pipeline(vk::RayTracingPipelineCreateInfoKHR{
+        .flags = vk::PipelineCreateFlagBits::eLibraryKHR,
+        .stageCount = static_cast<uint32_t>(shader_stages.size()),
+        .pStages = shader_stages.data(),
+        .groupCount = static_cast<uint32_t>(groups.size()),
+        .pGroups = groups.data(),
+        .maxPipelineRayRecursionDepth = max_recursion_depth,
+        .pLibraryInterface = &m_library_interface,
+        .layout = pipeline_layout });
+}
+
+vk::Pipeline Raytracing_pipeline::create_pipeline_from_libraries(
+    const Shaders& shaders, const Raymarch_settings& settings, const vk::SpecializationInfo& specialization_info,
+    std::vector<vk::Pipeline>& retired_libraries, size_t& nb_libraries_built)
+{
+    // Specialization constants are baked in every library
+    bool rebuild_all = settings != m_library_settings;
+    m_library_settings = settings;
+
+    std::vector<vk::PipelineShaderStageCreateInfo> shader_stages;
+    std::vector<vk::RayTracingShaderGroupCreateInfoKHR> groups;
+    // Replaced libraries are only destroyed with the pipeline linked from them
+    auto retire = [&retired_libraries](vk::Pipeline library) {
+        if (library) {
+            retired_libraries.push_back(library);
+        }
+    };
+
+    // Raygen and miss library, its groups come first like in the monolithic pipeline
+    std::vector<uint32_t> revisions{ shaders.raygen.revision, shaders.primary_miss.revision, shaders.shadow_miss.revision };
+    if (rebuild_all || !m_base_library.pipeline || revisions != m_base_library.revisions) {
+        add_raygen_miss_stages(shaders, settings.variant, specialization_info, shader_stages, groups);
+        retire(m_base_library.pipeline);
+        m_base_library.pipeline = create_library(shader_stages, groups);
+        m_base_library.revisions = std::move(revisions);
+        nb_libraries_built++;
+    }
+
+    // One library per group, with its own copy of the shadow intersection
+    for (size_t i = shaders.groups.size(); i < m_group_libraries.size(); i++) {
+        retire(m_group_libraries[i].pipeline);
+    }
+    m_group_libraries.resize(shaders.groups.size());
+    for (size_t i = 0u; i < shaders.groups.size(); i++) {
+        const auto& shader_group = shaders.groups[i];
+        auto& library = m_group_libraries[i];
+        revisions = {
+            shaders.shadow_intersection.revision,
+            shader_group.primary_intersection.revision,
+            shader_group.primary_closest_hit.revision,
+            shader_group.shadow_any_hit.revision,
+            shader_group.ao_any_hit.revision };
+        if (!rebuild_all && library.pipeline && revisions == library.revisions) {
+            continue;
+        }
+        shader_stages.clear();
+        groups.clear();
+        shader_stages.push_back(vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eIntersectionKHR,
+            .module = shaders.shadow_intersection.module(settings.variant),
+            .pName = "main",
+            .pSpecializationInfo = &specialization_info });
+        add_group_stages(shader_group, settings.variant, 0u, specialization_info, shader_stages, groups);
+        retire(library.pipeline);
+        library.pipeline = create_library(shader_stages, groups);
+        library.revisions = std::move(revisions);
+        nb_libraries_built++;
+    }
+
+    // Final link, groups are numbered in the order of the libraries
+    std::vector<vk::Pipeline> libraries;
+    libraries.reserve(1u + m_group_libraries.size());
+    libraries.push_back(m_base_library.pipeline);
+    for (const auto& library : m_group_libraries) {
+        libraries.push_back(library.pipeline);
+    }
+    vk::PipelineLibraryCreateInfoKHR library_info{
+        .libraryCount = static_cast<uint32_t>(libraries.size()),
+        .pLibraries = libraries.data()
+    };
+    return create_raytracing_pipeline(vk::RayTracingPipelineCreateInfoKHR{
+        .maxPipelineRayRecursionDepth = max_recursion_depth,
+        .pLibraryInfo = &library_info,
+        .pLibraryInterface = &m_library_interface,
+        .layout = pipeline_layout });
+}
+
+void Raytracing_pipeline::load_pipeline_cache()
+{
+    std::vector<uint8_t> initial_data;
+    std::ifstream file(m_pipeline_cache_path, std::ios::binary);
+    Pipeline_cache_header header{};
+    if (file.is_open() && file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        bool valid = header.magic == pipeline_cache_magic &&
+            header.vendor_id == m_device_properties.vendorID &&
+            header.device_id == m_device_properties.deviceID &&
+            header.driver_version == m_device_properties.driverVersion &&
+            std::equal(header.pipeline_cache_uuid.cbegin(), header.pipeline_cache_uuid.cend(), m_device_properties.pipelineCacheUUID.begin());
+        // The size comes from the file, it must match the rest of it before anything is allocated
+        std::streamoff data_start = file.tellg();
+        file.seekg(0, std::ios::end);
+        std::streamoff remaining = file.tellg() - data_start;
+        file.seekg(data_start);
+        if (valid && (!file || remaining < 0 || header.data_size != static_cast<uint64_t>(remaining))) {
+            fmt::print("Pipeline cache truncated or corrupt, ignored\n");
+        }
+        else if (valid) {
+            initial_data.resize(header.data_size);
+            file.read(reinterpret_cast<char*>(initial_data.data()), static_cast<std::streamsize>(initial_data.size()));
+            if (!file || file.gcount() != static_cast<std::streamsize>(initial_data.size())) {
+                fmt::print("Pipeline cache could not be read, ignored\n");
+                initial_data.clear();
+            }
+        }
+        else {
+            fmt::print("Pipeline cache created with another device or driver, ignored\n");
+        }
+    }
+    if (initial_data.empty()) {
+        fmt::print("No pipeline cache, the first pipeline creation will be slower\n");
+    }
+    else {
+        fmt::print("Pipeline cache loaded: {} bytes\n", initial_data.size());
+    }
+    m_pipeline_cache = m_device.createPipelineCache(vk::PipelineCacheCreateInfo{
+        .initialDataSize = initial_data.size(),
+        .pInitialData = initial_data.data() });
+}
+
+void Raytracing_pipeline::save_pipeline_cache()
+{
+    auto data = m_device.getPipelineCacheData(m_pipeline_cache);
+    Pipeline_cache_header header{
+        .magic = pipeline_cache_magic,
+        .vendor_id = m_device_properties.vendorID,
+        .device_id = m_device_properties.deviceID,
+        .driver_version = m_device_properties.driverVersion,
+        .data_size = data.size()
+    };
+    std::copy(m_device_properties.pipelineCacheUUID.begin(), m_device_properties.pipelineCacheUUID.end(), header.pipeline_cache_uuid.begin());
+
+    // Avoid leaving a truncated cache if the application is killed while writing
+    auto temp_path = m_pipeline_cache_path;
+    temp_path += ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            fmt::print("Warning: can't write pipeline cache {}\n", temp_path.string());
+            return;
+        }
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(data.data()), data.size());
+    }
+    std::error_code error;
+    std::filesystem::rename(temp_path, m_pipeline_cache_path, error);
+    if (error) {
+        fmt::print("Warning: can't write pipeline cache {}: {}\n", m_pipeline_cache_path.string(), error.message());
+        return;
+    }
+    fmt::print("Pipeline cache saved: {} bytes\n", data.size());
+}
+
+}
@@ -1,11 +1,15 @@
 #pragma once
 #include "vk_common.hpp"
 #include "vma_buffer.hpp"
+#include "core/shader.hpp"
+#include <array>
 #include <filesystem>
 
 namespace sdf_editor
 {
 struct Scene;
+struct Shaders;
+struct Shader_group;
 }
 namespace sdf_editor::vulkan
 {
@@ -34,12 +38,82 @@ public:
     Raytracing_pipeline& operator=(Raytracing_pipeline&& other) = delete;
     ~Raytracing_pipeline();
 
-    void create_pipeline(Scene& scene);
+    // Replacement pipeline and its shader binding table, built away from the frame thread
+    struct Pipeline_build
+    {
+        vk::Pipeline pipeline;
+        std::vector<vk::Pipeline> retired_libraries;  // Replaced libraries, the current pipeline might still use them
+        Vma_buffer shader_binding_table;
+        Vma_buffer staging;  // Still need to be copied to shader_binding_table
+        float build_time_ms = 0.0f;
+    };
+
+    // Can run on a worker thread while the current pipeline is used, only one build at a time
+    // The shader modules must stay alive until it returns
+    [[nodiscard]] Pipeline_build build_pipeline(const Shaders& shaders, const Raymarch_settings& settings);
+    [[nodiscard]] bool use_libraries() const { return m_use_libraries; }
+    [[nodiscard]] vk::DeviceSize shader_binding_table_size() const { return m_shader_binding_table_size; }
 
     void update_shader_binding_table();
-    std::vector<uint8_t> create_shader_binding_table();
+    [[nodiscard]] std::vector<uint8_t> create_shader_binding_table(vk::Pipeline new_pipeline) const;
 private:
+    // Header written before the driver data, the cache is discarded if the device or driver changed
+    struct Pipeline_cache_header
+    {
+        uint32_t magic;
+        uint32_t vendor_id;
+        uint32_t device_id;
+        uint32_t driver_version;
+        std::array<uint8_t, VK_UUID_SIZE> pipeline_cache_uuid;
+        uint64_t data_size;
+    };
+    static constexpr uint32_t pipeline_cache_magic = 0x53444643;  // "SDFC"
+    static constexpr uint32_t max_recursion_depth = 4u;
+
+    // Compiled part of the pipeline, rebuilt only if one of its shaders changed
+    struct Pipeline_library
+    {
+        vk::Pipeline pipeline;
+        std::vector<uint32_t> revisions;
+    };
+
     vk::Device m_device;
+    VmaAllocator m_allocator;
+    vk::PhysicalDeviceProperties m_device_properties;
+    std::filesystem::path m_pipeline_cache_path{ "pipeline_cache.bin" };
+    vk::PipelineCache m_pipeline_cache;
+    uint32_t m_shader_binding_table_size = 0u;
+
+    // With VK_KHR_pipeline_library, editing a group only recompile its library before linking
+    bool m_use_libraries = false;
+    vk::RayTracingPipelineInterfaceCreateInfoKHR m_library_interface{
+        .maxPipelineRayPayloadSize = 4u * sizeof(float),
+        .maxPipelineRayHitAttributeSize = 2u * sizeof(float)
+    };
+    Raymarch_settings m_library_settings;
+    Pipeline_library m_base_library;
+    std::vector<Pipeline_library> m_group_libraries;
+
+    void load_pipeline_cache();
+    void save_pipeline_cache();
+    void compute_shader_binding_table_layout();
+
+    [[nodiscard]] vk::Pipeline create_pipeline(const Shaders& shaders, const Raymarch_settings& settings, std::vector<vk::Pipeline>& retired_libraries);
+    // Creation is split with a deferred operation so that several threads can work on it
+    [[nodiscard]] vk::Pipeline create_raytracing_pipeline(const vk::RayTracingPipelineCreateInfoKHR& create_info);
+
+    static void add_raygen_miss_stages(
+        const Shaders& shaders, Shader_variant variant, const vk::SpecializationInfo& specialization_info,
+        std::vector<vk::PipelineShaderStageCreateInfo>& shader_stages, std::vector<vk::RayTracingShaderGroupCreateInfoKHR>& groups);
+    static void add_group_stages(
+        const Shader_group& shader_group, Shader_variant variant, uint32_t shadow_intersection_id, const vk::SpecializationInfo& specialization_info,
+        std::vector<vk::PipelineShaderStageCreateInfo>& shader_stages, std::vector<vk::RayTracingShaderGroupCreateInfoKHR>& groups);
+    [[nodiscard]] vk::Pipeline create_library(
+        const std::vector<vk::PipelineShaderStageCreateInfo>& shader_stages,
+        const std::vector<vk::RayTracingShaderGroupCreateInfoKHR>& groups);
+    [[nodiscard]] vk::Pipeline create_pipeline_from_libraries(
+        const Shaders& shaders, const Raymarch_settings& settings, const vk::SpecializationInfo& specialization_info,
+        std::vector<vk::Pipeline>& retired_libraries, size_t& nb_libraries_built);
 };
 
 }
@@ -3,7 +3,12 @@
 #include "command_buffer.hpp"
 #include "vr/vr_swapchain.hpp"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <iostream>
+#include <fmt/core.h>
+#include <marl/scheduler.h>
 #undef MemoryBarrier
 
 namespace sdf_editor::vulkan
@@ -13,69 +18,254 @@ Renderer::Renderer(Context& context, Scene& scene, size_t command_pool_size) :
     m_device(context.device),
     m_allocator(context.allocator),
     m_queue(context.graphics_queue),
+    m_command_pool(context.command_pool),
     m_imgui_render(context, vk::Extent2D{ .width = 1000, .height = 1000 }, command_pool_size),
     m_noise_texture(context, "textures/lut_noise.png"),
     m_scene_texture(context, scene.texture_path.generic_string()),
     m_sampler(context),
     m_pipeline(context, scene, m_sampler.sampler, m_imgui_render.result_sampler.sampler),
-    m_blas(context)
+    m_bounds_estimator(context, m_sampler.sampler, m_noise_texture.image_view),
+    m_timestamp_pool(context.device.createQueryPool(vk::QueryPoolCreateInfo{
+        .queryType = vk::QueryType::eTimestamp,
+        .queryCount = static_cast<uint32_t>(queries_per_pool * command_pool_size) })),
+    m_timestamp_period(context.physical_device.getProperties().limits.timestampPeriod),
+    m_timestamps_written(command_pool_size, false)
 {
-    One_time_command_buffer command_buffer(context.device, context.command_pool, context.graphics_queue);
-    m_blas.build(command_buffer.command_buffer);
+    size_t group_count = scene.shaders.groups.size();
+    m_group_blas.reserve(2u * group_count);
+    for (size_t i = 0u; i < 2u * group_count; i++) {
+        m_group_blas.emplace_back(context);
+    }
+    m_bounds_revisions.resize(group_count);
+    m_primitives_buffer = Vma_buffer(
+        context.device, context.allocator,
+        vk::BufferCreateInfo{
+            .size = sizeof(vk::AabbPositionsKHR) * Bounds_estimator::max_primitives * std::max(2u * group_count, size_t{ 1u }),
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer },
+        VmaAllocationCreateInfo{
+            .flags = VMA_ALLOCATION_CREATE_MAPPED_BIT,
+            .usage = VMA_MEMORY_USAGE_CPU_TO_GPU
+        });
+
+    // Nothing is traced yet, the first bounds are estimated and built right away in the first block
+    One_time_command_buffer command_buffer(m_device, m_command_pool, m_queue);
+    scene.group_blas_addresses.resize(group_count);
+    scene.group_primitive_blocks.resize(group_count);
+    for (size_t i = 0u; i < group_count; i++) {
+        const auto& shader_group = scene.shaders.groups[i];
+        auto boxes = m_bounds_estimator.estimate(shader_group.bounds.module(Shader_variant::quality), scene.scene_global);
+        m_bounds_revisions[i] = shader_group.bounds.revision;
+        fmt::print("Bounds of {}: {} boxes, {:.2f} intersection invocations per ray hitting the unit cube\n",
+            shader_group.name, boxes.size(), Bounds_estimator::invocation_ratio(boxes));
+        m_primitives_buffer.copy(boxes.data(), boxes.size() * sizeof(vk::AabbPositionsKHR), i * Bounds_estimator::max_primitives * sizeof(vk::AabbPositionsKHR));
+        m_group_blas[i].build(command_buffer.command_buffer, boxes, Bounds_estimator::max_primitives);
+        scene.group_blas_addresses[i] = m_group_blas[i].structure_address;
+        scene.group_primitive_blocks[i] = static_cast<uint32_t>(i);
+    }
+    m_primitives_buffer.flush();
     command_buffer.submit_and_wait_idle();
 }
 
 Renderer::~Renderer()
 {
+    if (m_pipeline_build.valid()) {
+        auto build = m_pipeline_build.get();
+        m_device.destroyPipeline(build.pipeline);
+        for (auto library : build.retired_libraries) {
+            m_device.destroyPipeline(library);
+        }
+    }
+    for (auto& retired : m_retired_pipelines) {
+        destroy_retired(retired);
+    }
     for (auto& data : per_frame) {
         m_device.destroyImageView(data.image_view);
     }
+    m_device.destroyQueryPool(m_timestamp_pool);
 }
 
-void Renderer::start_recording(vk::CommandBuffer command_buffer, Scene& scene)
+void Renderer::start_recording(vk::CommandBuffer command_buffer, Scene& scene, size_t command_pool_id)
 {
     command_buffer.begin({ .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
 
-    if (scene.shaders.pipeline_dirty) {
-        m_queue.waitIdle();
-        m_device.destroyPipeline(m_pipeline.pipeline);
-        m_pipeline.create_pipeline(scene);
-        auto temp_buffer_aligned = m_pipeline.create_shader_binding_table();
-        Buffer_from_staged buffer_and_staged(
-            m_device, m_allocator, command_buffer,
-            vk::BufferCreateInfo{
-                .size = temp_buffer_aligned.size(),
-                .usage = vk::BufferUsageFlagBits::eShaderBindingTableKHR | vk::BufferUsageFlagBits::eShaderDeviceAddress
-            },
-            temp_buffer_aligned.data());
-        m_pipeline.shader_binding_table = std::move(buffer_and_staged.result);
-        staging = std::move(buffer_and_staged.staging);
+    // The fence of this command pool was waited on, previous frames recorded with it are done
+    std::erase_if(m_retired_pipelines, [this, command_pool_id](Retired_pipeline& retired) {
+        retired.pending_frames[command_pool_id] = false;
+        if (std::ranges::find(retired.pending_frames, true) != retired.pending_frames.end()) {
+            return false;
+        }
+        destroy_retired(retired);
+        return true;
+    });
+    std::erase_if(m_retired_blocks, [command_pool_id](Retired_block& retired) {
+        retired.pending_frames[command_pool_id] = false;
+        return std::ranges::find(retired.pending_frames, true) == retired.pending_frames.end();
+    });
+
+    auto first_query = static_cast<uint32_t>(queries_per_pool * command_pool_id);
+    if (m_timestamps_written[command_pool_id]) {
+        std::array<uint64_t, queries_per_pool> timestamps{};
+        auto result = m_device.getQueryPoolResults(m_timestamp_pool, first_query, queries_per_pool, sizeof(timestamps), timestamps.data(), sizeof(uint64_t), vk::QueryResultFlagBits::e64);
+        if (result == vk::Result::eSuccess) {
+            m_trace_time_ms = static_cast<float>(timestamps[1] - timestamps[0]) * m_timestamp_period * 1e-6f;
+            m_tlas_time_ms = static_cast<float>(timestamps[3] - timestamps[2]) * m_timestamp_period * 1e-6f;
+        }
+        m_timestamps_written[command_pool_id] = false;
+    }
+    command_buffer.resetQueryPool(m_timestamp_pool, first_query, queries_per_pool);
+
+    update_group_bounds(command_buffer, scene);
+
+    if (m_pipeline_build.valid() && m_pipeline_build.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+        swap_pipeline(command_buffer, scene);
+    }
+
+    // Keep tracing with the current pipeline while the new one is built
+    if (scene.shaders.pipeline_dirty && !m_pipeline_build.valid()) {
         scene.shaders.pipeline_dirty = false;
+        scene.shaders.pipeline_building = true;
+        // The worker thread shares the scheduler of the frame thread, for the joins of the pipeline creation
+        m_pipeline_build = std::async(std::launch::async, [this, &shaders = scene.shaders, settings = scene.shaders.raymarch_settings, scheduler = marl::Scheduler::get()]() {
+            struct Scheduler_binding
+            {
+                explicit Scheduler_binding(marl::Scheduler* bound_scheduler) : bound(bound_scheduler != nullptr) { if (bound) { bound_scheduler->bind(); } }
+                ~Scheduler_binding() { if (bound) { marl::Scheduler::unbind(); } }
+                bool bound;
+            } binding(scheduler);
+            return m_pipeline.build_pipeline(shaders, settings);
+        });
+    }
+}
 
+void Renderer::update_group_bounds(vk::CommandBuffer command_buffer, Scene& scene)
+{
+    if (m_estimated_group) {
+        auto boxes = m_bounds_estimator.poll();
+        if (!boxes) {
+            return;
+        }
+        size_t group = *m_estimated_group;
+        m_estimated_group.reset();
+        // The other block isn't traced by any frame, the current one is until the frames in flight complete
+        uint32_t block = other_block(scene, group);
+        m_primitives_buffer.copy(boxes->data(), boxes->size() * sizeof(vk::AabbPositionsKHR), block * Bounds_estimator::max_primitives * sizeof(vk::AabbPositionsKHR));
+        m_primitives_buffer.flush();
+        m_group_blas[block].build(command_buffer, *boxes, Bounds_estimator::max_primitives);
+        // For the TLAS builds of the next frames, once the Transform_system moved the instances to this block
         command_buffer.pipelineBarrier(
-            vk::PipelineStageFlagBits::eTransfer,
-            vk::PipelineStageFlagBits::eRayTracingShaderKHR,
-            {}, {},
-            vk::BufferMemoryBarrier{
-                .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
-                .dstAccessMask = vk::AccessFlagBits::eShaderRead,
-                .buffer = m_pipeline.shader_binding_table.buffer,
-                .offset = 0u,
-                .size = VK_WHOLE_SIZE
-            }, {});
+            vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+            vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR | vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+            {},
+            vk::MemoryBarrier{
+                .srcAccessMask = vk::AccessFlagBits::eAccelerationStructureWriteKHR,
+                .dstAccessMask = vk::AccessFlagBits::eAccelerationStructureReadKHR },
+            {}, {});
+        m_retired_blocks.push_back(Retired_block{
+            .block = scene.group_primitive_blocks[group],
+            .pending_frames = std::vector<bool>(per_frame.size(), true)
+            });
+        scene.group_primitive_blocks[group] = block;
+        scene.group_blas_addresses[group] = m_group_blas[block].structure_address;
+    }
 
-        /*vk::BufferMemoryBarrier2KHR memory_barrier{
-            .srcStageMask = vk::PipelineStageFlagBits2KHR::e2Transfer,
-            .srcAccessMask = vk::AccessFlagBits2KHR::e2TransferWrite,
-            .dstStageMask = vk::PipelineStageFlagBits2KHR::e2RayTracingShader,
-            .dstAccessMask = vk::AccessFlagBits2KHR::e2ShaderRead,
-            .buffer = m_pipeline.shader_binding_table.buffer
-        };
-        command_buffer.pipelineBarrier2KHR(vk::DependencyInfoKHR{
-            .bufferMemoryBarrierCount = 1,
-            .pBufferMemoryBarriers = &memory_barrier
-            });*/
+    for (size_t i = 0u; i < scene.shaders.groups.size(); i++) {
+        const auto& bounds = scene.shaders.groups[i].bounds;
+        if (bounds.revision == m_bounds_revisions[i] || !bounds.module(Shader_variant::quality)) {
+            continue;
+        }
+        // Wait for the frames still tracing the previous bounds of the group
+        uint32_t block = other_block(scene, i);
+        if (std::ranges::find(m_retired_blocks, block, &Retired_block::block) != m_retired_blocks.end()) {
+            continue;
+        }
+        m_bounds_estimator.start(bounds.module(Shader_variant::quality), scene.scene_global);
+        m_bounds_revisions[i] = bounds.revision;
+        m_estimated_group = i;
+        return;
+    }
+}
+
+uint32_t Renderer::other_block(const Scene& scene, size_t group) const
+{
+    auto group_count = static_cast<uint32_t>(scene.shaders.groups.size());
+    uint32_t block = scene.group_primitive_blocks[group];
+    return block < group_count ? block + group_count : block - group_count;
+}
+
+void Renderer::swap_pipeline(vk::CommandBuffer command_buffer, Scene& scene)
+{
+    auto swap_start = std::chrono::steady_clock::now();
+    auto build = m_pipeline_build.get();
+    scene.shaders.pipeline_building = false;
+
+    // Frames in flight might still use the old pipeline, and this one use the staging buffer
+    m_retired_pipelines.push_back(Retired_pipeline{
+        .pipeline = m_pipeline.pipeline,
+        .libraries = std::move(build.retired_libraries),
+        .shader_binding_table = std::move(m_pipeline.shader_binding_table),
+        .staging = std::move(build.staging),
+        .pending_frames = std::vector<bool>(per_frame.size(), true)
+        });
+    m_pipeline.pipeline = build.pipeline;
+    m_pipeline.shader_binding_table = std::move(build.shader_binding_table);
+
+    command_buffer.copyBuffer(m_retired_pipelines.back().staging.buffer, m_pipeline.shader_binding_table.buffer, vk::BufferCopy{
+        .srcOffset = 0,
+        .dstOffset = 0,
+        .size = m_pipeline.shader_binding_table_size() });
+    command_buffer.pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+        {}, {},
+        vk::BufferMemoryBarrier{
+            .srcAccessMask = vk::AccessFlagBits::eTransferWrite,
+            .dstAccessMask = vk::AccessFlagBits::eShaderRead,
+            .buffer = m_pipeline.shader_binding_table.buffer,
+            .offset = 0u,
+            .size = VK_WHOLE_SIZE
+        }, {});
+
+    /*vk::BufferMemoryBarrier2KHR memory_barrier{
+        .srcStageMask = vk::PipelineStageFlagBits2KHR::e2Transfer,
+        .srcAccessMask = vk::AccessFlagBits2KHR::e2TransferWrite,
+        .dstStageMask = vk::PipelineStageFlagBits2KHR::e2RayTracingShader,
+        .dstAccessMask = vk::AccessFlagBits2KHR::e2ShaderRead,
+        .buffer = m_pipeline.shader_binding_table.buffer
+    };
+    command_buffer.pipelineBarrier2KHR(vk::DependencyInfoKHR{
+        .bufferMemoryBarrierCount = 1,
+        .pBufferMemoryBarriers = &memory_barrier
+        });*/
+
+    std::chrono::duration<float, std::milli> swap_time = std::chrono::steady_clock::now() - swap_start;
+    fmt::print("Pipeline built in {:.1f} ms on a worker thread ({}), frame thread blocked {:.2f} ms for the swap\n",
+        build.build_time_ms, m_pipeline.use_libraries() ? "libraries" : "monolithic", swap_time.count());
+}
+
+void Renderer::wait_pipeline_build(Scene& scene)
+{
+    if (!m_pipeline_build.valid()) {
+        return;
+    }
+    auto build = m_pipeline_build.get();
+    scene.shaders.pipeline_building = false;
+    m_retired_pipelines.push_back(Retired_pipeline{
+        .pipeline = build.pipeline,
+        .libraries = std::move(build.retired_libraries),
+        .shader_binding_table = std::move(build.shader_binding_table),
+        .staging = std::move(build.staging),
+        .pending_frames = std::vector<bool>(per_frame.size(), true)
+        });
+}
+
+void Renderer::destroy_retired(Retired_pipeline& retired)
+{
+    m_device.destroyPipeline(retired.pipeline);
+    for (auto library : retired.libraries) {
+        m_device.destroyPipeline(library);
     }
+    retired.shader_binding_table.free();
+    retired.staging.free();
 }
 
 void Renderer::barrier_vr_swapchain(vk::CommandBuffer command_buffer, vk::Image swapchain_image)
@@ -131,7 +321,26 @@ void Renderer::trace(vk::CommandBuffer command_buffer, Scene& scene, size_t comm
         m_imgui_render.draw(draw_data, command_buffer, command_pool_id);
     }
 
-    per_frame[command_pool_id].tlas.update(command_buffer, scene, false);
+    auto first_query = static_cast<uint32_t>(queries_per_pool * command_pool_id);
+    auto& tlas = per_frame[command_pool_id].tlas;
+    auto previous_structure = tlas.acceleration_structure;
+    command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, m_timestamp_pool, first_query + 2u);
+    tlas.update(command_buffer, scene, false, scene.tlas_stats);
+    command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR, m_timestamp_pool, first_query + 3u);
+    // Reallocated because the instances outgrew it, the set isn't bound yet in this command buffer
+    if (tlas.acceleration_structure != previous_structure) {
+        vk::WriteDescriptorSetAccelerationStructureKHR descriptor_acceleration_structure_info{
+            .accelerationStructureCount = 1u,
+            .pAccelerationStructures = &tlas.acceleration_structure
+        };
+        m_device.updateDescriptorSets(vk::WriteDescriptorSet{
+            .pNext = &descriptor_acceleration_structure_info,
+            .dstSet = m_descriptor_sets[command_pool_id],
+            .dstBinding = 0,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = vk::DescriptorType::eAccelerationStructureKHR }, {});
+    }
     command_buffer.pipelineBarrier(
         vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
         vk::PipelineStageFlagBits::eRayTracingShaderKHR,
@@ -204,6 +413,7 @@ void Renderer::trace(vk::CommandBuffer command_buffer, Scene& scene, size_t comm
         vk::ShaderStageFlagBits::eAnyHitKHR | vk::ShaderStageFlagBits::eClosestHitKHR | vk::ShaderStageFlagBits::eMissKHR, 0,
         sizeof(Scene_global), &scene.scene_global);
 
+    command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, m_timestamp_pool, first_query);
     command_buffer.traceRaysKHR(
         &raygen_shader_entry,
         &miss_shader_entry,
@@ -213,6 +423,8 @@ void Renderer::trace(vk::CommandBuffer command_buffer, Scene& scene, size_t comm
         extent.width,
         extent.height,
         1u);
+    command_buffer.writeTimestamp(vk::PipelineStageFlagBits::eRayTracingShaderKHR, m_timestamp_pool, first_query + 1u);
+    m_timestamps_written[command_pool_id] = true;
 
     //  Img to source
     command_buffer.pipelineBarrier(
@@ -460,28 +672,16 @@ void Renderer::create_per_frame_data(Context& context, Scene& scene, vk::Extent2
                     .layerCount = 1
                 }});
 
-        Vma_buffer material_buffer = Vma_buffer(
-            context.device, context.allocator,
-            vk::BufferCreateInfo{
-                .size = sizeof(Material) * scene.materials.size(),
-                .usage = vk::BufferUsageFlagBits::eStorageBuffer },
-                VmaAllocationCreateInfo {
-                    .flags = VMA_ALLOCATION_CREATE_MAPPED_BIT,
-                    .usage = VMA_MEMORY_USAGE_CPU_TO_GPU
-                });
-        Vma_buffer lights_buffer = Vma_buffer(
-            context.device, context.allocator,
-            vk::BufferCreateInfo{
-                .size = sizeof(Light) * Scene::max_lights,
-                .usage = vk::BufferUsageFlagBits::eStorageBuffer },
-                VmaAllocationCreateInfo{
-                    .flags = VMA_ALLOCATION_CREATE_MAPPED_BIT,
-                    .usage = VMA_MEMORY_USAGE_CPU_TO_GPU
-                });
+        size_t materials_capacity = std::max(scene.materials.size(), initial_materials_capacity);
+        Vma_buffer material_buffer = create_per_frame_buffer(sizeof(Material) * materials_capacity);
+        size_t lights_capacity = std::max(scene.lights.size(), initial_lights_capacity);
+        Vma_buffer lights_buffer = create_per_frame_buffer(sizeof(Light) * lights_capacity);
         per_frame.push_back(Per_frame{
-            .tlas = {command_buffer.command_buffer, context, m_blas, scene},
+            .tlas = {command_buffer.command_buffer, context, scene},
             .materials = std::move(material_buffer),
+            .materials_capacity = materials_capacity,
             .lights = std::move(lights_buffer),
+            .lights_capacity = lights_capacity,
             .storage_image = std::move(image),
             .image_view = image_view
             });
@@ -496,8 +696,50 @@ void Renderer::create_per_frame_data(Context& context, Scene& scene, vk::Extent2
     }
 }
 
+Vma_buffer Renderer::create_per_frame_buffer(vk::DeviceSize size)
+{
+    return Vma_buffer(
+        m_device, m_allocator,
+        vk::BufferCreateInfo{
+            .size = size,
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer },
+            VmaAllocationCreateInfo{
+                .flags = VMA_ALLOCATION_CREATE_MAPPED_BIT,
+                .usage = VMA_MEMORY_USAGE_CPU_TO_GPU
+            });
+}
+
+void Renderer::write_buffer_descriptor(vk::DescriptorSet descriptor_set, uint32_t binding, vk::Buffer buffer)
+{
+    vk::DescriptorBufferInfo buffer_info{
+        .buffer = buffer,
+        .offset = 0u,
+        .range = VK_WHOLE_SIZE
+    };
+    m_device.updateDescriptorSets(vk::WriteDescriptorSet{
+        .dstSet = descriptor_set,
+        .dstBinding = binding,
+        .dstArrayElement = 0,
+        .descriptorCount = 1,
+        .descriptorType = vk::DescriptorType::eStorageBuffer,
+        .pBufferInfo = &buffer_info }, {});
+}
+
 void Renderer::update_per_frame_data(Scene& scene, size_t command_pool_id)
 {
+    // The previous frame of this command pool completed, its buffers can be replaced
+    // The json hot reload can add materials and the UI lights
+    auto& data = per_frame[command_pool_id];
+    if (scene.materials.size() > data.materials_capacity) {
+        data.materials_capacity = std::max(scene.materials.size(), 2u * data.materials_capacity);
+        data.materials = create_per_frame_buffer(sizeof(Material) * data.materials_capacity);
+        write_buffer_descriptor(m_descriptor_sets[command_pool_id], 2u, data.materials.buffer);
+    }
+    if (scene.lights.size() > data.lights_capacity) {
+        data.lights_capacity = std::max(scene.lights.size(), 2u * data.lights_capacity);
+        data.lights = create_per_frame_buffer(sizeof(Light) * data.lights_capacity);
+        write_buffer_descriptor(m_descriptor_sets[command_pool_id], 3u, data.lights.buffer);
+    }
     per_frame[command_pool_id].materials.copy(scene.materials.data(), sizeof(Material) * scene.materials.size());
     per_frame[command_pool_id].lights.copy(scene.lights.data(), sizeof(Light) * scene.lights.size());
     per_frame[command_pool_id].materials.flush();
@@ -546,6 +788,11 @@ void Renderer::create_descriptor_sets(vk::DescriptorPool descriptor_pool, size_t
             .sampler = m_sampler.sampler,
             .imageView = m_scene_texture.image_view,
             .imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal };
+        vk::DescriptorBufferInfo primitives_info{
+            .buffer = m_primitives_buffer.buffer,
+            .offset = 0u,
+            .range = VK_WHOLE_SIZE
+        };
 
         m_device.updateDescriptorSets(std::array{
             vk::WriteDescriptorSet{
@@ -596,7 +843,14 @@ void Renderer::create_descriptor_sets(vk::DescriptorPool descriptor_pool, size_t
                 .dstArrayElement = 0,
                 .descriptorCount = 1,
                 .descriptorType = vk::DescriptorType::eCombinedImageSampler,
-                .pImageInfo = &scene_texture_info}
+                .pImageInfo = &scene_texture_info},
+            vk::WriteDescriptorSet{
+                .dstSet = m_descriptor_sets[i],
+                .dstBinding = 7,
+                .dstArrayElement = 0,
+                .descriptorCount = 1,
+                .descriptorType = vk::DescriptorType::eStorageBuffer,
+                .pBufferInfo = &primitives_info}
             }, {});
     }
 }
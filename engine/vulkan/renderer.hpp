@@ -3,12 +3,16 @@
 
 #include "raytracing_pipeline.hpp"
 #include "acceleration_structure.hpp"
+#include "bounds_estimator.hpp"
 #include "vma_buffer.hpp"
 #include "vma_image.hpp"
 #include "texture.hpp"
 #include "imgui_render.hpp"
 #include "core/scene.hpp"
 
+#include <future>
+#include <optional>
+
 namespace sdf_editor::vulkan
 {
 
@@ -19,7 +23,9 @@ struct Per_frame
     std::vector<Blas> characters_blas;
     Tlas tlas;
     Vma_buffer materials;
+    size_t materials_capacity;
     Vma_buffer lights;
+    size_t lights_capacity;
     Vma_image storage_image;
     vk::ImageView image_view;
 };
@@ -40,7 +46,7 @@ public:
 
     void update_per_frame_data(Scene& scene, size_t command_pool_id);
 
-    void start_recording(vk::CommandBuffer command_buffer, Scene& scene);
+    void start_recording(vk::CommandBuffer command_buffer, Scene& scene, size_t command_pool_id);
     void barrier_vr_swapchain(vk::CommandBuffer command_buffer, vk::Image swapchain_image);
     void trace(vk::CommandBuffer command_buffer, Scene& scene, size_t command_pool_id, vk::Extent2D extent);
     void copy_to_vr_swapchain(vk::CommandBuffer command_buffer, vk::Image swapchain_image, size_t command_pool_id, vk::Extent2D extent);
@@ -49,20 +55,72 @@ public:
     void create_per_frame_data(Context& context, Scene& scene, vk::Extent2D extent, size_t command_pool_size);
     // OpenXR doesn't expose Storage bit so we have to first render to another image and copy
     void create_descriptor_sets(vk::DescriptorPool descriptor_pool, size_t command_pool_size);
+    // Shader modules can't be destroyed while a pipeline build is running
+    void wait_pipeline_build(Scene& scene);
+    // GPU time of the ray tracing dispatch of the last completed frame, 0 until one completed
+    [[nodiscard]] float trace_time_ms() const { return m_trace_time_ms; }
+    // GPU time of the TLAS update of the last completed frame, whether it was skipped, refit or rebuilt
+    [[nodiscard]] float tlas_time_ms() const { return m_tlas_time_ms; }
 private:
+    // Kept until every frame which could use it completed
+    struct Retired_pipeline
+    {
+        vk::Pipeline pipeline;
+        std::vector<vk::Pipeline> libraries;
+        Vma_buffer shader_binding_table;
+        Vma_buffer staging;
+        std::vector<bool> pending_frames;
+    };
+    // BLAS and AABBs of a group replaced by new bounds, reused for the next ones once no frame traces them
+    struct Retired_block
+    {
+        uint32_t block;
+        std::vector<bool> pending_frames;
+    };
+
     vk::Device m_device;
     VmaAllocator m_allocator;
     vk::Queue m_queue;
+    vk::CommandPool m_command_pool;
     Imgui_render m_imgui_render;
     Texture m_noise_texture;
     Texture m_scene_texture;
     Sampler m_sampler;
     Raytracing_pipeline m_pipeline;
-    Blas m_blas;
+    Bounds_estimator m_bounds_estimator;
+    // Two blocks per shader group, a BLAS with the AABBs given by its bounds shader and their copy for the shaders:
+    // the one the instances reference, and the other one where new bounds are built while the frames in flight trace the first
+    // Block b is m_group_blas[b] and the AABBs at b * Bounds_estimator::max_primitives, group g use block g or g + group count
+    std::vector<Blas> m_group_blas;
+    Vma_buffer m_primitives_buffer;
+    std::vector<uint32_t> m_bounds_revisions;
+    std::vector<Retired_block> m_retired_blocks;
+    std::optional<size_t> m_estimated_group;  // Group of the estimate running on the GPU
 
-    Vma_buffer staging;
+    std::future<Raytracing_pipeline::Pipeline_build> m_pipeline_build;
+    std::vector<Retired_pipeline> m_retired_pipelines;
 
     std::vector<vk::DescriptorSet> m_descriptor_sets;
+
+    static constexpr size_t initial_materials_capacity = 16u;
+    static constexpr size_t initial_lights_capacity = 16u;
+    // Timestamps of each command pool, around traceRays then around the TLAS update
+    static constexpr uint32_t queries_per_pool = 4u;
+    vk::QueryPool m_timestamp_pool;
+    float m_timestamp_period;
+    std::vector<bool> m_timestamps_written;
+    float m_trace_time_ms = 0.0f;
+    float m_tlas_time_ms = 0.0f;
+
+    void swap_pipeline(vk::CommandBuffer command_buffer, Scene& scene);
+    // Estimate the bounds of the groups whose bounds shader changed, one at a time without waiting for the GPU,
+    // then build the BLAS of the other block of the group in the command buffer and point the group to it
+    void update_group_bounds(vk::CommandBuffer command_buffer, Scene& scene);
+    [[nodiscard]] uint32_t other_block(const Scene& scene, size_t group) const;
+    void destroy_retired(Retired_pipeline& retired);
+    // Storage buffer written by the CPU each frame
+    [[nodiscard]] Vma_buffer create_per_frame_buffer(vk::DeviceSize size);
+    void write_buffer_descriptor(vk::DescriptorSet descriptor_set, uint32_t binding, vk::Buffer buffer);
 };
 
 }
@@ -17,8 +17,9 @@ public:
     Vma_buffer(vk::Device device, VmaAllocator allocator, vk::BufferCreateInfo buffer_info, VmaAllocationCreateInfo allocation_info);
     ~Vma_buffer();
 
-    void copy(const void* data, size_t size);
+    void copy(const void* data, size_t size, size_t offset = 0u);
     void flush();
+    void read(void* data, size_t size);  // For buffers written by the GPU
     void* map();
     void unmap();
     void free();
@@ -36,9 +37,9 @@ struct Buffer_from_staged
     Vma_buffer staging;
 };
 
-inline void Vma_buffer::copy(const void* data, size_t size)
+inline void Vma_buffer::copy(const void* data, size_t size, size_t offset)
 {
-    memcpy(m_mapped, data, size);
+    memcpy(static_cast<char*>(m_mapped) + offset, data, size);
 }
 
 inline void Vma_buffer::flush()
@@ -46,6 +47,12 @@ inline void Vma_buffer::flush()
     vmaFlushAllocation(m_allocator, m_allocation, 0, VK_WHOLE_SIZE);
 }
 
+inline void Vma_buffer::read(void* data, size_t size)
+{
+    vmaInvalidateAllocation(m_allocator, m_allocation, 0, VK_WHOLE_SIZE);
+    memcpy(data, m_mapped, size);
+}
+
 inline void* Vma_buffer::map()
 {
     vmaMapMemory(m_allocator, m_allocation, &m_mapped);
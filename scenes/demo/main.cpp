@@ -5,7 +5,16 @@
 #include <functional>
 #include <cstdlib>
 
-int main() {
+int main(int argc, char* argv[]) {
+    try {
+        if (sdf_editor::run_command_line_benchmark(argc, argv, demo::make_desktop_app)) {
+            return EXIT_SUCCESS;
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
     demo::Demo demo{};
     try {
         demo.run();
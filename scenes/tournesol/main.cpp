@@ -6,8 +6,17 @@
 #include <cstdlib>
 #include <Windows.h>
 
-int main() {
+int main(int argc, char* argv[]) {
     timeBeginPeriod(1);
+    try {
+        if (sdf_editor::run_command_line_benchmark(argc, argv, tournesol::make_desktop_app)) {
+            return EXIT_SUCCESS;
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
     tournesol::Tournesol tournesol{};
     try {
         tournesol.run();
@@ -73,4 +73,9 @@ Tournesol::Tournesol() :
 {
 }
 
+std::unique_ptr<Desktop_app> make_desktop_app()
+{
+    return std::make_unique<Desktop_app>(make_scene(), SCENE_JSON, SHADER_SOURCE);
+}
+
 }
\ No newline at end of file
@@ -17,4 +17,7 @@ public:
     ~Tournesol() = default;
 };
 
+// The same scene in a desktop window, for the benchmarks
+[[nodiscard]] std::unique_ptr<sdf_editor::Desktop_app> make_desktop_app();
+
 }
\ No newline at end of file
@@ -0,0 +1,235 @@
+#include "core/shader.hpp"
+#include "engine/shader_compiler.hpp"
+#include "engine/shader_dependencies.hpp"
+#include "engine/spirv_optimizer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fmt/core.h>
+#include <marl/defer.h>
+#include <marl/scheduler.h>
+#include <marl/waitgroup.h>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+using namespace sdf_editor;
+
+namespace
+{
+
+struct Options
+{
+    std::filesystem::path engine_directory;
+    std::filesystem::path scene_directory;
+    std::filesystem::path output_directory;
+    std::vector<std::string> groups;
+    bool desktop_mode = false;
+    Spirv_profile profile = Spirv_profile::none;
+    std::optional<std::filesystem::path> cache_directory;
+};
+
+void print_usage()
+{
+    fmt::print(
+        "usage: shader_compiler <engine shader dir> <scene shader dir> <output dir> <group>... [--desktop] [--profile <name>] [--cache <dir>]\n"
+        "  Compile every variant of every stage of the ray tracing pipeline and write <output dir>/<group>_<file>[.<variant>].spv and report.json\n"
+        "  --desktop      compile raygen_desktop.rgen instead of raygen.rgen\n"
+        "  --profile <name>  spirv-tools profile run after shaderc: none (default), performance or size\n"
+        "  --cache <dir>  use a SPIR-V cache, by default every shader is compiled to give comparable timings\n");
+}
+
+Options parse_options(int argc, char* argv[])
+{
+    Options options;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "--desktop") {
+            options.desktop_mode = true;
+        }
+        else if (arg == "--profile") {
+            if (++i == argc) {
+                throw std::runtime_error("--profile need a name");
+            }
+            std::string_view name(argv[i]);
+            size_t profile = 0u;
+            while (profile < spirv_profile_count && name != spirv_profile_name(static_cast<Spirv_profile>(profile))) {
+                profile++;
+            }
+            if (profile == spirv_profile_count) {
+                throw std::runtime_error(fmt::format("Unknown profile {}", name));
+            }
+            options.profile = static_cast<Spirv_profile>(profile);
+        }
+        else if (arg == "--cache") {
+            if (++i == argc) {
+                throw std::runtime_error("--cache need a directory");
+            }
+            options.cache_directory = argv[i];
+        }
+        else if (arg.starts_with("--")) {
+            throw std::runtime_error(fmt::format("Unknown option {}", arg));
+        }
+        else {
+            positional.push_back(std::move(arg));
+        }
+    }
+    if (positional.size() < 4u) {
+        throw std::runtime_error("Missing arguments");
+    }
+    options.engine_directory = positional[0];
+    options.scene_directory = positional[1];
+    options.output_directory = positional[2];
+    options.groups.assign(positional.begin() + 3, positional.end());
+    return options;
+}
+
+std::string_view kind_name(shaderc_shader_kind kind)
+{
+    switch (kind) {
+    case shaderc_raygen_shader: return "raygen";
+    case shaderc_miss_shader: return "miss";
+    case shaderc_intersection_shader: return "intersection";
+    case shaderc_closesthit_shader: return "closest_hit";
+    case shaderc_anyhit_shader: return "any_hit";
+    case shaderc_compute_shader: return "compute";
+    default: return "unknown";
+    }
+}
+
+int run(const Options& options)
+{
+    using Clock = std::chrono::steady_clock;
+
+    Shaders shaders;
+    shaders.engine_files = Shader_compiler::read_directory(options.engine_directory);
+    shaders.scene_files = Shader_compiler::read_directory(options.scene_directory);
+    for (const auto& group : options.groups) {
+        shaders.groups.push_back(Shader_group{ .name = group });
+    }
+    Shader_dependencies dependencies;
+    dependencies.set_files(shaders.engine_files, shaders.scene_files);
+    Shader_compiler::add_shaders(dependencies, shaders, options.desktop_mode);
+
+    Shader_compiler compiler(options.cache_directory);
+    marl::Scheduler scheduler{ marl::Scheduler::Config::allCores() };
+    scheduler.bind();
+    defer(scheduler.unbind());
+
+    // Same task layout as Shader_system: one task per stage and variant
+    auto start_time = Clock::now();
+    Shader_compiler::Translation_units translation_units;
+    std::vector<Shader_compiler::Result> results(dependencies.size() * shader_variant_count);
+    marl::WaitGroup compile_shaders(static_cast<unsigned int>(results.size()));
+    for (size_t result_id = 0u; result_id < results.size(); result_id++) {
+        marl::schedule([&, compile_shaders, result_id]
+            {
+                const auto& node = dependencies.node(static_cast<int>(result_id / shader_variant_count));
+                auto variant = static_cast<Shader_variant>(result_id % shader_variant_count);
+                results[result_id] = compiler.compile(dependencies, shaders.engine_files, shaders.scene_files, translation_units, true,
+                    node.shader->file_id, node.kind, node.group_name, variant, options.profile);
+                compile_shaders.done();
+            });
+    }
+    compile_shaders.wait();
+    std::chrono::duration<float, std::milli> total_time = Clock::now() - start_time;
+
+    std::filesystem::create_directories(options.output_directory);
+    json report_shaders = json::array();
+    size_t error_count = 0u;
+    size_t total_spirv_size = 0u;
+    size_t total_instructions_before = 0u;
+    size_t total_instructions = 0u;
+    for (size_t result_id = 0u; result_id < results.size(); result_id++) {
+        const auto& node = dependencies.node(static_cast<int>(result_id / shader_variant_count));
+        auto variant = static_cast<Shader_variant>(result_id % shader_variant_count);
+        const auto& result = results[result_id];
+        const auto& file_name = shaders.engine_files[node.shader->file_id].name;
+        std::string name = node.group_name.empty() ? file_name : fmt::format("{}_{}", node.group_name, file_name);
+        if (variant != Shader_variant::quality) {
+            name += fmt::format(".{}", shader_variant_name(variant));
+        }
+
+        std::vector<int> includes = result.included_file_id;
+        std::ranges::sort(includes);
+        includes.erase(std::unique(includes.begin(), includes.end()), includes.end());
+
+        size_t spirv_size = 0u;
+        size_t instructions = 0u;
+        if (result.success()) {
+            const auto& code = result.translation_unit->code;
+            spirv_size = sizeof(uint32_t) * code.size();
+            instructions = count_spirv_instructions(code);
+            total_instructions_before += result.translation_unit->instructions_before;
+            total_instructions += instructions;
+            std::ofstream file(options.output_directory / (name + ".spv"), std::ios::trunc | std::ios::binary);
+            if (!file.is_open()) {
+                throw std::runtime_error("failed to open file!");
+            }
+            file.write(reinterpret_cast<const char*>(code.data()), spirv_size);
+            total_spirv_size += spirv_size;
+        }
+        else {
+            error_count++;
+        }
+
+        report_shaders.push_back(json{
+            { "name", name },
+            { "file", file_name },
+            { "group", node.group_name },
+            { "kind", kind_name(node.kind) },
+            { "variant", shader_variant_name(variant) },
+            { "preprocess_time_ms", result.preprocess_time_ms },
+            { "compile_time_ms", result.compile_time_ms },
+            { "optimize_time_ms", result.success() ? result.translation_unit->optimize_time_ms : 0.0f },
+            { "spirv_size", spirv_size },
+            { "instructions_before", result.success() ? result.translation_unit->instructions_before : 0u },
+            { "instructions", instructions },
+            { "include_count", includes.size() },
+            { "error", result.error } });
+    }
+
+    json report;
+    report["shaders"] = report_shaders;
+    report["shader_count"] = dependencies.size();
+    report["variant_count"] = shader_variant_count;
+    report["profile"] = spirv_profile_name(options.profile);
+    report["unique_translation_units"] = translation_units.units.size();
+    report["error_count"] = error_count;
+    report["total_time_ms"] = total_time.count();
+    report["total_spirv_size"] = total_spirv_size;
+    report["total_instructions_before"] = total_instructions_before;
+    report["total_instructions"] = total_instructions;
+    report["cache_hits"] = compiler.cache_hits();
+    report["cache_misses"] = compiler.cache_misses();
+
+    std::ofstream output(options.output_directory / "report.json");
+    output << std::setw(4) << report << std::endl;
+
+    fmt::print("Compiled {} shaders in {} variants ({} unique) in {:.1f} ms, {} errors\n",
+        dependencies.size(), shader_variant_count, translation_units.units.size(), total_time.count(), error_count);
+    return error_count == 0u ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    try {
+        return run(parse_options(argc, argv));
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        print_usage();
+        return EXIT_FAILURE;
+    }
+}